@@ -5,8 +5,22 @@
 
 #include "include/ctrl_database.h"
 
-tNode *ctrlDatabase = NULL;
+static tDatabaseRow *ctrlDatabase[CTRL_DATABASE_CAPACITY]; // ring of rows, slot of a row is TXbase % CTRL_DATABASE_CAPACITY
+static unsigned long firstTXbase = 1; // oldest row in database, all rows from here up to gTXbase-1 are in the ring
 unsigned long gTXbase = 1; // we need this variable because we are not going to keep all sent+acknowledged messages in database like we do on Server implementation
+static unsigned long nextTXbase2server = 1; // where to start looking for next row to send
+static unsigned short unackedCount; // how many rows in database are not acked
+static unsigned short inFlightCount; // how many rows are sent but not acked yet
+
+static char dbArena[CTRL_DATABASE_ARENA_SIZE] __attribute__((aligned(4))); // rows are carved out of here in FIFO order
+static unsigned short arenaHead; // offset of oldest row in arena
+static unsigned short arenaTail; // offset where next row goes
+static unsigned short arenaEnd = CTRL_DATABASE_ARENA_SIZE; // end of used space when rows wrapped to the beginning of arena
+static unsigned short arenaUsed; // bytes taken by rows (without the unused space at the end when wrapped)
+
+static unsigned long dbBytes; // bytes taken by all rows, in arena and on heap
+static unsigned char dbOverBudget; // 1 = refusing rows until dbBytes drops to CTRL_DATABASE_LOW_WATERMARK
+static unsigned long dbRejections;
 
 /*
 	This database model is used to store outgoing messages from this Base -> Server.
@@ -18,264 +32,382 @@ unsigned long gTXbase = 1; // we need this variable because we are not going to
 	whether it can or can't process the next message it will receive from Server.
 */
 
-void ICACHE_FLASH_ATTR ctrl_database_ack_row(unsigned long TXbase)
+// returns row with given TXbase, or NULL if it is not in database
+static tDatabaseRow * ICACHE_FLASH_ATTR ctrl_database_find(unsigned long TXbase)
 {
-	// mark THIS message as acked. also, remove it from QUEUE since there is no point in holding it anymore BUT ONLY IF THERE ARE NO UNACKED TRANSMISSIONS OLDER THAN IT!
-	// we use global TXbase variable to keep track of next TXbase to assign for next row to add so it is quite safe to remove them
+	if(TXbase < firstTXbase || TXbase >= gTXbase)
+	{
+		return NULL;
+	}
 
-	unsigned char canFree = 1;
-	tNode *tmp = ctrlDatabase;
-	while(tmp != NULL)
+	return ctrlDatabase[TXbase % CTRL_DATABASE_CAPACITY];
+}
+
+// bytes taken by row with "len" bytes of data, rounded up to keep rows aligned
+static unsigned short ICACHE_FLASH_ATTR ctrl_database_row_size(unsigned short len)
+{
+	return (sizeof(tDatabaseRow) + len + 3) & ~3;
+}
+
+// takes space for a row with "len" bytes of data from the arena, or from heap if arena is full
+static tDatabaseRow * ICACHE_FLASH_ATTR ctrl_database_alloc_row(unsigned short len)
+{
+	unsigned long size = ctrl_database_row_size(len);
+	tDatabaseRow *row = NULL;
+
+	if(arenaTail >= arenaHead)
 	{
-		if((tmp->row)->TXbase == TXbase)
+		// free space is at the end of arena and in front of the oldest row
+		if(arenaTail + size <= CTRL_DATABASE_ARENA_SIZE)
 		{
-			(tmp->row)->acked = 1;
-			break;
+			row = (tDatabaseRow *)(dbArena + arenaTail);
+			arenaTail += size;
 		}
-		else if((tmp->row)->acked == 0)
+		else if(size < arenaHead)
+		{
+			arenaEnd = arenaTail;
+			row = (tDatabaseRow *)dbArena;
+			arenaTail = size;
+		}
+	}
+	else
+	{
+		// wrapped, free space is between the newest and the oldest row
+		if(arenaTail + size < arenaHead)
 		{
-			canFree = 0;
+			row = (tDatabaseRow *)(dbArena + arenaTail);
+			arenaTail += size;
 		}
-		tmp = tmp->next;
 	}
 
-	if(canFree)
+	if(row != NULL)
 	{
-		ctrl_database_delete_by_TXbase(TXbase);
+		arenaUsed += size;
+		row->inArena = 1;
+		return row;
 	}
-}
 
-// returns next database row from database, and marks it as SENT
-tDatabaseRow * ICACHE_FLASH_ATTR ctrl_database_get_next_txbase2server(void)
-{
-	tNode *tmp = ctrlDatabase;
-	while(tmp != NULL)
+	if(system_get_free_heap_size() < size + CTRL_DATABASE_HEAP_HEADROOM)
 	{
-		if((tmp->row)->sent == 0 && (tmp->row)->acked == 0)
-		{
-			(tmp->row)->sent = 1;
-			return tmp->row;
-		}
-		tmp = tmp->next;
+		return NULL;
 	}
 
-	return NULL;
+	row = (tDatabaseRow *)os_malloc(sizeof(tDatabaseRow) + len);
+	if(row != NULL)
+	{
+		row->inArena = 0;
+	}
+
+	return row;
 }
 
-void ICACHE_FLASH_ATTR ctrl_database_unsend_all(void)
+// releases the row. Rows from the arena must be released in the same order they were taken (oldest first).
+static void ICACHE_FLASH_ATTR ctrl_database_free_row(tDatabaseRow *row)
 {
-	tNode *tmp = ctrlDatabase;
-	while(tmp != NULL)
+	dbBytes -= ctrl_database_row_size(row->len);
+	if(dbOverBudget && dbBytes <= CTRL_DATABASE_LOW_WATERMARK)
 	{
-		(tmp->row)->sent = 0;
-		tmp = tmp->next;
+		dbOverBudget = 0;
 	}
-}
 
-// returns: 1 on error, 0 on success
-unsigned char ICACHE_FLASH_ATTR ctrl_database_add_row(char *data, unsigned short len)
-{
-	if(ctrl_database_count() >= CTRL_DATABASE_CAPACITY)
+	if(!row->inArena)
 	{
-		return 1; // no more memory
+		os_free(row);
+		return;
 	}
 
-	tDatabaseRow *row = (tDatabaseRow *)os_malloc(sizeof(tDatabaseRow));
-	row->TXbase = gTXbase;
-	row->data = (char *)os_malloc(len);
-	os_memcpy(row->data, data, len);
-	row->len = len;
-	row->sent = 0;
-	row->acked = 0;
+	unsigned short size = ctrl_database_row_size(row->len);
 
-	// Increment TXbase to be assigned because to next row... We flush the queue during operation and we need to keep track of last TXbase we've sent out
-	gTXbase++;
+	arenaUsed -= size;
+	arenaHead += size;
 
-	return ctrl_database_add_node(row);
+	if(arenaUsed == 0)
+	{
+		// empty, start from the beginning again
+		arenaHead = 0;
+		arenaTail = 0;
+		arenaEnd = CTRL_DATABASE_ARENA_SIZE;
+	}
+	else if(arenaHead == arenaEnd)
+	{
+		// reached the unused space at the end, oldest row is at the beginning
+		arenaHead = 0;
+		arenaEnd = CTRL_DATABASE_ARENA_SIZE;
+	}
 }
 
-// flushing acknowledged messages until we get to the first unacknowledged (or 'till the end), then we stop
-void ICACHE_FLASH_ATTR ctrl_database_flush_acked(void)
+// returns: 1 when the ACK gives a valid round trip time sample (written to "rtt", in us), 0 otherwise
+unsigned char ICACHE_FLASH_ATTR ctrl_database_ack_row(unsigned long TXbase, unsigned long *rtt)
 {
-	tNode *tmp = ctrlDatabase;
-	while(tmp != NULL)
-	{
-		if((tmp->row)->acked == 1)
-		{
-			tmp = ctrl_database_delete_by_TXbase((tmp->row)->TXbase); // returns the element which pointed to the deleted one so we can continue
-
-			// this should never be NULL in this loop, but who knows...
-			if(tmp == NULL)
-			{
-				return;
-			}
-		}
-		else
-		{
-			break;
-		}
+	// mark THIS message as acked. also, remove it from QUEUE since there is no point in holding it anymore BUT ONLY IF THERE ARE NO UNACKED TRANSMISSIONS OLDER THAN IT!
+	// we use global TXbase variable to keep track of next TXbase to assign for next row to add so it is quite safe to remove them
 
-		tmp = tmp->next;
+	tDatabaseRow *row = ctrl_database_find(TXbase);
+	if(row == NULL || row->acked)
+	{
+		return 0;
 	}
-}
 
-// count number of elements in database
-static unsigned char ICACHE_FLASH_ATTR ctrl_database_count(void)
-{
-	unsigned char count = 0;
+	// Karn's rule: ACK of a re-transmitted row can belong to any of its transmissions, so it is no sample
+	unsigned char sample = 0;
+	if(row->sent && row->sendCount == 1)
+	{
+		*rtt = system_get_time() - row->sentTime;
+		sample = 1;
+	}
 
-	tNode *tmp = ctrlDatabase;
-	while(tmp != NULL)
+	row->acked = 1;
+	unackedCount--;
+	if(row->sent)
 	{
-		count++;
-		tmp = tmp->next;
+		inFlightCount--;
 	}
 
-	return count;
+	ctrl_database_flush_acked();
+
+	return sample;
 }
 
-// count unacked items from DB
-unsigned char ICACHE_FLASH_ATTR ctrl_database_count_unacked_items(void)
+// returns next database row from database, and marks it as SENT
+tDatabaseRow * ICACHE_FLASH_ATTR ctrl_database_get_next_txbase2server(void)
 {
-	unsigned char count = 0;
+	if(nextTXbase2server < firstTXbase)
+	{
+		nextTXbase2server = firstTXbase;
+	}
 
-	tNode *tmp = ctrlDatabase;
-	while(tmp != NULL)
+	while(nextTXbase2server < gTXbase)
 	{
-		if((tmp->row)->acked == 0)
+		tDatabaseRow *row = ctrlDatabase[nextTXbase2server % CTRL_DATABASE_CAPACITY];
+		nextTXbase2server++;
+
+		if(row->sent == 0 && row->acked == 0)
 		{
-			count++;
+			row->sent = 1;
+			row->sentTime = system_get_time();
+			if(row->sendCount < 255)
+			{
+				row->sendCount++;
+			}
+			inFlightCount++;
+			return row;
 		}
-		tmp = tmp->next;
 	}
 
-	return count;
+	return NULL;
 }
 
-void ICACHE_FLASH_ATTR ctrl_database_delete_all(void)
+// returns the oldest row that is sent and waiting for ACK, or NULL if there is none
+tDatabaseRow * ICACHE_FLASH_ATTR ctrl_database_get_oldest_in_flight(void)
 {
-	tNode *pointer = ctrlDatabase;
-	tNode *next;
-
-	while(pointer != NULL)
+	if(inFlightCount == 0)
 	{
-		next = pointer->next;
+		return NULL;
+	}
 
-		if((pointer->row)->data != NULL)
+	unsigned long TXbase;
+	for(TXbase = firstTXbase; TXbase < gTXbase; TXbase++)
+	{
+		tDatabaseRow *row = ctrlDatabase[TXbase % CTRL_DATABASE_CAPACITY];
+		if(row->sent && !row->acked)
 		{
-			os_free((pointer->row)->data);
+			return row;
 		}
-		os_free(pointer->row);
-		os_free(pointer);
-
-		pointer = next;
 	}
 
-	ctrl_database_init();
+	return NULL;
 }
 
-// deletes entry in database by row
-static tNode * ICACHE_FLASH_ATTR ctrl_database_delete_by_TXbase(unsigned long TXbase)
+void ICACHE_FLASH_ATTR ctrl_database_unsend_all(void)
 {
-	// Database empty?
-	if(ctrlDatabase == NULL)
+	unsigned long TXbase;
+	for(TXbase = firstTXbase; TXbase < gTXbase; TXbase++)
 	{
-		return NULL;
+		ctrlDatabase[TXbase % CTRL_DATABASE_CAPACITY]->sent = 0;
+		ctrlDatabase[TXbase % CTRL_DATABASE_CAPACITY]->retries = 0; // all of them are sent again anyway, give them a fresh start
 	}
 
-	tNode *pointer = ctrlDatabase;
-	tNode *temp;
+	nextTXbase2server = firstTXbase;
+	inFlightCount = 0;
+}
 
-	// if found at the first location, don't seek it
-	if((pointer->row)->TXbase == TXbase)
+// marks all rows from TXbase on as not sent, so they are sent again in order
+void ICACHE_FLASH_ATTR ctrl_database_unsend_from(unsigned long TXbase)
+{
+	if(TXbase < firstTXbase)
 	{
-		temp = ctrlDatabase;
-
-		ctrlDatabase = temp->next;
-		pointer = temp->next;
+		TXbase = firstTXbase;
 	}
-	else
-	{
-		// Go to the node for which the node next to it has to be deleted
-		while(pointer->next != NULL && ((pointer->next)->row)->TXbase != TXbase)
-		{
-			pointer = pointer->next;
-		}
 
-		// Element not found in list
-		if(pointer->next == NULL)
+	unsigned long i;
+	for(i = TXbase; i < gTXbase; i++)
+	{
+		tDatabaseRow *row = ctrlDatabase[i % CTRL_DATABASE_CAPACITY];
+		if(row->sent && !row->acked)
 		{
-			return pointer;
+			row->sent = 0;
+			inFlightCount--;
 		}
+	}
 
-		temp = pointer->next;
-		pointer->next = temp->next;
+	if(TXbase < nextTXbase2server)
+	{
+		nextTXbase2server = TXbase;
 	}
+}
 
-	// temp holds the element that must be os_free()-ed
+// returns TXbase of the oldest unacked row, or TXbase the next row will get if all are acked
+unsigned long ICACHE_FLASH_ATTR ctrl_database_first_unacked(void)
+{
+	// acked rows at the beginning are flushed right away, so the first row is always unacked
+	return firstTXbase;
+}
 
-	// free the memory
-	if((temp->row)->data != NULL)
+// returns TXbase of the newest row that was sent (acked or not), or firstTXbase-1 if none was sent
+unsigned long ICACHE_FLASH_ATTR ctrl_database_last_sent(void)
+{
+	unsigned long TXbase;
+	for(TXbase = gTXbase; TXbase > firstTXbase; TXbase--)
 	{
-		os_free((temp->row)->data);
+		tDatabaseRow *row = ctrlDatabase[(TXbase-1) % CTRL_DATABASE_CAPACITY];
+		if(row->sent || row->acked)
+		{
+			return TXbase-1;
+		}
 	}
-	os_free(temp->row);
-	os_free(temp);
 
-	return pointer;
+	return firstTXbase-1;
 }
 
-// add database row to the list
-static unsigned char ICACHE_FLASH_ATTR ctrl_database_add_node(tDatabaseRow *row)
+// marks the row as not sent, use when the row didn't actually make it to the socket
+void ICACHE_FLASH_ATTR ctrl_database_unsend_row(unsigned long TXbase)
 {
-	// create new row
-	tNode *newListItem = (tNode *)os_malloc(sizeof(tNode));
-	if(newListItem == NULL)
+	tDatabaseRow *row = ctrl_database_find(TXbase);
+	if(row == NULL || !row->sent || row->acked)
 	{
-		return 1; // no more memory!
+		return;
 	}
-	newListItem->row = (tDatabaseRow *)os_malloc(sizeof(tDatabaseRow));
-	if(newListItem->row == NULL)
+
+	row->sent = 0;
+	inFlightCount--;
+
+	if(TXbase < nextTXbase2server)
 	{
-		return 1; // no more memory!
+		nextTXbase2server = TXbase;
 	}
-	os_memcpy(newListItem->row, row, sizeof(tDatabaseRow));
-	newListItem->next = NULL;
+}
 
-	tNode *last = (tNode *)ctrl_database_find_last();
-	// list is totally empty?
-	if(last == NULL)
+// returns: one of tDatabaseAddResult, CTRL_DATABASE_ADD_OK (0) on success
+unsigned char ICACHE_FLASH_ATTR ctrl_database_add_row(char *data, unsigned short len)
+{
+	if(ctrl_database_count() >= CTRL_DATABASE_CAPACITY)
 	{
-		ctrlDatabase = newListItem;
+		dbRejections++;
+		return CTRL_DATABASE_ADD_ERR_ROWS;
 	}
-	// add to end of the list
-	else
+
+	unsigned short size = ctrl_database_row_size(len);
+	if(dbOverBudget || dbBytes + size > CTRL_DATABASE_BYTE_BUDGET)
 	{
-		last->next = newListItem;
+		dbOverBudget = 1;
+		dbRejections++;
+		return CTRL_DATABASE_ADD_ERR_BUDGET;
 	}
 
-	return 0;
+	// header and data in one piece
+	tDatabaseRow *row = ctrl_database_alloc_row(len);
+	if(row == NULL)
+	{
+		dbRejections++;
+		return CTRL_DATABASE_ADD_ERR_HEAP;
+	}
+	dbBytes += size;
+
+	row->TXbase = gTXbase;
+	row->len = len;
+	os_memcpy(row->data, data, len);
+	row->sent = 0;
+	row->acked = 0;
+	row->retries = 0;
+	row->sendCount = 0;
+
+	ctrlDatabase[gTXbase % CTRL_DATABASE_CAPACITY] = row;
+	unackedCount++;
+
+	// Increment TXbase to be assigned because to next row... We flush the queue during operation and we need to keep track of last TXbase we've sent out
+	gTXbase++;
+
+	return CTRL_DATABASE_ADD_OK;
 }
 
-// return address of last element in list, or NULL if list is empty
-static tNode * ICACHE_FLASH_ATTR ctrl_database_find_last()
+// flushing acknowledged messages until we get to the first unacknowledged (or 'till the end), then we stop
+void ICACHE_FLASH_ATTR ctrl_database_flush_acked(void)
 {
-	if(ctrlDatabase == NULL)
+	while(firstTXbase < gTXbase)
 	{
-		return NULL;
+		tDatabaseRow *row = ctrlDatabase[firstTXbase % CTRL_DATABASE_CAPACITY];
+		if(!row->acked)
+		{
+			break;
+		}
+
+		ctrl_database_free_row(row);
+		ctrlDatabase[firstTXbase % CTRL_DATABASE_CAPACITY] = NULL;
+
+		firstTXbase++;
 	}
+}
+
+// count number of elements in database
+static unsigned short ICACHE_FLASH_ATTR ctrl_database_count(void)
+{
+	return gTXbase - firstTXbase;
+}
+
+// count unacked items from DB
+unsigned short ICACHE_FLASH_ATTR ctrl_database_count_unacked_items(void)
+{
+	return unackedCount;
+}
 
-	tNode *last = ctrlDatabase;
-	while(last->next != NULL)
+// count items that are sent and waiting for ACK
+unsigned short ICACHE_FLASH_ATTR ctrl_database_count_in_flight(void)
+{
+	return inFlightCount;
+}
+
+void ICACHE_FLASH_ATTR ctrl_database_get_stats(tDatabaseStats *stats)
+{
+	stats->bytes = dbBytes;
+	stats->rows = ctrl_database_count();
+	stats->rejections = dbRejections;
+}
+
+void ICACHE_FLASH_ATTR ctrl_database_delete_all(void)
+{
+	unsigned long TXbase;
+	for(TXbase = firstTXbase; TXbase < gTXbase; TXbase++)
 	{
-		last = last->next;
+		ctrl_database_free_row(ctrlDatabase[TXbase % CTRL_DATABASE_CAPACITY]);
+		ctrlDatabase[TXbase % CTRL_DATABASE_CAPACITY] = NULL;
 	}
 
-	return last;
+	ctrl_database_init();
 }
 
 void ICACHE_FLASH_ATTR ctrl_database_init()
 {
-	ctrlDatabase = NULL;
+	firstTXbase = 1;
 	gTXbase = 1;
+	nextTXbase2server = 1;
+	unackedCount = 0;
+	inFlightCount = 0;
+
+	// database is empty, so is the arena and nothing counts against the budget
+	arenaHead = 0;
+	arenaTail = 0;
+	arenaEnd = CTRL_DATABASE_ARENA_SIZE;
+	arenaUsed = 0;
+	dbBytes = 0;
+	dbOverBudget = 0;
 }
@@ -10,6 +10,8 @@
 #include "../misc/include/wifi.h"
 #include "include/ctrl_stack.h"
 #include "include/ctrl_config_server.h"
+#include "include/ctrl_txpool.h"
+#include "include/ctrl_rxpool.h"
 #include "../misc/include/realrtc.h"
 
 #include "include/ctrl_platform.h"
@@ -20,17 +22,48 @@
 		#error You probably forgot to include ctrl_database.h in ctrl_platform.c file?
 	#endif*/
 	os_timer_t tmrDatabaseItemSender;
+	os_timer_t tmrRetransmit;
+	static unsigned char retransmitArmed;
+	static unsigned char rttMeasured; // 0 = no round trip time sample yet
+	static unsigned long srtt; // smoothed round trip time, in ms
+	static unsigned long rttvar; // round trip time variation, in ms
+	static unsigned long rto = CTRL_RTO_INITIAL_MS; // re-transmission timeout, in ms
+	static unsigned char rtoBackoff; // rto is doubled this many times, reset when ACK arrives
+	static unsigned char resyncing; // 1 = we re-sent everything from resyncTXbase on because Server was missing it
+	static unsigned long resyncTXbase;
+	static unsigned long resyncEnd; // newest row that was sent when re-sending from resyncTXbase began
 #else
 	static unsigned long TXbase;
 #endif
 
 os_event_t *taskQueue;
+static tCtrlMessage appQueue[CTRL_APP_QUEUE_LEN]; // messages waiting for user app, data stays where it is
+static unsigned char appQueueFirst;
+static unsigned char appQueueCount;
+static unsigned char appTaskPosted; // 1 = ctrl_platform_task_processor() is already posted and will drain appQueue
+os_timer_t tmrAppTaskPost;
+static unsigned long appProcessUs; // average time user app needs for one message, in us
+static unsigned char backedOff; // 1 = backoff controller told Server to backoff and didn't release it yet
+static unsigned char recvHeld; // 1 = backoff controller stopped reading from the socket (CTRL_FLOW_CONTROL_TCP)
+static tBackoffStats backoffStats;
+os_timer_t tmrBackoffCheck;
 
 os_timer_t tmrConfigChecker;
 struct espconn ctrlConn;
 esp_tcp ctrlTcp;
 os_timer_t tmrLinker;
 static unsigned char tcpReconCount;
+static char *txInFlight = NULL; // frame handed to espconn_sent(), returned to pool in ctrl_platform_sent_cb()
+static tTxQueueItem txQueue[CTRL_TXQUEUE_LEN]; // frames waiting for txInFlight to be written out
+static unsigned char txQueueFirst;
+static unsigned char txQueueCount;
+static unsigned char txAppFrame; // 1 = frame being sent carries application data, it can't take the reserved queue slots
+static tTxOverflowItem *txOverflowFirst; // frames of CTRL stack that didn't fit into txQueue, oldest first
+static tTxOverflowItem *txOverflowLast;
+static char *txHeld = NULL; // write that socket didn't take, it goes out before anything in txQueue
+static unsigned short txHeldLen;
+static char txCoalesceBuff[CTRL_TX_COALESCE_SIZE]; // queued frames glued together for a single write
+static os_timer_t tmrTxCoalesce;
 static tCtrlConnState connState = CTRL_WIFI_CONNECTING;
 
 static tStatusLed statusLed;
@@ -42,7 +75,8 @@ static unsigned char ctrlSynchronized;
 
 tCtrlAppCallbacks ctrlAppCallbacks;
 
-static void ICACHE_FLASH_ATTR ctrl_platform_check_ip(void *arg)
+// starts TCP connection to Server if we have an IP, otherwise waits for ctrl_platform_wifi_event_cb() to get one
+static void ICACHE_FLASH_ATTR ctrl_platform_tcp_connect(void)
 {
     os_timer_disarm(&tmrLinker);
 
@@ -73,31 +107,219 @@ static void ICACHE_FLASH_ATTR ctrl_platform_check_ip(void *arg)
     else
     {
 		statusLed.count = LED_FLASH_NOWIFI;
+		connState = CTRL_WIFI_CONNECTING;
 
-        if(wifi_station_get_connect_status() == STATION_WRONG_PASSWORD ||
-           		wifi_station_get_connect_status() == STATION_NO_AP_FOUND ||
-           		wifi_station_get_connect_status() == STATION_CONNECT_FAIL)
-		{
-            connState = CTRL_WIFI_CONNECTING_ERROR;
-            #ifdef CTRL_LOGGING
-            	os_printf("WIFI CONNECTING ERROR\r\n");
-            #endif
-
-            os_timer_setfn(&tmrLinker, (os_timer_func_t *)ctrl_platform_check_ip, NULL);
-            os_timer_arm(&tmrLinker, 1000, 0); // try now slower
-        }
-        else {
-            connState = CTRL_WIFI_CONNECTING;
-            #ifdef CTRL_LOGGING
-            	os_printf("WIFI CONNECTING...\r\n");
-            #endif
-
-            os_timer_setfn(&tmrLinker, (os_timer_func_t *)ctrl_platform_check_ip, NULL);
-            os_timer_arm(&tmrLinker, 100, 0);
-        }
+		#ifdef CTRL_LOGGING
+			os_printf("WIFI CONNECTING...\r\n");
+		#endif
     }
 }
 
+// Wi-Fi events from SDK drive the connection, TCP connection starts the moment we get an IP
+static void ICACHE_FLASH_ATTR ctrl_platform_wifi_event_cb(System_Event_t *evt)
+{
+	switch(evt->event)
+	{
+		case EVENT_STAMODE_GOT_IP:
+			#ifdef CTRL_LOGGING
+				os_printf("WIFI GOT IP\r\n");
+			#endif
+
+			// waiting for it? TCP connection that keeps failing still waits for its timer
+			if(connState == CTRL_WIFI_CONNECTING || connState == CTRL_WIFI_CONNECTING_ERROR || connState == CTRL_TCP_DISCONNECTED)
+			{
+				ctrl_platform_tcp_connect();
+			}
+			break;
+
+		case EVENT_STAMODE_DISCONNECTED:
+			statusLed.count = LED_FLASH_NOWIFI;
+
+			if(connState == CTRL_TCP_CONNECTED || connState == CTRL_AUTHENTICATED)
+			{
+				// socket is dead now, discon callback reconnects when IP is back
+				ctrl_platform_discon(&ctrlConn);
+			}
+			else if(connState != CTRL_TCP_CONNECTING) // recon callback takes care of that one
+			{
+				os_timer_disarm(&tmrLinker);
+
+				if(wifi_station_get_connect_status() == STATION_WRONG_PASSWORD ||
+						wifi_station_get_connect_status() == STATION_NO_AP_FOUND ||
+						wifi_station_get_connect_status() == STATION_CONNECT_FAIL)
+				{
+					connState = CTRL_WIFI_CONNECTING_ERROR;
+					#ifdef CTRL_LOGGING
+						os_printf("WIFI CONNECTING ERROR\r\n");
+					#endif
+				}
+				else
+				{
+					connState = CTRL_WIFI_CONNECTING;
+					#ifdef CTRL_LOGGING
+						os_printf("WIFI CONNECTING...\r\n");
+					#endif
+				}
+			}
+			break;
+
+		default:
+			break;
+	}
+}
+
+// returns the buffer of the frame that was written to socket back to the transmit pool
+static void ICACHE_FLASH_ATTR ctrl_platform_tx_release(void)
+{
+	if(txInFlight != NULL)
+	{
+		if(txInFlight != txCoalesceBuff)
+		{
+			ctrl_txpool_free(txInFlight);
+		}
+		txInFlight = NULL;
+	}
+}
+
+// writes queued frames to socket, until one write is accepted (we will be called again from sent callback) or queue is empty.
+// As many queued frames as fit into one TCP segment are written together.
+static void ICACHE_FLASH_ATTR ctrl_platform_tx_drain(void)
+{
+	os_timer_disarm(&tmrTxCoalesce);
+
+	while(txInFlight == NULL && (txHeld != NULL || txQueueCount > 0))
+	{
+		char *data;
+		unsigned short len;
+
+		if(txHeld != NULL)
+		{
+			data = txHeld;
+			len = txHeldLen;
+			txHeld = NULL;
+		}
+		else
+		{
+			data = txQueue[txQueueFirst].data;
+			len = txQueue[txQueueFirst].len;
+			txQueueFirst = (txQueueFirst + 1) % CTRL_TXQUEUE_LEN;
+			txQueueCount--;
+
+			if(txQueueCount > 0 && len + txQueue[txQueueFirst].len <= CTRL_TX_COALESCE_SIZE)
+			{
+				// next one fits too, glue them together
+				os_memcpy(txCoalesceBuff, data, len);
+				ctrl_txpool_free(data);
+
+				while(txQueueCount > 0 && len + txQueue[txQueueFirst].len <= CTRL_TX_COALESCE_SIZE)
+				{
+					tTxQueueItem *item = &txQueue[txQueueFirst];
+					os_memcpy(txCoalesceBuff + len, item->data, item->len);
+					len += item->len;
+					ctrl_txpool_free(item->data);
+
+					txQueueFirst = (txQueueFirst + 1) % CTRL_TXQUEUE_LEN;
+					txQueueCount--;
+				}
+
+				data = txCoalesceBuff;
+			}
+
+			// slots were freed, let waiting frames of CTRL stack in
+			ctrl_platform_tx_refill();
+		}
+
+		if(espconn_sent(&ctrlConn, (uint8 *)data, len) == ESPCONN_OK)
+		{
+			txInFlight = data;
+		}
+		else
+		{
+			// socket can't take it right now, keep it and try again a bit later (if connection
+			// is gone instead, ctrl_platform_tx_flush() drops it)
+			#ifdef CTRL_LOGGING
+				os_printf("ctrl_platform_tx_drain - socket busy, will retry\r\n");
+			#endif
+			txHeld = data;
+			txHeldLen = len;
+			os_timer_disarm(&tmrTxCoalesce);
+			os_timer_arm(&tmrTxCoalesce, CTRL_TX_RETRY_MS, 0); // 0 = don't repeat automatically
+			break;
+		}
+	}
+}
+
+// moves frames of CTRL stack that waited on heap into transmit queue, as long as there is room
+static void ICACHE_FLASH_ATTR ctrl_platform_tx_refill(void)
+{
+	while(txOverflowFirst != NULL && txQueueCount < CTRL_TXQUEUE_LEN)
+	{
+		tTxOverflowItem *node = txOverflowFirst;
+
+		tTxQueueItem *item = &txQueue[(txQueueFirst + txQueueCount) % CTRL_TXQUEUE_LEN];
+		item->data = node->data;
+		item->len = node->len;
+		txQueueCount++;
+
+		txOverflowFirst = node->next;
+		if(txOverflowFirst == NULL)
+		{
+			txOverflowLast = NULL;
+		}
+		os_free(node);
+	}
+}
+
+// frames of this event loop turn are all queued now, write them out
+static void ICACHE_FLASH_ATTR ctrl_platform_tx_coalesce_timer(void *arg)
+{
+	ctrl_platform_tx_drain();
+}
+
+// drops frame on its way and all queued frames, sent callback will never arrive for them
+static void ICACHE_FLASH_ATTR ctrl_platform_tx_flush(void)
+{
+	os_timer_disarm(&tmrTxCoalesce);
+	ctrl_platform_tx_release();
+
+	if(txHeld != NULL)
+	{
+		if(txHeld != txCoalesceBuff)
+		{
+			ctrl_txpool_free(txHeld);
+		}
+		txHeld = NULL;
+	}
+
+	while(txQueueCount > 0)
+	{
+		ctrl_txpool_free(txQueue[txQueueFirst].data);
+		txQueueFirst = (txQueueFirst + 1) % CTRL_TXQUEUE_LEN;
+		txQueueCount--;
+	}
+	txQueueFirst = 0;
+
+	while(txOverflowFirst != NULL)
+	{
+		tTxOverflowItem *node = txOverflowFirst;
+		txOverflowFirst = node->next;
+		ctrl_txpool_free(node->data);
+		os_free(node);
+	}
+	txOverflowLast = NULL;
+}
+
+// returns: 1 if next frame will be put into transmit queue by ctrl_send_data_cb(), 0 if it wouldn't
+static unsigned char ICACHE_FLASH_ATTR ctrl_platform_tx_room(unsigned char appFrame)
+{
+	if(txOverflowFirst != NULL)
+	{
+		return 0; // frames of CTRL stack are waiting for room already
+	}
+
+	return txQueueCount < (appFrame ? CTRL_TXQUEUE_LEN - CTRL_TXQUEUE_RESERVED : CTRL_TXQUEUE_LEN);
+}
+
 static void ICACHE_FLASH_ATTR ctrl_platform_recon_cb(void *arg, sint8 err)
 {
     struct espconn *pespconn = (struct espconn *)arg;
@@ -106,6 +328,15 @@ static void ICACHE_FLASH_ATTR ctrl_platform_recon_cb(void *arg, sint8 err)
     	os_printf("ctrl_platform_recon_cb\r\n");
     #endif
 
+	// sent callback will never arrive for the frames that were on their way
+	ctrl_platform_tx_flush();
+
+	#ifdef USE_DATABASE_APPROACH
+		// everything unacked is sent again after reconnect
+		os_timer_disarm(&tmrRetransmit);
+		retransmitArmed = 0;
+	#endif
+
 	connState = CTRL_TCP_DISCONNECTED;
 	statusLed.count = LED_FLASH_CTRLERROR;
 
@@ -142,6 +373,15 @@ static void ICACHE_FLASH_ATTR ctrl_platform_sent_cb(void *arg)
 	/*#ifdef CTRL_LOGGING
     	os_printf("ctrl_platform_sent_cb\r\n");
     #endif*/
+
+	// frame is out, return its buffer to the pool and write the next one
+	ctrl_platform_tx_release();
+	ctrl_platform_tx_drain();
+
+	#ifdef USE_DATABASE_APPROACH
+		// queue has room again, keep pipelining
+		ctrl_database_item_sender(NULL);
+	#endif
 }
 
 static void ICACHE_FLASH_ATTR ctrl_platform_recv_cb(void *arg, char *pdata, unsigned short len)
@@ -169,6 +409,10 @@ static void ICACHE_FLASH_ATTR ctrl_platform_connect_cb(void *arg)
     espconn_regist_recvcb(pespconn, ctrl_platform_recv_cb);
     espconn_regist_sentcb(pespconn, ctrl_platform_sent_cb);
 
+	#ifdef CTRL_TCP_NODELAY
+		espconn_set_opt(pespconn, ESPCONN_NODELAY);
+	#endif
+
 	connState = CTRL_TCP_CONNECTED;
 
 	unsigned char sync = 0;
@@ -178,6 +422,7 @@ static void ICACHE_FLASH_ATTR ctrl_platform_connect_cb(void *arg)
 		// 3. Count pending items to see if we need to tell server to Sync
 		ctrl_database_flush_acked();
 		ctrl_database_unsend_all();
+		resyncing = 0;
 		if(ctrl_database_count_unacked_items() == 0)
 		{
 			sync = 1;
@@ -189,6 +434,8 @@ static void ICACHE_FLASH_ATTR ctrl_platform_connect_cb(void *arg)
 	#endif
 
 	ctrl_stack_authorize(ctrlSetup.baseid, ctrlSetup.aes128Key, sync);
+
+	ctrl_platform_backoff_reset();
 }
 
 static void ICACHE_FLASH_ATTR ctrl_platform_reconnect(struct espconn *pespconn)
@@ -197,7 +444,7 @@ static void ICACHE_FLASH_ATTR ctrl_platform_reconnect(struct espconn *pespconn)
     	os_printf("ctrl_platform_reconnect\r\n");
     #endif
 
-    ctrl_platform_check_ip(NULL);
+    ctrl_platform_tcp_connect();
 }
 
 static void ICACHE_FLASH_ATTR ctrl_platform_discon_cb(void *arg)
@@ -210,6 +457,15 @@ static void ICACHE_FLASH_ATTR ctrl_platform_discon_cb(void *arg)
 
 	connState = CTRL_TCP_DISCONNECTED;
 
+	// sent callback will never arrive for the frames that were on their way
+	ctrl_platform_tx_flush();
+
+	#ifdef USE_DATABASE_APPROACH
+		// everything unacked is sent again after reconnect
+		os_timer_disarm(&tmrRetransmit);
+		retransmitArmed = 0;
+	#endif
+
     if (pespconn == NULL)
     {
 		#ifdef CTRL_LOGGING
@@ -241,6 +497,9 @@ static void ICACHE_FLASH_ATTR ctrl_platform_discon(struct espconn *pespconn)
 }
 
 #ifdef USE_DATABASE_APPROACH
+	// Sends items from database. Items are handed to transmit queue until CTRL_SEND_WINDOW of
+	// them are waiting for ACK or the queue is full. From there on each ACK that arrives and each
+	// completed socket write (ctrl_platform_sent_cb()) lets the next item out.
 	static void ICACHE_FLASH_ATTR ctrl_database_item_sender(void *arg)
 	{
 		os_timer_disarm(&tmrDatabaseItemSender);
@@ -257,16 +516,75 @@ static void ICACHE_FLASH_ATTR ctrl_platform_discon(struct espconn *pespconn)
 			return;
 		}
 
-		// get next item to send from DB, send it and mark as SENT even if it doesn't actually get sent to socket!
-		tDatabaseRow *row = (tDatabaseRow *)ctrl_database_get_next_txbase2server();
-		if(row != NULL)
+		// when Server supports containers, items that are ready go out together in one frame
+		unsigned char maxRecords = (ctrl_stack_capabilities() & CTRL_CAP_CONTAINER) ? CTRL_CONTAINER_MAX_RECORDS : 1;
+		tCtrlMessage batch[CTRL_CONTAINER_MAX_RECORDS];
+		tDatabaseRow *row = NULL;
+
+		while(ctrl_database_count_in_flight() < CTRL_SEND_WINDOW && ctrl_platform_tx_room(1))
 		{
-			ctrl_stack_send(row->data, row->len, row->TXbase, 0);
+			unsigned char count = 0;
+			unsigned short size = 0;
+
+			while(count < maxRecords && ctrl_database_count_in_flight() < CTRL_SEND_WINDOW)
+			{
+				// get next item to send from DB and mark it as SENT
+				row = (tDatabaseRow *)ctrl_database_get_next_txbase2server();
+				if(row == NULL)
+				{
+					break;
+				}
+
+				if(count > 0 && size + 2+1+4+row->len > CTRL_CONTAINER_DATA_SIZE)
+				{
+					// doesn't fit, it goes into the next one
+					ctrl_database_unsend_row(row->TXbase);
+					break;
+				}
+
+				batch[count].header = 0;
+				batch[count].TXsender = row->TXbase;
+				batch[count].data = row->data;
+				batch[count].length = 1+4+row->len;
+				size += 2+batch[count].length;
+				count++;
+			}
+
+			if(count == 0)
+			{
+				break;
+			}
 
-			// set us up to execute again
-			os_timer_arm(&tmrDatabaseItemSender, TMR_ITEMS_SENDER_MS, 0); // 0 = don't repeat automatically
+			txAppFrame = 1;
+			unsigned char ret = ctrl_stack_send_container(batch, count);
+			txAppFrame = 0;
+
+			if(ret)
+			{
+				// socket didn't take them, try again a bit later
+				unsigned char i;
+				for(i=0; i<count; i++)
+				{
+					ctrl_database_unsend_row(batch[i].TXsender);
+				}
+				os_timer_arm(&tmrDatabaseItemSender, TMR_ITEMS_SENDER_MS, 0); // 0 = don't repeat automatically
+				#ifdef CTRL_LOGGING
+					os_printf("ctrl_database_item_sender - send failed, retrying\r\n");
+				#endif
+				return;
+			}
+
+			// make sure the oldest of them is watched
+			if(!retransmitArmed)
+			{
+				ctrl_platform_retransmit_restart();
+			}
+		}
+
+		if(row != NULL)
+		{
 			#ifdef CTRL_LOGGING
-				os_printf("ctrl_database_item_sender - ON again\r\n");
+				os_printf("ctrl_database_item_sender - window or queue full\r\n");
 			#endif
 		}
 		else
@@ -276,9 +594,101 @@ static void ICACHE_FLASH_ATTR ctrl_platform_discon(struct espconn *pespconn)
 			#endif
 		}
 	}
+
+	// updates re-transmission timeout with new round trip time sample (Jacobson/Karels)
+	static void ICACHE_FLASH_ATTR ctrl_platform_rtt_sample(unsigned long rtt)
+	{
+		if(!rttMeasured)
+		{
+			srtt = rtt;
+			rttvar = rtt / 2;
+			rttMeasured = 1;
+		}
+		else
+		{
+			unsigned long delta = (srtt > rtt) ? srtt - rtt : rtt - srtt;
+			rttvar = (3 * rttvar + delta) / 4;
+			srtt = (7 * srtt + rtt) / 8;
+		}
+
+		rto = srtt + 4 * rttvar;
+		if(rto < CTRL_RTO_MIN_MS)
+		{
+			rto = CTRL_RTO_MIN_MS;
+		}
+		else if(rto > CTRL_RTO_MAX_MS)
+		{
+			rto = CTRL_RTO_MAX_MS;
+		}
+	}
+
+	// (re)starts re-transmission timer for the oldest item waiting for ACK, or stops it if there is none
+	// While we don't read from the socket its ACKs can't arrive, the timer is stopped until we read again.
+	static void ICACHE_FLASH_ATTR ctrl_platform_retransmit_restart(void)
+	{
+		os_timer_disarm(&tmrRetransmit);
+		retransmitArmed = 0;
+
+		if(ctrl_database_count_in_flight() == 0 || recvHeld)
+		{
+			return;
+		}
+
+		unsigned long timeout = rto << rtoBackoff;
+		if(timeout > CTRL_RTO_MAX_MS)
+		{
+			timeout = CTRL_RTO_MAX_MS;
+		}
+
+		os_timer_arm(&tmrRetransmit, timeout, 0); // 0 = don't repeat automatically
+		retransmitArmed = 1;
+	}
+
+	// ACK of the oldest item didn't arrive in time, send it again
+	static void ICACHE_FLASH_ATTR ctrl_platform_retransmit_timeout(void *arg)
+	{
+		retransmitArmed = 0;
+
+		if(connState != CTRL_AUTHENTICATED)
+		{
+			return;
+		}
+
+		tDatabaseRow *row = ctrl_database_get_oldest_in_flight();
+		if(row == NULL)
+		{
+			return;
+		}
+
+		if(row->retries >= CTRL_RETRANSMIT_MAX)
+		{
+			#ifdef CTRL_LOGGING
+				os_printf("Re-transmission limit reached, disconnecting!\r\n");
+			#endif
+
+			ctrl_platform_discon(&ctrlConn);
+			return;
+		}
+
+		#ifdef CTRL_LOGGING
+			char tmp[60];
+			os_sprintf(tmp, "Re-transmitting TXbase %u (%u)\r\n", row->TXbase, row->retries+1);
+			os_printf(tmp);
+		#endif
+
+		row->retries++;
+		if((rto << rtoBackoff) < CTRL_RTO_MAX_MS)
+		{
+			rtoBackoff++;
+		}
+
+		ctrl_database_unsend_row(row->TXbase);
+		ctrl_database_item_sender(NULL);
+
+		ctrl_platform_retransmit_restart();
+	}
 #endif
 
-// blinking status led according to the status of system
 static void ICACHE_FLASH_ATTR ctrl_status_led_blinker(void *arg)
 {
 	os_timer_disarm(&(statusLed.tmr));
@@ -310,7 +720,8 @@ static void ICACHE_FLASH_ATTR ctrl_status_led_blinker(void *arg)
 	}
 }
 
-static void ICACHE_FLASH_ATTR ctrl_message_recv_cb(tCtrlMessage *msg)
+// returns: 0 when message was taken, 1 when Server has to send it again later
+static unsigned char ICACHE_FLASH_ATTR ctrl_message_recv_cb(tCtrlMessage *msg)
 {
 	// do something with msg now
 	#ifdef CTRL_LOGGING
@@ -324,7 +735,8 @@ static void ICACHE_FLASH_ATTR ctrl_message_recv_cb(tCtrlMessage *msg)
 	// make a call to ctrl_stack_backoff(1); and it will acknowledge to
 	// any following messages with BACKOFF which will tell server
 	// to re-send that message and postpone sending any following messages
-	// untill we call ctrl_stack_backoff(0);
+	// untill we call ctrl_stack_backoff(0); ctrl_platform_backoff_control()
+	// does that for messages queued for user app.
 
 	// Don't push system messages to user app, they are for private
 	// communication between Base (us) and Server. There is no problem
@@ -336,8 +748,28 @@ static void ICACHE_FLASH_ATTR ctrl_message_recv_cb(tCtrlMessage *msg)
 		// because it might be new timestamp, or some server-stored-variable
 		// we previously requested!
 
+		// Server wants us to re-send unacked messages, optionally from a given TXbase on?
+		if(msg->data[0] == SYSTEM_MESSAGE_RESEND_UNACKED)
+		{
+			#ifdef USE_DATABASE_APPROACH
+				unsigned long resendFrom = ctrl_database_first_unacked();
+				if(msg->length >= 1+4+1+4)
+				{
+					os_memcpy(&resendFrom, msg->data+1, 4); // little endian
+				}
+
+				#ifdef CTRL_LOGGING
+					char tmp[60];
+					os_sprintf(tmp, "Server requested re-send from TXbase %u\r\n", resendFrom);
+					os_printf(tmp);
+				#endif
+
+				ctrl_database_unsend_from(resendFrom);
+				ctrl_database_item_sender(NULL);
+			#endif
+		}
 		// Recently requested variable is arriving from Server?
-		if(msg->data[0] == SYSTEM_MESSAGE_GET_VAR)
+		else if(msg->data[0] == SYSTEM_MESSAGE_GET_VAR)
 		{
 			// we have a Variable!
 			char variableId[4];
@@ -387,37 +819,70 @@ static void ICACHE_FLASH_ATTR ctrl_message_recv_cb(tCtrlMessage *msg)
 		// push message to ctrl-user-application
 		if(ctrlAppCallbacks.message_received != NULL)
 		{
-			// copy message to new memory location. task must free it after it finishes!
-			tCtrlMessage *newMsg = (tCtrlMessage *)os_malloc(sizeof(tCtrlMessage));
-			if(newMsg == NULL)
+			// we backoff Server long before this happens, but messages already on the wire still arrive
+			if(appQueueCount == CTRL_APP_QUEUE_LEN)
 			{
+				// notifications are never sent again, the rest is refused before it gets acknowledged
+				if(msg->header & CH_NOTIFICATION)
+				{
+					backoffStats.dropped++;
+					#ifdef CTRL_LOGGING
+						os_printf("App queue full, ignoring received notification!\r\n");
+					#endif
+					return 0;
+				}
+
+				backoffStats.refused++;
 				#ifdef CTRL_LOGGING
-					os_printf("Out of memory (1)! Ignoring received message.\r\n");
+					os_printf("App queue full, Server will send the message again!\r\n");
 				#endif
+				ctrl_platform_backoff_refuse();
+				return 1;
 			}
+			tCtrlMessage *newMsg = &appQueue[(appQueueFirst + appQueueCount) % CTRL_APP_QUEUE_LEN];
 			os_memcpy(newMsg, msg, sizeof(tCtrlMessage));
 
-			// copy data as well
-			char *newData = (char *)os_malloc(msg->length-1-4);
-			if(newData == NULL)
+			// data stays in its receive pool buffer until task processes it, copy it only if it isn't in one
+			if(msg->length <= 1+4)
 			{
-				#ifdef CTRL_LOGGING
-					os_printf("Out of memory (2)! Ignoring received message.\r\n");
-				#endif
+				newMsg->data = NULL;
 			}
-			os_memcpy(newData, msg->data, msg->length-1-4);
-			newMsg->data = newData;
-
-			// call task that will process it
-			if(!system_os_post(USER_TASK_PRIO_0, 0, (os_param_t)newMsg))
+			else if(ctrl_rxpool_ref(msg->data) != 0)
 			{
-				ctrl_stack_backoff(1);
-				#ifdef CTRL_LOGGING
-					os_printf("All tasks busy, backed off Server!\r\n");
-				#endif
+				char *newData = (char *)os_malloc(msg->length-1-4);
+				if(newData == NULL)
+				{
+					// it isn't acknowledged yet, refuse it just like on full queue
+					if(msg->header & CH_NOTIFICATION)
+					{
+						backoffStats.dropped++;
+						#ifdef CTRL_LOGGING
+							os_printf("Out of memory! Ignoring received notification.\r\n");
+						#endif
+						return 0;
+					}
+
+					backoffStats.refused++;
+					#ifdef CTRL_LOGGING
+						os_printf("Out of memory! Server will send the message again.\r\n");
+					#endif
+					ctrl_platform_backoff_refuse();
+					return 1;
+				}
+				os_memcpy(newData, msg->data, msg->length-1-4);
+				newMsg->data = newData;
 			}
+			appQueueCount++;
+
+			// will we have room for the next one?
+			ctrl_platform_backoff_control();
+
+			// call task that will process it, one posted task drains all queued messages
+			ctrl_platform_task_post(NULL);
 		}
 	}
+
+	return 0;
 }
 
 static void ICACHE_FLASH_ATTR ctrl_message_ack_cb(tCtrlMessage *msg)
@@ -432,6 +897,21 @@ static void ICACHE_FLASH_ATTR ctrl_message_ack_cb(tCtrlMessage *msg)
 	// hendliraj out_of_sync koji nam server moze poslati
 	if((msg->header) & CH_OUT_OF_SYNC)
 	{
+		#ifdef USE_DATABASE_APPROACH
+			// Server was missing rows from resyncTXbase on, so it rejected everything we sent after it as
+			// out of sync too. Those reports are just echoes of what we already re-sent, ignore them.
+			// Rows sent after the re-sending began are not covered by it, their reports count as usual.
+			if(resyncing && msg->TXsender > resyncTXbase && msg->TXsender <= resyncEnd)
+			{
+				#ifdef CTRL_LOGGING
+					char tmp[60];
+					os_sprintf(tmp, "Out of sync echo on TXsender %u, ignoring.\r\n", msg->TXsender);
+					os_printf(tmp);
+				#endif
+				return;
+			}
+		#endif
+
 		#ifdef CTRL_LOGGING
 			os_printf("Server is complaining that we are OUT OF SYNC!\r\n");
 		#endif
@@ -446,8 +926,9 @@ static void ICACHE_FLASH_ATTR ctrl_message_ack_cb(tCtrlMessage *msg)
 				#endif
 
 				os_timer_disarm(&tmrDatabaseItemSender);
+				resyncing = 0;
 
-				// Flush the outgoing queue, that's all we can do about it really.
+				// Re-sending didn't help, flush the outgoing queue, that's all we can do about it really.
 				ctrl_database_delete_all();
 			#endif
 
@@ -466,16 +947,19 @@ static void ICACHE_FLASH_ATTR ctrl_message_ack_cb(tCtrlMessage *msg)
 			#endif
 
 			#ifdef USE_DATABASE_APPROACH
+				// Re-send only what Server is missing: everything from the first unacked row on
+				resyncTXbase = ctrl_database_first_unacked();
+				resyncEnd = ctrl_database_last_sent();
+				resyncing = 1;
+
 				#ifdef CTRL_LOGGING
-					os_printf("Re-sending outgoing queue...\r\n");
+					os_sprintf(tmp, "Re-sending from TXbase %u...\r\n", resyncTXbase);
+					os_printf(tmp);
 				#endif
 
-				// Re-send all unacked outgoing messages, maybe that will resolve the sync problem
 				os_timer_disarm(&tmrDatabaseItemSender);
-
-				ctrl_database_unsend_all();
-
-				os_timer_arm(&tmrDatabaseItemSender, TMR_ITEMS_SENDER_MS, 0); // 0 = don't repeat automatically
+				ctrl_database_unsend_from(resyncTXbase);
+				ctrl_database_item_sender(NULL);
 			#endif
 		}
 	}
@@ -484,7 +968,24 @@ static void ICACHE_FLASH_ATTR ctrl_message_ack_cb(tCtrlMessage *msg)
 		outOfSyncCounter = 0;
 
 		#ifdef USE_DATABASE_APPROACH
-			ctrl_database_ack_row(msg->TXsender);
+			// Server got the row it was missing, we are in sync again
+			if(resyncing && msg->TXsender >= resyncTXbase)
+			{
+				resyncing = 0;
+			}
+
+			unsigned long rtt;
+			if(ctrl_database_ack_row(msg->TXsender, &rtt))
+			{
+				ctrl_platform_rtt_sample(rtt / 1000);
+			}
+
+			// Server is responding, restart re-transmission timer for what is still waiting
+			rtoBackoff = 0;
+			ctrl_platform_retransmit_restart();
+
+			// one less in flight, let the next item out
+			ctrl_database_item_sender(NULL);
 		#endif
 	}
 }
@@ -508,9 +1009,9 @@ static void ICACHE_FLASH_ATTR ctrl_auth_response_cb()
 	#ifdef USE_DATABASE_APPROACH
 		if(ctrl_database_count_unacked_items() > 0)
 		{
-			// start sending pending data right now
-			os_timer_disarm(&tmrDatabaseItemSender);
-			os_timer_arm(&tmrDatabaseItemSender, TMR_ITEMS_SENDER_MS, 0); // 0 = don't repeat automatically
+			// start sending pending data right now, first window of it is queued in this same event loop turn
+			// together with capabilities, keep-alive and timestamp request, so it all goes out in one write
+			ctrl_database_item_sender(NULL);
 		}
 	#endif
 }
@@ -541,11 +1042,62 @@ static char ICACHE_FLASH_ATTR ctrl_send_data_cb(char *data, unsigned short len)
 		os_printf(".\r\n");
 	#endif*/
 
-	return espconn_sent(&ctrlConn, data, len);
+	// wait in queue for frames of this event loop turn to gather up, or for the previous write to complete
+	if(!ctrl_platform_tx_room(txAppFrame))
+	{
+		// application data is kept by its sender and sent again later
+		if(txAppFrame)
+		{
+			#ifdef CTRL_LOGGING
+				os_printf("ctrl_send_data_cb - transmit queue full\r\n");
+			#endif
+			return ESPCONN_MAXNUM;
+		}
+
+		// but ACKs and other frames of CTRL stack are never sent again, they wait on heap
+		tTxOverflowItem *node = (tTxOverflowItem *)os_malloc(sizeof(tTxOverflowItem));
+		if(node == NULL)
+		{
+			#ifdef CTRL_LOGGING
+				os_printf("ctrl_send_data_cb - out of memory\r\n");
+			#endif
+			return ESPCONN_MEM;
+		}
+		node->data = data;
+		node->len = len;
+		node->next = NULL;
+
+		if(txOverflowLast == NULL)
+		{
+			txOverflowFirst = node;
+		}
+		else
+		{
+			txOverflowLast->next = node;
+		}
+		txOverflowLast = node;
+
+		return ESPCONN_OK;
+	}
+
+	tTxQueueItem *item = &txQueue[(txQueueFirst + txQueueCount) % CTRL_TXQUEUE_LEN];
+	item->data = data;
+	item->len = len;
+	txQueueCount++;
+
+	if(txInFlight == NULL && txHeld == NULL && txQueueCount == 1)
+	{
+		// first frame of this turn, sent callback won't come so write them out from timer
+		os_timer_disarm(&tmrTxCoalesce);
+		os_timer_arm(&tmrTxCoalesce, CTRL_TX_COALESCE_MS, 0); // 0 = don't repeat automatically
+	}
+
+	return ESPCONN_OK;
 }
 
 // all user CTRL messages is sent to Server through this function
-// returns: 1 on error, 0 on success
+// returns: 0 on success, 1 when not authenticated/synchronized or on stack error,
+// or tDatabaseAddResult reason when the database refused the message
 unsigned char ICACHE_FLASH_ATTR ctrl_platform_send(char *data, unsigned short len, unsigned char notification)
 {
 	#ifdef CTRL_LOGGING
@@ -563,7 +1115,12 @@ unsigned char ICACHE_FLASH_ATTR ctrl_platform_send(char *data, unsigned short le
 				return 1;
 			}
 
-			return ctrl_stack_send(data, len, 0, 1); // Send notifications immediatelly, no queue and no delivery order here
+			// Send notifications immediatelly, no database and no delivery order here
+			txAppFrame = 1;
+			unsigned char ret = ctrl_stack_send(data, len, 0, 1);
+			txAppFrame = 0;
+
+			return ret;
 		}
 		else
 		{
@@ -576,13 +1133,20 @@ unsigned char ICACHE_FLASH_ATTR ctrl_platform_send(char *data, unsigned short le
 			}
 
 			unsigned char ret = ctrl_database_add_row(data, len);
-			// No point in starting timer if we couldn't add data to DB. If we are not authenticated
-			// or synched the timer itself has that check so no problem starting it now
-			if(ret == 0)
+			// No point in sending if we couldn't add data to DB. If we are not authenticated
+			// or synched the sender itself has that check so no problem calling it now
+			if(ret == CTRL_DATABASE_ADD_OK)
 			{
-				os_timer_disarm(&tmrDatabaseItemSender);
-				os_timer_arm(&tmrDatabaseItemSender, TMR_ITEMS_SENDER_MS, 0); // 0 = don't repeat automatically
+				ctrl_database_item_sender(NULL);
+			}
+			#ifdef CTRL_LOGGING
+			else
+			{
+				tDatabaseStats stats;
+				ctrl_database_get_stats(&stats);
+				os_printf("ctrl_platform_send refused by database (reason %u, %lu bytes in %u rows, %lu rejected)\r\n", ret, stats.bytes, stats.rows, stats.rejections);
 			}
+			#endif
 			return ret;
 		}
 	#else
@@ -594,7 +1158,9 @@ unsigned char ICACHE_FLASH_ATTR ctrl_platform_send(char *data, unsigned short le
 			return 1;
 		}
 
+		txAppFrame = 1;
 		unsigned char ret = ctrl_stack_send(data, len, TXbase, notification);
+		txAppFrame = 0;
 		TXbase++;
 
 		return ret;
@@ -628,10 +1194,186 @@ static void ICACHE_FLASH_ATTR ctrl_platform_config_checker(void *arg)
 	}
 }
 
+// passes a batch of queued messages to user app, and posts itself again if there are more of them
 static void ICACHE_FLASH_ATTR ctrl_platform_task_processor(os_event_t *e) {
-	tCtrlMessage *msg = (tCtrlMessage *)e->par;
-	ctrlAppCallbacks.message_received(msg);
-	os_free(msg);
+	appTaskPosted = 0;
+
+	unsigned char n;
+	for(n=0; n<CTRL_APP_QUEUE_BATCH && appQueueCount > 0; n++)
+	{
+		tCtrlMessage *msg = &appQueue[appQueueFirst];
+
+		unsigned long started = system_get_time();
+		ctrlAppCallbacks.message_received(msg);
+		unsigned long took = system_get_time() - started;
+		appProcessUs = (appProcessUs == 0) ? took : (7*appProcessUs + took) / 8;
+
+		if(msg->data != NULL && ctrl_rxpool_unref(msg->data) != 0)
+		{
+			os_free(msg->data);
+		}
+
+		appQueueFirst = (appQueueFirst + 1) % CTRL_APP_QUEUE_LEN;
+		appQueueCount--;
+	}
+
+	ctrl_platform_backoff_control();
+
+	// let the rest of the system (and socket) run before the next batch
+	ctrl_platform_task_post(NULL);
+}
+
+// posts ctrl_platform_task_processor() if there are queued messages and it isn't posted yet
+// SDK task queue can be full, then it is tried again a bit later. Nothing else would post it while Server is backed off.
+static void ICACHE_FLASH_ATTR ctrl_platform_task_post(void *arg)
+{
+	if(appTaskPosted || appQueueCount == 0)
+	{
+		return;
+	}
+
+	if(system_os_post(USER_TASK_PRIO_0, 0, 0))
+	{
+		appTaskPosted = 1;
+		os_timer_disarm(&tmrAppTaskPost);
+		return;
+	}
+
+	#ifdef CTRL_LOGGING
+		os_printf("Task queue full, posting again later.\r\n");
+	#endif
+
+	os_timer_disarm(&tmrAppTaskPost);
+	os_timer_arm(&tmrAppTaskPost, TMR_APP_TASK_RETRY_MS, 0); // 0 = do not repeat automatically
+}
+
+// backs off Server ahead of time, before we run out of room for messages it sends, and releases it when we catch up
+static void ICACHE_FLASH_ATTR ctrl_platform_backoff_control(void)
+{
+	unsigned long heap = system_get_free_heap_size();
+	unsigned long drainMs = (appQueueCount * appProcessUs) / 1000;
+
+	if(!backedOff)
+	{
+		if(appQueueCount >= CTRL_APP_QUEUE_BACKOFF)
+		{
+			backoffStats.byQueue++;
+		}
+		else if(heap <= CTRL_BACKOFF_HEAP_LOW)
+		{
+			backoffStats.byHeap++;
+		}
+		else if(drainMs >= CTRL_BACKOFF_DRAIN_MS)
+		{
+			backoffStats.byTime++;
+		}
+		else
+		{
+			return;
+		}
+
+		ctrl_platform_backoff_raise();
+		backedOff = 1;
+
+		#ifdef CTRL_LOGGING
+			char tmp[100];
+			os_sprintf(tmp, "Backed off Server! Queue: %u, Heap: %u, Drain: %u ms\r\n", appQueueCount, heap, drainMs);
+			os_printf(tmp);
+		#endif
+	}
+	else if(appQueueCount <= CTRL_APP_QUEUE_RESUME && heap >= CTRL_BACKOFF_HEAP_RESUME && drainMs <= CTRL_BACKOFF_DRAIN_RESUME_MS)
+	{
+		if(ctrl_platform_backoff_release() == 0)
+		{
+			backedOff = 0;
+			backoffStats.released++;
+			os_timer_disarm(&tmrBackoffCheck);
+
+			#ifdef CTRL_LOGGING
+				os_printf("Released Server's backoff.\r\n");
+			#endif
+			return;
+		}
+
+		backoffStats.deferred++; // Server didn't confirm our backoff yet, try again later
+	}
+
+	os_timer_disarm(&tmrBackoffCheck);
+	os_timer_arm(&tmrBackoffCheck, TMR_BACKOFF_CHECK_MS, 0); // 0 = do not repeat automatically
+}
+
+// tells Server to stop sending
+static void ICACHE_FLASH_ATTR ctrl_platform_backoff_raise(void)
+{
+	#ifdef CTRL_FLOW_CONTROL_TCP
+		espconn_recv_hold(&ctrlConn);
+		recvHeld = 1;
+
+		#ifdef USE_DATABASE_APPROACH
+			ctrl_platform_retransmit_restart(); // stops it, no ACK can arrive now
+		#endif
+	#else
+		ctrl_stack_backoff(1);
+	#endif
+}
+
+// Server must send the message we just refused again, and everything it sent after it too
+static void ICACHE_FLASH_ATTR ctrl_platform_backoff_refuse(void)
+{
+	ctrl_stack_backoff(1);
+
+	// backoff controller releases it when we catch up
+	if(!backedOff)
+	{
+		backedOff = 1;
+		os_timer_disarm(&tmrBackoffCheck);
+		os_timer_arm(&tmrBackoffCheck, TMR_BACKOFF_CHECK_MS, 0); // 0 = do not repeat automatically
+	}
+}
+
+// lets Server continue sending
+// returns: 0 on success, 1 when Server didn't confirm our protocol backoff yet
+static unsigned char ICACHE_FLASH_ATTR ctrl_platform_backoff_release(void)
+{
+	// Server's confirmation of protocol backoff (if we refused a message meanwhile) arrives through the socket
+	if(recvHeld)
+	{
+		espconn_recv_unhold(&ctrlConn);
+		recvHeld = 0;
+
+		#ifdef USE_DATABASE_APPROACH
+			ctrl_platform_retransmit_restart(); // ACKs can arrive again, rows waiting for them get a fresh timeout
+		#endif
+	}
+
+	return ctrl_stack_backoff(0);
+}
+
+// backoff of the previous connection went away with it, Server doesn't keep it and new connection isn't held
+static void ICACHE_FLASH_ATTR ctrl_platform_backoff_reset(void)
+{
+	os_timer_disarm(&tmrBackoffCheck);
+	ctrl_stack_backoff(0); // always succeeds after ctrl_stack_authorize()
+	backedOff = 0;
+	recvHeld = 0;
+
+	#ifdef USE_DATABASE_APPROACH
+		ctrl_platform_retransmit_restart();
+	#endif
+
+	// app may still be behind, backoff new connection right away if so
+	ctrl_platform_backoff_control();
+}
+
+// backoff re-check timer, when no message arrives or gets processed to do it
+static void ICACHE_FLASH_ATTR ctrl_platform_backoff_check(void *arg)
+{
+	ctrl_platform_backoff_control();
+}
+
+void ICACHE_FLASH_ATTR ctrl_platform_get_backoff_stats(tBackoffStats *stats)
+{
+	os_memcpy(stats, &backoffStats, sizeof(tBackoffStats));
 }
 
 // entry point to the ctrl platform
@@ -712,21 +1454,37 @@ void ICACHE_FLASH_ATTR ctrl_platform_init(void)
 			os_printf("System initialization done!\r\n");
 		#endif
 
-		// Wait for WIFI connection and start TCP connection
-		os_timer_disarm(&tmrLinker);
-		os_timer_setfn(&tmrLinker, (os_timer_func_t *)ctrl_platform_check_ip, NULL);
-		os_timer_arm(&tmrLinker, 100, 0);
-
 		// set a timer for Status LED blinking
 		statusLed.count = LED_FLASH_NOWIFI;
 		os_timer_disarm(&(statusLed.tmr));
 		os_timer_setfn(&(statusLed.tmr), (os_timer_func_t *)ctrl_status_led_blinker, NULL);
 		os_timer_arm(&(statusLed.tmr), LED_FLASH_FREQUENCY, 0);
 
+		// set a timer that posts the app task again when SDK task queue was full
+		os_timer_disarm(&tmrAppTaskPost);
+		os_timer_setfn(&tmrAppTaskPost, (os_timer_func_t *)ctrl_platform_task_post, NULL);
+
+		// set a timer that re-checks backoff while Server is backed off
+		os_timer_disarm(&tmrBackoffCheck);
+		os_timer_setfn(&tmrBackoffCheck, (os_timer_func_t *)ctrl_platform_backoff_check, NULL);
+
+		// set a timer that writes out frames queued during one event loop turn
+		os_timer_disarm(&tmrTxCoalesce);
+		os_timer_setfn(&tmrTxCoalesce, (os_timer_func_t *)ctrl_platform_tx_coalesce_timer, NULL);
+
 		#ifdef USE_DATABASE_APPROACH
 			// set a timer that will send items from the database (if database approach is used)
 			os_timer_disarm(&tmrDatabaseItemSender);
 			os_timer_setfn(&tmrDatabaseItemSender, (os_timer_func_t *)ctrl_database_item_sender, NULL);
+
+			// set a timer that re-transmits items when their ACKs don't arrive in time
+			os_timer_disarm(&tmrRetransmit);
+			os_timer_setfn(&tmrRetransmit, (os_timer_func_t *)ctrl_platform_retransmit_timeout, NULL);
 		#endif
+
+		// Wait for WIFI connection and start TCP connection, or start it right now if we already have an IP
+		os_timer_disarm(&tmrLinker);
+		wifi_set_event_handler_cb(ctrl_platform_wifi_event_cb);
+		ctrl_platform_tcp_connect();
 	}
 }
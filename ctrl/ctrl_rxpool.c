@@ -0,0 +1,97 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "mem.h"
+
+#include "include/ctrl_rxpool.h"
+
+/*
+	Pool of reference counted receive buffers. The one who takes a buffer holds
+	the first reference, anybody who wants to keep a message from it past the
+	call it got the message in (task queue, reorder buffer) takes another one.
+	Buffer returns to the pool when the last reference is released.
+*/
+
+static char rxPool[CTRL_RXPOOL_COUNT][CTRL_RXPOOL_SIZE] __attribute__((aligned(16)));
+static unsigned char rxPoolRefs[CTRL_RXPOOL_COUNT]; // 0 = free
+
+static tRxPoolStats rxPoolStats;
+
+// returns index of the pool buffer that "ptr" points into, or CTRL_RXPOOL_COUNT if it isn't in the pool
+static unsigned char ICACHE_FLASH_ATTR ctrl_rxpool_index(char *ptr)
+{
+	if(ptr < (char *)rxPool || ptr >= (char *)rxPool + sizeof(rxPool))
+	{
+		return CTRL_RXPOOL_COUNT;
+	}
+
+	return (ptr - (char *)rxPool) / CTRL_RXPOOL_SIZE;
+}
+
+// returns buffer of at least "len" bytes with one reference taken, or NULL if there is none
+char * ICACHE_FLASH_ATTR ctrl_rxpool_alloc(unsigned short len)
+{
+	if(len > CTRL_RXPOOL_SIZE)
+	{
+		rxPoolStats.tooLong++;
+		return NULL;
+	}
+
+	unsigned char i;
+	for(i=0; i<CTRL_RXPOOL_COUNT; i++)
+	{
+		if(rxPoolRefs[i] == 0)
+		{
+			rxPoolRefs[i] = 1;
+
+			rxPoolStats.hits++;
+			rxPoolStats.inUse++;
+			if(rxPoolStats.inUse > rxPoolStats.highWater)
+			{
+				rxPoolStats.highWater = rxPoolStats.inUse;
+			}
+
+			return rxPool[i];
+		}
+	}
+
+	rxPoolStats.exhausted++;
+	return NULL;
+}
+
+// takes another reference to the buffer "ptr" points into (anywhere inside of it)
+// returns: 0 on success, 1 if "ptr" isn't in a taken pool buffer and the caller must keep its own copy
+unsigned char ICACHE_FLASH_ATTR ctrl_rxpool_ref(char *ptr)
+{
+	unsigned char i = ctrl_rxpool_index(ptr);
+	if(i == CTRL_RXPOOL_COUNT || rxPoolRefs[i] == 0 || rxPoolRefs[i] == 0xFF)
+	{
+		return 1;
+	}
+
+	rxPoolRefs[i]++;
+	return 0;
+}
+
+// releases a reference to the buffer "ptr" points into (anywhere inside of it)
+// returns: 0 on success, 1 if "ptr" isn't in the pool (so it is caller's own copy)
+unsigned char ICACHE_FLASH_ATTR ctrl_rxpool_unref(char *ptr)
+{
+	unsigned char i = ctrl_rxpool_index(ptr);
+	if(i == CTRL_RXPOOL_COUNT)
+	{
+		return 1;
+	}
+
+	if(rxPoolRefs[i] > 0 && --rxPoolRefs[i] == 0)
+	{
+		rxPoolStats.inUse--;
+	}
+
+	return 0;
+}
+
+void ICACHE_FLASH_ATTR ctrl_rxpool_get_stats(tRxPoolStats *stats)
+{
+	os_memcpy(stats, &rxPoolStats, sizeof(tRxPoolStats));
+}
@@ -5,19 +5,28 @@
 #include "espconn.h" // only for ESPCONN_OK enum
 #include "../driver/include/uart.h"
 #include "../driver/include/aes_cbc.h"
+#include "../driver/include/cmac.h"
+#include "../driver/include/aes_cbc_cmac.h"
 #include "include/ctrl_platform.h"
+#include "include/ctrl_txpool.h"
+#include "include/ctrl_rxpool.h"
 
 #include "include/ctrl_stack.h"
 
 os_timer_t tmrDataExpecter;
+os_timer_t tmrAckDelay;
+os_timer_t tmrReorder;
 
 static unsigned long TXserver;
 static char *baseid;
-static char *rxBuff = NULL;
-static unsigned short rxBuffLen;
+static char rxBuff[CTRL_RX_BUFF_SIZE]; // collects a frame which arrived split over multiple TCP segments
+static char *rxFrame = rxBuff; // where that frame is collected, rxBuff or heap when it is longer than rxBuff
+static unsigned short rxBuffLen; // how much of that frame is collected so far, 0 = nothing
+static unsigned short rxSkipLen; // how much of a frame that didn't get memory (or can't be valid) is still to be discarded
 static unsigned char authMode;
 static unsigned char authPhase;
 static unsigned char authSync;
+static unsigned char authResuming; // 1 = we presented a session ticket, Server either accepts it or sends a challenge
 static tCtrlCallbacks *ctrlCallbacks;
 static unsigned char backoff;
 
@@ -37,7 +46,20 @@ static unsigned char backoff;
 static unsigned char safeToUnBackoff = 1;
 
 static char *aes128Key; // secret key
+static tAesKeySchedule aes128KeySchedule; // secret key expanded once per authorization, used for all frames of the session
+static tAesKeySchedule zeroAes128KeySchedule; // all-zero key used in first phase of authorization, expanded once in ctrl_stack_init()
+static tCmacContext aes128Cmac; // CMAC subkeys of the secret key, derived once per authorization
+static tCmacContext zeroAes128Cmac; // CMAC subkeys of the all-zero key, derived once in ctrl_stack_init()
 static char random16bytes[16]; // IV for encryption
+static unsigned char serverCapabilities; // capabilities Server agreed to use in this session
+static char containerBuff[1+CTRL_CONTAINER_DATA_SIZE]; // data of outgoing container: [SYSTEM_MESSAGE_CONTAINER][records]
+static unsigned char ackBatching; // 1 = ACKs are collected into pendingAcks while we process received data
+static tCtrlPendingAck pendingAcks[CTRL_CONTAINER_MAX_RECORDS];
+static unsigned char pendingAcksCount;
+static unsigned char cumulativeAckCount; // how many processed messages are waiting for cumulative ACK, 0 = none
+static tCtrlMessage reorderBuff[CTRL_REORDER_SLOTS]; // messages that arrived early, slot is TXsender % CTRL_REORDER_SLOTS, length 0 = empty slot
+static unsigned char reorderCount; // how many messages are held in reorderBuff
+static unsigned char reorderReleasing; // 1 = we are processing held messages right now
 
 // find first message and return its length. 0 = not found, since CTRL message always has a length (it has at least header byte)!
 static unsigned short ICACHE_FLASH_ATTR ctrl_find_message(char *data, unsigned short len)
@@ -63,6 +85,23 @@ static void ICACHE_FLASH_ATTR ctrl_stack_process_message(tCtrlMessage *msg)
 	// if we are currently in the authorization mode, process received data differently
 	if(authMode)
 	{
+		// Server accepted our session ticket? Then it replied with SYSTEM_MESSAGE_SESSION_RESUMED that carries
+		// TXserver right away, instead of the challenge. Anything else means the ticket was refused.
+		unsigned char resumed = 0;
+		if(authPhase == 1 && authResuming)
+		{
+			if((msg->header & CH_SYSTEM_MESSAGE) && msg->length >= 1+4+1+4 && msg->data[0] == SYSTEM_MESSAGE_SESSION_RESUMED)
+			{
+				authPhase = 2;
+				resumed = 1;
+			}
+			else
+			{
+				ctrl_stack_drop_ticket(); // no use presenting it again
+			}
+		}
+		authResuming = 0;
+
 		// receiving challenge?
 		// we must answer to it here
 		if(authPhase == 1)
@@ -107,9 +146,12 @@ static void ICACHE_FLASH_ATTR ctrl_stack_process_message(tCtrlMessage *msg)
 			}
 			else
 			{
-				os_memcpy(&TXserver, msg->data, 4);
+				os_memcpy(&TXserver, msg->data + resumed, 4); // it follows SYSTEM_MESSAGE_SESSION_RESUMED when resuming
 			}
 
+			// tell Server what we support, it will reply with what it is going to use
+			ctrl_stack_send_capabilities();
+
 			if(ctrlCallbacks->auth_response != NULL)
 			{
 				ctrlCallbacks->auth_response();
@@ -135,6 +177,11 @@ static void ICACHE_FLASH_ATTR ctrl_stack_process_message(tCtrlMessage *msg)
 				}
 			}
 		}
+		// container of messages, each record in it is processed as if it arrived on its own
+		else if((msg->header & CH_SYSTEM_MESSAGE) && (msg->header & CH_NOTIFICATION) && msg->length > 1+4 && msg->data[0] == SYSTEM_MESSAGE_CONTAINER)
+		{
+			ctrl_stack_process_container(msg);
+		}
 		// fresh message, acknowledge and push it to the app
 		else
 		{
@@ -148,6 +195,7 @@ static void ICACHE_FLASH_ATTR ctrl_stack_process_message(tCtrlMessage *msg)
 			ack.TXsender = msg->TXsender;
 			ack.length = 1+4; // fixed ACK length, without payload (data)
 			char TXserver2Save[4]; // will need this bellow
+			unsigned char refused = 0; // 1 = message is in order but app didn't take it
 
 			// is this NOT a notification message?
 			if(!(msg->header & CH_NOTIFICATION))
@@ -157,8 +205,19 @@ static void ICACHE_FLASH_ATTR ctrl_stack_process_message(tCtrlMessage *msg)
                     ack.header &= ~CH_PROCESSED;
                     //os_printf("ERROR: Re-transmitted message, ignoring!\r\n");
                 }
+                else if (msg->TXsender > (TXserver + 1) && backoff)
+                {
+					// Server is backed off, it sends this one again together with the ones before it
+					ack.header &= ~CH_PROCESSED;
+                }
                 else if (msg->TXsender > (TXserver + 1))
                 {
+					// Arrived a bit early? Hold it until the messages before it arrive, it is acknowledged then.
+					if(ctrl_stack_reorder_hold(msg) == 0)
+					{
+						return;
+					}
+
 					// SYNC PROBLEM! Server sent higher than we expected! This means we missed some previous Message!
                     // This part should be handled on Server's side.
                     // Server will flush all data after receiving X successive out-of-sync messages from us,
@@ -169,6 +228,14 @@ static void ICACHE_FLASH_ATTR ctrl_stack_process_message(tCtrlMessage *msg)
                     ack.header &= ~CH_PROCESSED;
                     //os_printf("ERROR: Out-of-sync message!\r\n");
                 }
+                else if (ctrl_stack_deliver(msg) != 0)
+                {
+					// App can't take it right now, it must not be acknowledged as processed. Server sends it
+					// again, after it backs off, together with everything it sent after it.
+					ack.header |= CH_BACKOFF;
+					ack.header &= ~CH_PROCESSED;
+					refused = 1;
+                }
                 else
                 {
                 	ack.header |= CH_PROCESSED;
@@ -190,33 +257,363 @@ static void ICACHE_FLASH_ATTR ctrl_stack_process_message(tCtrlMessage *msg)
 					ack.data = TXserver2Save;
                 }
 
-                // send reply
-                ctrl_stack_send_msg(&ack);
+				// Message is in order and we are not backing off? One cumulative ACK a bit later will cover
+				// it together with messages that follow. Everything else (re-transmissions, out of sync,
+				// backoff) must reach Server exactly as it is, right after ACKs for messages before it.
+				if((ack.header & CH_PROCESSED) && !(ack.header & CH_BACKOFF) && (serverCapabilities & CTRL_CAP_CUMULATIVE_ACK))
+				{
+					ctrl_stack_delay_ack();
+				}
+				else
+				{
+					ctrl_stack_flush_cumulative_ack();
+
+					// send reply
+					ctrl_stack_send_ack(&ack);
+				}
+
+				// messages held after the refused one are sent again too
+				if(refused && reorderCount > 0)
+				{
+					ctrl_stack_reorder_reject(CH_ACK | CH_BACKOFF);
+				}
 
                 //os_printf("ACKed to a msg!\r\n");
 			}
 			else
 			{
-				ack.header |= CH_PROCESSED; // need this for code bellow to execute
+				// nobody will send a notification again, if app can't take it it is gone
+				ctrl_stack_deliver(msg);
 				//os_printf("Didn't ACK because this is a notification-type msg!\r\n");
 			}
 
-			// received a message which is new and as expected?
-			if(ack.header & CH_PROCESSED)
+			// next expected message arrived, messages that arrived early may follow it now
+			if(reorderCount > 0 && (ack.header & CH_PROCESSED) && !(msg->header & CH_NOTIFICATION))
 			{
-				//os_printf("Got fresh message!\r\n");
-
-				// 7-12-2014 pushing system messages to ctrl_platform.c!
-				// push the received message to callback
-				if(ctrlCallbacks->message_received != NULL)
-				{
-					ctrlCallbacks->message_received(msg);
-				}
+				ctrl_stack_reorder_release();
 			}
 		}
 	}
 }
 
+// hands fresh message over to whoever it is for, before it gets acknowledged
+// returns: 0 when it was taken, 1 when it can't be taken right now
+static unsigned char ICACHE_FLASH_ATTR ctrl_stack_deliver(tCtrlMessage *msg)
+{
+	//os_printf("Got fresh message!\r\n");
+
+	// Server's reply to our capabilities, this one is for us only
+	if((msg->header & CH_SYSTEM_MESSAGE) && msg->length >= 1+4+2 && msg->data[0] == SYSTEM_MESSAGE_CAPABILITIES)
+	{
+		serverCapabilities = msg->data[1] & CTRL_CAPABILITIES;
+	}
+	// ticket for resuming this session on the next authorization, this one is for us only too
+	else if((msg->header & CH_SYSTEM_MESSAGE) && msg->length >= 1+4+1+16 && msg->data[0] == SYSTEM_MESSAGE_SESSION_TICKET)
+	{
+		ctrl_stack_save_ticket(msg->data+1);
+	}
+	// 7-12-2014 pushing system messages to ctrl_platform.c!
+	// push the received message to callback
+	else if(ctrlCallbacks->message_received != NULL)
+	{
+		return ctrlCallbacks->message_received(msg);
+	}
+
+	return 0;
+}
+
+// processes every record of received container
+static void ICACHE_FLASH_ATTR ctrl_stack_process_container(tCtrlMessage *container)
+{
+	char *recordPtr = container->data + 1; // skip SYSTEM_MESSAGE_CONTAINER
+	char *endPtr = container->data + (container->length - 1 - 4);
+
+	while(endPtr - recordPtr >= 2 + 1 + 4)
+	{
+		tCtrlMessage record;
+
+		os_memcpy((char *)&record.length, recordPtr, 2); // little endian
+		if(record.length < 1 + 4 || record.length > endPtr - recordPtr - 2)
+		{
+			#ifdef CTRL_LOGGING
+				os_printf("Malformed container record, ignoring the rest!\r\n");
+			#endif
+			return;
+		}
+
+		os_memcpy(&record.header, recordPtr+2, 1);
+		os_memcpy((char *)&record.TXsender, recordPtr+3, 4); // little endian
+		record.data = recordPtr + 2 + 1 + 4;
+
+		recordPtr += 2 + record.length;
+
+		// containers don't nest
+		if((record.header & CH_SYSTEM_MESSAGE) && record.length > 1+4 && record.data[0] == SYSTEM_MESSAGE_CONTAINER)
+		{
+			continue;
+		}
+
+		ctrl_stack_process_message(&record);
+	}
+}
+
+// sends the ACK, or collects it to be sent in a container with other ACKs when we are processing received data
+static unsigned char ICACHE_FLASH_ATTR ctrl_stack_send_ack(tCtrlMessage *ack)
+{
+	if(!ackBatching || !(serverCapabilities & CTRL_CAP_CONTAINER))
+	{
+		return ctrl_stack_send_msg(ack);
+	}
+
+	if(pendingAcksCount >= CTRL_CONTAINER_MAX_RECORDS)
+	{
+		ctrl_stack_flush_acks();
+	}
+
+	tCtrlPendingAck *pending = &pendingAcks[pendingAcksCount++];
+	pending->header = ack->header;
+	pending->TXsender = ack->TXsender;
+	if(ack->header & CH_SAVE_TXSERVER)
+	{
+		os_memcpy(&pending->TXserver, ack->data, 4);
+	}
+
+	return 0;
+}
+
+// sends all collected ACKs
+static void ICACHE_FLASH_ATTR ctrl_stack_flush_acks(void)
+{
+	if(pendingAcksCount == 0)
+	{
+		return;
+	}
+
+	tCtrlMessage acks[CTRL_CONTAINER_MAX_RECORDS];
+	unsigned char i;
+	for(i=0; i<pendingAcksCount; i++)
+	{
+		acks[i].header = pendingAcks[i].header;
+		acks[i].TXsender = pendingAcks[i].TXsender;
+		acks[i].length = 1+4;
+		acks[i].data = NULL;
+
+		if(pendingAcks[i].header & CH_SAVE_TXSERVER)
+		{
+			acks[i].length += 4;
+			acks[i].data = (char *)&pendingAcks[i].TXserver;
+		}
+	}
+
+	unsigned char count = pendingAcksCount;
+	pendingAcksCount = 0;
+
+	ctrl_stack_send_container(acks, count);
+}
+
+// counts one more processed message to be covered by cumulative ACK
+static void ICACHE_FLASH_ATTR ctrl_stack_delay_ack(void)
+{
+	if(++cumulativeAckCount >= CTRL_CUMULATIVE_ACK_MAX)
+	{
+		ctrl_stack_flush_cumulative_ack();
+	}
+	else if(cumulativeAckCount == 1)
+	{
+		os_timer_disarm(&tmrAckDelay);
+		os_timer_arm(&tmrAckDelay, TMR_ACK_DELAY_MS, 0); // 0 = do not repeat automatically
+	}
+}
+
+// sends cumulative ACK for all processed messages up to TXserver, if any is waiting for it
+static void ICACHE_FLASH_ATTR ctrl_stack_flush_cumulative_ack(void)
+{
+	if(cumulativeAckCount == 0)
+	{
+		return;
+	}
+
+	os_timer_disarm(&tmrAckDelay);
+	cumulativeAckCount = 0;
+
+	char TXserver2Save[4];
+	os_memcpy(TXserver2Save, &TXserver, 4);
+
+	tCtrlMessage ack;
+	ack.header = CH_ACK | CH_PROCESSED | CH_SAVE_TXSERVER;
+	if(backoff)
+	{
+		ack.header |= CH_BACKOFF; // like every other ACK, messages it covers were processed anyway
+	}
+	ack.TXsender = TXserver; // highest message we received in order
+	ack.length = 1+4+4;
+	ack.data = TXserver2Save;
+
+	ctrl_stack_send_ack(&ack);
+}
+
+// ack delay timeout, no more messages arrived to be covered by cumulative ACK
+static void ICACHE_FLASH_ATTR ack_delay_timeout(void *arg)
+{
+	ctrl_stack_flush_cumulative_ack();
+}
+
+// holds message that arrived early, in its receive pool buffer or a copy of it
+// returns: 0 when message is held (or already was), 1 when it can't be held
+static unsigned char ICACHE_FLASH_ATTR ctrl_stack_reorder_hold(tCtrlMessage *msg)
+{
+	if(msg->TXsender > TXserver + 1 + CTRL_REORDER_SLOTS)
+	{
+		return 1; // too far ahead
+	}
+
+	tCtrlMessage *slot = &reorderBuff[msg->TXsender % CTRL_REORDER_SLOTS];
+	if(slot->length != 0)
+	{
+		if(slot->TXsender == msg->TXsender)
+		{
+			return 0; // re-transmission of a message we already hold
+		}
+
+		if(slot->TXsender > TXserver)
+		{
+			return 1; // taken
+		}
+
+		// stale, it arrived in order after all
+		if(slot->data != NULL && ctrl_rxpool_unref(slot->data))
+		{
+			os_free(slot->data);
+		}
+		slot->length = 0;
+		reorderCount--;
+	}
+
+	// keep it in its receive pool buffer, or make a copy if it isn't in one
+	char *data = NULL;
+	if(msg->length > 1+4 && ctrl_rxpool_ref(msg->data) == 0)
+	{
+		data = msg->data;
+	}
+	else if(msg->length > 1+4)
+	{
+		data = (char *)os_malloc(msg->length-1-4);
+		if(data == NULL)
+		{
+			return 1;
+		}
+		os_memcpy(data, msg->data, msg->length-1-4);
+	}
+
+	os_memcpy(slot, msg, sizeof(tCtrlMessage));
+	slot->data = data;
+
+	if(reorderCount++ == 0)
+	{
+		os_timer_disarm(&tmrReorder);
+		os_timer_arm(&tmrReorder, TMR_REORDER_MS, 0); // 0 = do not repeat automatically
+	}
+
+	return 0;
+}
+
+// processes held messages that are next in order
+static void ICACHE_FLASH_ATTR ctrl_stack_reorder_release(void)
+{
+	// processing a held message calls us again, the loop bellow takes care of the rest
+	if(reorderReleasing)
+	{
+		return;
+	}
+	reorderReleasing = 1;
+
+	while(reorderCount > 0)
+	{
+		tCtrlMessage *slot = &reorderBuff[(TXserver + 1) % CTRL_REORDER_SLOTS];
+		if(slot->length == 0 || slot->TXsender != TXserver + 1)
+		{
+			break;
+		}
+
+		tCtrlMessage held;
+		os_memcpy(&held, slot, sizeof(tCtrlMessage));
+		slot->length = 0;
+		reorderCount--;
+
+		ctrl_stack_process_message(&held);
+
+		if(held.data != NULL && ctrl_rxpool_unref(held.data))
+		{
+			os_free(held.data);
+		}
+	}
+
+	if(reorderCount == 0)
+	{
+		os_timer_disarm(&tmrReorder);
+	}
+
+	reorderReleasing = 0;
+}
+
+// drops all held messages
+static void ICACHE_FLASH_ATTR ctrl_stack_reorder_clear(void)
+{
+	os_timer_disarm(&tmrReorder);
+
+	unsigned char i;
+	for(i=0; i<CTRL_REORDER_SLOTS; i++)
+	{
+		if(reorderBuff[i].length != 0 && reorderBuff[i].data != NULL && ctrl_rxpool_unref(reorderBuff[i].data))
+		{
+			os_free(reorderBuff[i].data);
+		}
+		reorderBuff[i].length = 0;
+	}
+
+	reorderCount = 0;
+}
+
+// reorder timeout, messages before the held ones didn't arrive in time
+static void ICACHE_FLASH_ATTR reorder_timeout(void *arg)
+{
+	#ifdef CTRL_LOGGING
+		os_printf("reorder_timeout() - gap didn't fill, OUT OF SYNC\r\n");
+	#endif
+
+	ctrl_stack_flush_cumulative_ack();
+
+	// tell Server about held messages just like we would if we didn't hold them
+	ctrl_stack_reorder_reject(CH_ACK | CH_OUT_OF_SYNC);
+}
+
+// answers all held messages with given ACK header (never PROCESSED) and drops them
+static void ICACHE_FLASH_ATTR ctrl_stack_reorder_reject(char header)
+{
+	unsigned long TXsender;
+	for(TXsender = TXserver + 2; TXsender <= TXserver + 1 + CTRL_REORDER_SLOTS; TXsender++)
+	{
+		tCtrlMessage *slot = &reorderBuff[TXsender % CTRL_REORDER_SLOTS];
+		if(slot->length == 0 || slot->TXsender != TXsender)
+		{
+			continue;
+		}
+
+		tCtrlMessage ack;
+		ack.header = header;
+		if(backoff)
+		{
+			ack.header |= CH_BACKOFF;
+		}
+		ack.TXsender = TXsender;
+		ack.length = 1+4; // fixed ACK length, without payload (data)
+
+		ctrl_stack_send_ack(&ack);
+	}
+
+	ctrl_stack_reorder_clear();
+}
+
 // data expecter timeout, in case it triggers things aren't going well
 static void ICACHE_FLASH_ATTR data_expecter_timeout(void *arg)
 {
@@ -224,142 +621,255 @@ static void ICACHE_FLASH_ATTR data_expecter_timeout(void *arg)
 		os_printf("data_expecter_timeout() - FLUSH RX BUFF\r\n");
 	#endif
 
-	if(rxBuff != NULL)
+	ctrl_stack_rx_reset();
+}
+
+// forgets the frame being collected from multiple TCP segments
+static void ICACHE_FLASH_ATTR ctrl_stack_rx_reset(void)
+{
+	if(rxFrame != rxBuff)
 	{
-		os_free(rxBuff);
-		rxBuff = NULL;
+		os_free(rxFrame);
+		rxFrame = rxBuff;
 	}
+	rxBuffLen = 0;
+	rxSkipLen = 0;
 }
 
-// all socket data which is received is flushed into this function
-void ICACHE_FLASH_ATTR ctrl_stack_recv(char *data, unsigned short len)
+// returns: 1 when processing of the message will use its data, 0 when its header is enough
+static unsigned char ICACHE_FLASH_ATTR ctrl_stack_wants_data(tCtrlMessage *msg)
 {
-	// Optimised for RAM memory usage. Reallocating memory only if messages
-	// come in multiple TCP segments (multiple calls of this function for one CTRL message)
+	if(authMode)
+	{
+		return 1;
+	}
 
-	unsigned char shouldFree = 0;
+	// ACKs from Server carry nothing we use
+	if(msg->header & CH_ACK)
+	{
+		return 0;
+	}
 
-	if(rxBuff == NULL)
+	// notifications (containers too) are always delivered
+	if(msg->header & CH_NOTIFICATION)
 	{
-		// fresh data arrived
-		rxBuff = data;
-		rxBuffLen = len;
+		return 1;
 	}
-	else
+
+	// re-transmission, or out of sync too far ahead to be held, we will only acknowledge those
+	if(msg->TXsender <= TXserver || msg->TXsender > TXserver + 1 + CTRL_REORDER_SLOTS)
 	{
-		// concatenate
-		shouldFree = 1;
-		char *newRxBuff = (char *)os_malloc(rxBuffLen+len);
-		if(newRxBuff == NULL)
-		{
-			#ifdef CTRL_LOGGING
-				os_printf("Out of memory (1) in ctrl_stack_recv()\r\n");
-			#endif
-		}
-		os_memcpy(newRxBuff, rxBuff, rxBuffLen);
-		os_memcpy(newRxBuff+rxBuffLen, data, len);
-		os_free(rxBuff);
+		return 0;
+	}
 
-		rxBuff = newRxBuff;
-		rxBuffLen = rxBuffLen+len;
+	// ahead of the next expected one while Server is backed off, it sends it again after the ones before it
+	if(msg->TXsender > TXserver + 1 && backoff)
+	{
+		return 0;
 	}
 
-	// process data we have in rxBuff buffer
-	unsigned short processedLen = 0;
-	while(rxBuffLen > 0)
+	return 1;
+}
+
+// verifies, decrypts and processes one entire frame. "frame" points to its ALL_LENGTH field.
+static void ICACHE_FLASH_ATTR ctrl_stack_process_frame(char *frame, unsigned short allLength)
+{
+	// messages must come in 16 byte blocks (minus the first two bytes for [ALL_LENGTH]) and must hold at least IV, one block and CMAC
+	if(allLength < 48 || (allLength % 16))
 	{
-		unsigned short allLength = ctrl_find_message(rxBuff+processedLen, rxBuffLen);
+		return;
+	}
 
-		if(allLength > 0)
-		{
-			// entire message found in buffer, lets process it
-			os_timer_disarm(&tmrDataExpecter);
+	// Packet structure:
+	// [ALL_LENGTH] { [RANDOM_IV] [MESSAGE_LENGTH] [HEADER] [TX_SENDER] [DATA] [padding when needed] } [CMAC]
+	// 		2             16              2           1          4        n              m               16
 
-			// messages must come in 16 byte blocks (minus the first two bytes for [ALL_LENGTH]). ctrl_find_message() doesn't include ALL_LENGTH field in result
-			if(!(allLength % 16))
-			{
-				// Packet structure:
-				// [ALL_LENGTH] { [RANDOM_IV] [MESSAGE_LENGTH] [HEADER] [TX_SENDER] [DATA] [padding when needed] } [CMAC]
-				// 		2             16              2           1          4        n              m               16
+	char *msgPtr = frame+2; // skip the ALL_LENGTH field
+	unsigned short cipherLength = allLength-16;
 
-				char *msgPtr = rxBuff+processedLen+2; // skip the ALL_LENGTH field
+	// Verify CMAC over ciphertext first, nothing gets decrypted unless the frame is authentic
+	if(!aes128_cmac_verify((unsigned char *)msgPtr, cipherLength, &aes128Cmac, (unsigned char *)msgPtr+cipherLength))
+	{
+		return;
+	}
 
-				// Verify CMAC
-				char calculatedCmac[16];
-				cmac_generate(aes128Key, msgPtr, allLength-16, calculatedCmac);
-				if(os_strncmp(calculatedCmac, msgPtr+allLength-16, 16) == 0)
-				{
-					// Decrypt
-					aes128_cbc_decrypt(msgPtr, allLength-16, aes128Key);
+	// Block 0 is the random IV, nobody needs it decrypted. Block 1 holds MESSAGE_LENGTH, HEADER, TX_SENDER
+	// and first 9 bytes of DATA, decrypt only that one to find out what to do with the message.
+	unsigned char firstBlock[16];
+	aes128_cbc_decrypt_block_schedule((unsigned char *)msgPtr, 1, &aes128KeySchedule, firstBlock);
 
-					msgPtr += 16; // skip IV
+	// Lets parse it into tCtrlMessage type
+	tCtrlMessage msg;
 
-					// Lets parse it into tCtrlMessage type
-					tCtrlMessage msg;
+	// Take MSG_LENGTH
+	os_memcpy((char *)&msg.length, firstBlock, 2); // little endian
 
-					// Take MSG_LENGTH
-					os_memcpy((char *)&msg.length, msgPtr, 2); // little endian
-					msgPtr += 2;
+	// Take HEADER
+	os_memcpy(&msg.header, firstBlock+2, 1);
 
-					// Take HEADER
-					os_memcpy(&msg.header, msgPtr, 1);
-					msgPtr += 1;
+	// Take TXsender
+	os_memcpy((char *)&msg.TXsender, firstBlock+3, 4); // little endian
 
-					// Take TXsender
-					os_memcpy((char *)&msg.TXsender, msgPtr, 4); // little endian
-					msgPtr += 4;
+	// Decrypt the rest only when data will be used (it won't for ACKs, re-transmissions and out of sync
+	// messages). It goes to a receive pool buffer, so whoever wants to keep the message only takes a
+	// reference to it. Without a pool buffer it is decrypted in place, blocks from 2 on before block 1
+	// is overwritten, they need its ciphertext.
+	char *plain = msgPtr + 16;
+	char *poolBuff = NULL;
+	if(ctrl_stack_wants_data(&msg))
+	{
+		poolBuff = ctrl_rxpool_alloc(cipherLength-16);
+		if(poolBuff != NULL)
+		{
+			aes128_cbc_decrypt_to_schedule((unsigned char *)msgPtr, cipherLength, 2, &aes128KeySchedule, (unsigned char *)poolBuff+16);
+			plain = poolBuff;
+		}
+		else if(cipherLength > 32)
+		{
+			aes128_cbc_decrypt_from_schedule((unsigned char *)msgPtr, cipherLength, 2, &aes128KeySchedule);
+		}
+		os_memcpy(plain, firstBlock, 16);
 
-					// Take data. Don't care about discard padding and CMAC because
-					// whoever reads this "msg" will consider msg.length to calculate
-					// the actual length of msg.data!
-					msg.data = msgPtr;
+		// Take data. Don't care about discard padding and CMAC because
+		// whoever reads this "msg" will consider msg.length to calculate
+		// the actual length of msg.data!
+		msg.data = plain + 2 + 1 + 4;
+	}
+	else
+	{
+		// everything past the first 9 bytes of data is still ciphertext, nobody gets to read any of it
+		msg.data = NULL;
+	}
 
-					// Process
-					ctrl_stack_process_message(&msg);
-				}
-			}
+	// Process
+	ctrl_stack_process_message(&msg);
 
-			processedLen += allLength+2;
-			rxBuffLen -= allLength+2;
+	if(poolBuff != NULL)
+	{
+		ctrl_rxpool_unref(poolBuff);
+	}
+}
+
+// all socket data which is received is flushed into this function
+void ICACHE_FLASH_ATTR ctrl_stack_recv(char *data, unsigned short len)
+{
+	// Frames that are entirely inside of received TCP segment are processed in place, right
+	// there in the segment. Only a frame that is split over multiple TCP segments (multiple
+	// calls of this function for one CTRL message) is collected into rxBuff, and every byte
+	// of it is copied only once.
+
+	unsigned short allLength;
+	unsigned short take;
+
+	// ACKs to all messages in this segment go out together
+	ackBatching = 1;
+
+	while(len > 0)
+	{
+		// discarding the rest of a frame that couldn't fit into rxBuff?
+		if(rxSkipLen > 0)
+		{
+			take = (len < rxSkipLen) ? len : rxSkipLen;
+			rxSkipLen -= take;
+			data += take;
+			len -= take;
+			continue;
 		}
-		else
+
+		// continuing a frame that was split over TCP segments?
+		if(rxBuffLen > 0)
 		{
-			// has remaining data in buffer (beginning of another message but not entire message)?
-			if(rxBuffLen > 0)
+			// first we need to know how long it is
+			if(rxBuffLen < 2)
+			{
+				rxBuff[rxBuffLen++] = *data++;
+				len--;
+				continue;
+			}
+
+			os_memcpy(&allLength, rxBuff, 2); // little endian
+
+			// can't be a valid frame, and allLength+2 of it wouldn't fit into unsigned short, skip it without collecting it
+			if(rxFrame == rxBuff && allLength > CTRL_FRAME_MAX_LENGTH)
 			{
+				rxSkipLen = allLength-(rxBuffLen-2);
+				rxBuffLen = 0;
 				os_timer_disarm(&tmrDataExpecter);
-				os_timer_arm(&tmrDataExpecter, TMR_DATA_EXPECTER_MS, 0); // 0 = do not repeat automatically
+				continue;
+			}
 
-				char *newRxBuff = (char *)os_malloc(rxBuffLen);
-				if(newRxBuff == NULL)
+			// longer than rxBuff, it is collected on heap
+			if(rxFrame == rxBuff && (unsigned long)allLength+2 > CTRL_RX_BUFF_SIZE)
+			{
+				rxFrame = (char *)os_malloc(allLength+2);
+				if(rxFrame == NULL)
 				{
 					#ifdef CTRL_LOGGING
-						os_printf("Out of memory (2) in ctrl_stack_recv()\r\n");
+						os_printf("Out of memory for a long frame in ctrl_stack_recv(), discarding it\r\n");
 					#endif
+
+					rxFrame = rxBuff;
+					rxSkipLen = allLength+2-rxBuffLen;
+					rxBuffLen = 0;
+					os_timer_disarm(&tmrDataExpecter);
+					continue;
 				}
-				os_memcpy(newRxBuff, rxBuff+processedLen, rxBuffLen);
-				if(shouldFree)
-				{
-					os_free(rxBuff);
-				}
+				os_memcpy(rxFrame, rxBuff, rxBuffLen);
+			}
 
-				rxBuff = newRxBuff;
+			take = allLength+2-rxBuffLen;
+			if(take > len)
+			{
+				take = len;
 			}
+			os_memcpy(rxFrame+rxBuffLen, data, take);
+			rxBuffLen += take;
+			data += take;
+			len -= take;
 
-			break;
+			if(rxBuffLen == allLength+2)
+			{
+				// entire message collected, lets process it
+				os_timer_disarm(&tmrDataExpecter);
+
+				ctrl_stack_process_frame(rxFrame, allLength);
+				ctrl_stack_rx_reset();
+			}
+			else
+			{
+				// still not there, wait for more
+				os_timer_disarm(&tmrDataExpecter);
+				os_timer_arm(&tmrDataExpecter, TMR_DATA_EXPECTER_MS, 0); // 0 = do not repeat automatically
+			}
+
+			continue;
 		}
-	}
 
-	if(rxBuffLen == 0)
-	{
-		os_timer_disarm(&tmrDataExpecter); // TODO: see if required here as well?
+		allLength = ctrl_find_message(data, len);
 
-		if(shouldFree)
+		if(allLength > 0)
 		{
-			os_free(rxBuff);
+			// entire message found in segment, lets process it in place
+			ctrl_stack_process_frame(data, allLength);
+
+			data += allLength+2;
+			len -= allLength+2;
+		}
+		else
+		{
+			// beginning of another message but not entire message, collect it into rxBuff
+			os_memcpy(rxBuff, data, (len < 2) ? len : 2);
+			rxBuffLen = (len < 2) ? len : 2;
+			data += rxBuffLen;
+			len -= rxBuffLen;
+
+			os_timer_disarm(&tmrDataExpecter);
+			os_timer_arm(&tmrDataExpecter, TMR_DATA_EXPECTER_MS, 0); // 0 = do not repeat automatically
 		}
-		rxBuff = NULL;
 	}
+
+	ackBatching = 0;
+	ctrl_stack_flush_acks();
 }
 
 // creates a message from data and sends it to Server
@@ -382,6 +892,60 @@ unsigned char ICACHE_FLASH_ATTR ctrl_stack_send(char *data, unsigned short len,
 	return ctrl_stack_send_msg(&msg);
 }
 
+// sends multiple messages in one container frame when Server supports it, or one by one when it doesn't
+// returns: 1 on error (none or only some of them were sent), 0 on success
+unsigned char ICACHE_FLASH_ATTR ctrl_stack_send_container(tCtrlMessage *msgs, unsigned char count)
+{
+	unsigned char i;
+
+	if(count == 1 || !(serverCapabilities & CTRL_CAP_CONTAINER))
+	{
+		for(i=0; i<count; i++)
+		{
+			if(ctrl_stack_send_msg(&msgs[i]))
+			{
+				return 1;
+			}
+		}
+
+		return 0;
+	}
+
+	containerBuff[0] = SYSTEM_MESSAGE_CONTAINER;
+	unsigned short len = 1;
+
+	for(i=0; i<count; i++)
+	{
+		if(len + 2 + msgs[i].length > sizeof(containerBuff))
+		{
+			return 1; // doesn't fit
+		}
+
+		os_memcpy(containerBuff+len, &msgs[i].length, 2); // little endian
+		os_memcpy(containerBuff+len+2, &msgs[i].header, 1);
+		os_memcpy(containerBuff+len+3, &msgs[i].TXsender, 4); // little endian
+		if(msgs[i].length > 1+4)
+		{
+			os_memcpy(containerBuff+len+7, msgs[i].data, msgs[i].length-1-4);
+		}
+		len += 2 + msgs[i].length;
+	}
+
+	tCtrlMessage container;
+	container.header = CH_SYSTEM_MESSAGE | CH_NOTIFICATION; // container itself isn't acknowledged, messages in it are
+	container.TXsender = 0; // since we set NOTIFICATION type, this is not relevant
+	container.data = containerBuff;
+	container.length = 1+4+len;
+
+	return ctrl_stack_send_msg(&container);
+}
+
+// returns capabilities Server agreed to use in this session (CTRL_CAP_* bits)
+unsigned char ICACHE_FLASH_ATTR ctrl_stack_capabilities(void)
+{
+	return serverCapabilities;
+}
+
 // calls a pre-set callback that sends data to socket
 // returns: 1 on error, 0 on success
 static unsigned char ICACHE_FLASH_ATTR ctrl_stack_send_msg(tCtrlMessage *msg)
@@ -391,18 +955,17 @@ static unsigned char ICACHE_FLASH_ATTR ctrl_stack_send_msg(tCtrlMessage *msg)
 		return 1;
 	}
 
-	char *activeAes128Key;
+	tCmacContext *activeCmac;
 
 	// Special situation: When we are currently in authMode and in authPhase==1 we need
 	// to use zero-aes128-key (key with all zeroes) to encrypt packet we are about to send.
-	char zeroAes128Key[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
 	if(authMode && authPhase == 1)
 	{
-		activeAes128Key = zeroAes128Key;
+		activeCmac = &zeroAes128Cmac;
 	}
 	else
 	{
-		activeAes128Key = aes128Key;
+		activeCmac = &aes128Cmac;
 	}
 
 	// Packet structure:
@@ -419,7 +982,7 @@ static unsigned char ICACHE_FLASH_ATTR ctrl_stack_send_msg(tCtrlMessage *msg)
 		return 1;
 	}
 
-	char *toSend = (char *)os_zalloc(allocateThisMuch); // use os_zalloc for easier debugging
+	char *toSend = ctrl_txpool_alloc(allocateThisMuch); // frame is built directly into transmit pool buffer
 	// failed to allocate? sorry...
 	if(toSend == NULL)
 	{
@@ -477,23 +1040,9 @@ static unsigned char ICACHE_FLASH_ATTR ctrl_stack_send_msg(tCtrlMessage *msg)
 		os_printf(".\r\n");
 	#endif*/
 
-	// Now encrypt the plaintext (but skip first 2 bytes of [ALL_LENGTH])
-	aes128_cbc_encrypt(toSend+2, (toSendTempPtr-toSend-2), activeAes128Key);
-
-	/*#ifdef CTRL_LOGGING
-		os_printf("encrypted: ");
-
-		for(i=2; i<(toSendTempPtr-toSend); i++)
-		{
-			char tmp2[10];
-			os_sprintf(tmp2, " 0x%X", toSend[i]);
-			os_printf_plus(tmp2);
-		}
-		os_printf(".\r\n");
-	#endif*/
-
-	// Now calculate CMAC over entire ciphertext (but skip first 2 bytes of [ALL_LENGTH]) and place it at the last 16 bytes of toSend!
-	cmac_generate(activeAes128Key, toSend+2, (toSendTempPtr-toSend-2), toSendTempPtr);
+	// Now encrypt the plaintext (but skip first 2 bytes of [ALL_LENGTH]) and in the same pass calculate CMAC
+	// over entire ciphertext and place it at the last 16 bytes of toSend!
+	aes128_cbc_encrypt_cmac((unsigned char *)toSend+2, (toSendTempPtr-toSend-2), activeCmac, (unsigned char *)toSendTempPtr);
 
 	/*#ifdef CTRL_LOGGING
 		os_printf("CMAC: ");
@@ -511,24 +1060,34 @@ static unsigned char ICACHE_FLASH_ATTR ctrl_stack_send_msg(tCtrlMessage *msg)
 	os_memcpy(random16bytes, toSendTempPtr, 16);
 
 	// That should be it, now send it to Server!
+	// On success the buffer belongs to send_data() now, it returns it to the pool once it is written out.
 	if(ctrlCallbacks->send_data(toSend, allocateThisMuch) != ESPCONN_OK)
 	{
-		os_free(toSend);
+		ctrl_txpool_free(toSend);
 		return 1;
 	}
 
-	os_free(toSend);
-
 	return 0;
 }
 
 // this sets or clears the backoff!
-void ICACHE_FLASH_ATTR ctrl_stack_backoff(unsigned char backoff_)
+// returns: 0 when done, 1 when backoff can't be cleared yet because Server didn't confirm it
+unsigned char ICACHE_FLASH_ATTR ctrl_stack_backoff(unsigned char backoff_)
 {
-	if(!safeToUnBackoff && !backoff_) return; // prevend unbackingoff if it is not safe
+	if(!safeToUnBackoff && !backoff_) return 1; // prevend unbackingoff if it is not safe
 	if(backoff_) safeToUnBackoff = 0; // say it is not safe to unbackoff if we just backedoff server
 
+	unsigned char raised = backoff_ && !backoff;
 	backoff = backoff_;
+
+	// Messages processed so far are acknowledged right away (and tell Server to backoff), they must not
+	// wait for the ack delay timer or a message that arrives after them.
+	if(raised)
+	{
+		ctrl_stack_flush_cumulative_ack();
+	}
+
+	return 0;
 }
 
 // this sends a request for current timestamp from Server. It should arrive asynchroniously ASAP
@@ -546,6 +1105,66 @@ void ICACHE_FLASH_ATTR ctrl_stack_get_rtc(void)
 	ctrl_stack_send_msg(&msg);
 }
 
+// this tells Server which optional protocol features we support
+static void ICACHE_FLASH_ATTR ctrl_stack_send_capabilities(void)
+{
+	tCtrlMessage msg;
+	msg.header = CH_SYSTEM_MESSAGE | CH_NOTIFICATION; // lets set NOTIFICATION type also, Server that doesn't know about capabilities will simply ignore it
+	msg.TXsender = 0; // since we set NOTIFICATION type, this is not relevant
+
+	char d[2];
+	d[0] = SYSTEM_MESSAGE_CAPABILITIES;
+	d[1] = CTRL_CAPABILITIES;
+	msg.data = d;
+
+	msg.length = 1+4+2;
+
+	ctrl_stack_send_msg(&msg);
+}
+
+// reads session ticket from RTC memory and counts its presentation there, before it is presented
+// returns: 0 when "ticket" got a valid one followed by its new counter (4 bytes), 1 when there is none
+static unsigned char ICACHE_FLASH_ATTR ctrl_stack_take_ticket(char *ticket)
+{
+	tCtrlSessionTicket stored;
+	if(!system_rtc_mem_read(CTRL_SESSION_TICKET_RTC_ADDR, &stored, sizeof(tCtrlSessionTicket)) || stored.magic != CTRL_SESSION_TICKET_MAGIC)
+	{
+		return 1;
+	}
+
+	// same frame must never go out twice, even if the connection breaks before Server replies
+	stored.counter++;
+	if(!system_rtc_mem_write(CTRL_SESSION_TICKET_RTC_ADDR, &stored, sizeof(tCtrlSessionTicket)))
+	{
+		return 1;
+	}
+
+	os_memcpy(ticket, stored.ticket, 16);
+	os_memcpy(ticket+16, &stored.counter, 4); // little endian
+
+	return 0;
+}
+
+// keeps session ticket that Server issued in RTC memory for the next authorization
+static void ICACHE_FLASH_ATTR ctrl_stack_save_ticket(char *ticket)
+{
+	tCtrlSessionTicket stored;
+	stored.magic = CTRL_SESSION_TICKET_MAGIC;
+	stored.counter = 0;
+	os_memcpy(stored.ticket, ticket, 16);
+
+	system_rtc_mem_write(CTRL_SESSION_TICKET_RTC_ADDR, &stored, sizeof(tCtrlSessionTicket));
+}
+
+// invalidates session ticket in RTC memory, Server refused it
+static void ICACHE_FLASH_ATTR ctrl_stack_drop_ticket(void)
+{
+	tCtrlSessionTicket stored;
+	os_memset(&stored, 0, sizeof(tCtrlSessionTicket));
+
+	system_rtc_mem_write(CTRL_SESSION_TICKET_RTC_ADDR, &stored, sizeof(tCtrlSessionTicket));
+}
+
 // this enables or disables the keep-alive on server's side
 void ICACHE_FLASH_ATTR ctrl_stack_keepalive(unsigned char keepalive)
 {
@@ -571,9 +1190,19 @@ void ICACHE_FLASH_ATTR ctrl_stack_authorize(char *baseid_, char *aes128Key_, uns
 	baseid = baseid_;
 	aes128Key = aes128Key_;
 
+	// Expand the key and derive CMAC subkeys only once here, they are then used for every frame we send or receive in this session
+	expandKey(&aes128KeySchedule, (unsigned char *)aes128Key);
+	cmac_prepare(&aes128Cmac, &aes128KeySchedule);
+
 	authMode = 1; // used in our local ctrl_stack_process_message() to know how to parse incoming data from server
 	authPhase = 1;
 	authSync = sync;
+	serverCapabilities = 0; // until Server tells us otherwise
+	pendingAcksCount = 0;
+	os_timer_disarm(&tmrAckDelay);
+	cumulativeAckCount = 0;
+	ctrl_stack_reorder_clear();
+	safeToUnBackoff = 1; // nothing we backed off can still be on the wire of a new connection
 
 	tCtrlMessage msg;
 	msg.length = 1 + 4 + 16;
@@ -581,16 +1210,34 @@ void ICACHE_FLASH_ATTR ctrl_stack_authorize(char *baseid_, char *aes128Key_, uns
 	msg.TXsender = 0; // value not relevant during authentication procedure
 	msg.data = baseid; //contains: baseid
 
-	// In case we already have something partial in rxBuff, we must free it since the remaining partial data will never arrive.
-	// We will never have this != NULL in case there was a full message available there, because it would be parsed at the time
-	// it arrived into this buffer!
-	if(rxBuff != NULL)
+	// Have a session ticket from the last authorization? Present it together with the proof that we
+	// know the key (CMAC over baseid, ticket and counter), Server then doesn't need to challenge us.
+	char resume[52];
+	authResuming = 0;
+	if(ctrl_stack_take_ticket(resume+16) == 0)
 	{
-		os_timer_disarm(&tmrDataExpecter);
-		os_free(rxBuff);
-		rxBuff = NULL;
+		os_memcpy(resume, baseid, 16);
+
+		char proofInput[48]; // whole blocks only
+		os_memcpy(proofInput, resume, 36);
+		os_memset(proofInput+36, 0, 12);
+		cmac_generate_ctx(&aes128Cmac, (unsigned char *)proofInput, 48, (unsigned char *)resume+36);
+
+		msg.length = 1 + 4 + 52;
+		msg.data = resume; // contains: baseid + ticket + counter + proof
+		if(authSync == 1)
+		{
+			msg.header |= CH_SYNC; // there is no challenge response to tell it in
+		}
+		authResuming = 1;
 	}
 
+	// In case we already have something partial in rxBuff, we must flush it since the remaining partial data will never arrive.
+	// We will never have anything in there in case there was a full message available, because it would be parsed at the time
+	// it arrived into this buffer!
+	os_timer_disarm(&tmrDataExpecter);
+	ctrl_stack_rx_reset();
+
 	// prepare IV for very first encryption of the "msg"
 	unsigned char i;
 	for(i=0; i<4; i++)
@@ -607,6 +1254,16 @@ void ICACHE_FLASH_ATTR ctrl_stack_init(tCtrlCallbacks *cc)
 {
 	ctrlCallbacks = cc;
 
+	char zeroAes128Key[16] = {0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0};
+	expandKey(&zeroAes128KeySchedule, (unsigned char *)zeroAes128Key);
+	cmac_prepare(&zeroAes128Cmac, &zeroAes128KeySchedule);
+
 	os_timer_disarm(&tmrDataExpecter);
 	os_timer_setfn(&tmrDataExpecter, (os_timer_func_t *)data_expecter_timeout, NULL);
+
+	os_timer_disarm(&tmrAckDelay);
+	os_timer_setfn(&tmrAckDelay, (os_timer_func_t *)ack_delay_timeout, NULL);
+
+	os_timer_disarm(&tmrReorder);
+	os_timer_setfn(&tmrReorder, (os_timer_func_t *)reorder_timeout, NULL);
 }
@@ -0,0 +1,108 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "mem.h"
+
+#include "include/ctrl_txpool.h"
+
+/*
+	Pool of transmit frame buffers. Every outgoing frame (including every ACK)
+	is built directly into one of these and it is returned here once the frame
+	has been written to the socket, so steady traffic doesn't churn the heap.
+*/
+
+static char txPoolSmall[CTRL_TXPOOL_SMALL_COUNT][CTRL_TXPOOL_SMALL_SIZE] __attribute__((aligned(16)));
+static char txPoolMedium[CTRL_TXPOOL_MEDIUM_COUNT][CTRL_TXPOOL_MEDIUM_SIZE] __attribute__((aligned(16)));
+static char txPoolLarge[CTRL_TXPOOL_LARGE_COUNT][CTRL_TXPOOL_LARGE_SIZE] __attribute__((aligned(16)));
+
+// one bit per buffer, set = taken
+static unsigned long txPoolSmallUsed;
+static unsigned long txPoolMediumUsed;
+static unsigned long txPoolLargeUsed;
+
+static tTxPoolStats txPoolStats;
+
+// takes first free buffer of one size class, returns NULL if all are taken
+static char * ICACHE_FLASH_ATTR ctrl_txpool_take(char *pool, unsigned short size, unsigned char count, unsigned long *used)
+{
+	unsigned char i;
+	for(i=0; i<count; i++)
+	{
+		if(!(*used & (1UL << i)))
+		{
+			*used |= (1UL << i);
+
+			txPoolStats.hits++;
+			txPoolStats.inUse++;
+			if(txPoolStats.inUse > txPoolStats.highWater)
+			{
+				txPoolStats.highWater = txPoolStats.inUse;
+			}
+
+			return pool + (i * size);
+		}
+	}
+
+	return NULL;
+}
+
+// returns buffer of at least "len" bytes, from the smallest size class that fits and has a free buffer, or from heap
+char * ICACHE_FLASH_ATTR ctrl_txpool_alloc(unsigned short len)
+{
+	char *buff = NULL;
+
+	if(len <= CTRL_TXPOOL_SMALL_SIZE)
+	{
+		buff = ctrl_txpool_take((char *)txPoolSmall, CTRL_TXPOOL_SMALL_SIZE, CTRL_TXPOOL_SMALL_COUNT, &txPoolSmallUsed);
+	}
+	if(buff == NULL && len <= CTRL_TXPOOL_MEDIUM_SIZE)
+	{
+		buff = ctrl_txpool_take((char *)txPoolMedium, CTRL_TXPOOL_MEDIUM_SIZE, CTRL_TXPOOL_MEDIUM_COUNT, &txPoolMediumUsed);
+	}
+	if(buff == NULL && len <= CTRL_TXPOOL_LARGE_SIZE)
+	{
+		buff = ctrl_txpool_take((char *)txPoolLarge, CTRL_TXPOOL_LARGE_SIZE, CTRL_TXPOOL_LARGE_COUNT, &txPoolLargeUsed);
+	}
+
+	if(buff == NULL)
+	{
+		txPoolStats.misses++;
+		buff = (char *)os_malloc(len);
+	}
+
+	return buff;
+}
+
+// returns buffer taken with ctrl_txpool_alloc()
+void ICACHE_FLASH_ATTR ctrl_txpool_free(char *buff)
+{
+	if(buff == NULL)
+	{
+		return;
+	}
+
+	if(buff >= (char *)txPoolSmall && buff < (char *)txPoolSmall + sizeof(txPoolSmall))
+	{
+		txPoolSmallUsed &= ~(1UL << ((buff - (char *)txPoolSmall) / CTRL_TXPOOL_SMALL_SIZE));
+	}
+	else if(buff >= (char *)txPoolMedium && buff < (char *)txPoolMedium + sizeof(txPoolMedium))
+	{
+		txPoolMediumUsed &= ~(1UL << ((buff - (char *)txPoolMedium) / CTRL_TXPOOL_MEDIUM_SIZE));
+	}
+	else if(buff >= (char *)txPoolLarge && buff < (char *)txPoolLarge + sizeof(txPoolLarge))
+	{
+		txPoolLargeUsed &= ~(1UL << ((buff - (char *)txPoolLarge) / CTRL_TXPOOL_LARGE_SIZE));
+	}
+	else
+	{
+		os_free(buff);
+		return;
+	}
+
+	txPoolStats.inUse--;
+}
+
+void ICACHE_FLASH_ATTR ctrl_txpool_get_stats(tTxPoolStats *stats)
+{
+	os_memcpy(stats, &txPoolStats, sizeof(tTxPoolStats));
+}
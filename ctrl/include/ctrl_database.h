@@ -4,42 +4,81 @@
 #include "c_types.h"
 
 // Define maximum database rows to store in total.
-// Maximum is 255 because of "unsigned char" usage for this value. It can be
-// changed though but the question is why having that long outgoing database
-// table? What's wrong with the connection and why isn't it sending that data?
-#define CTRL_DATABASE_CAPACITY		5
+// Rows are kept in a ring of slots where the slot of a row is its TXbase % CTRL_DATABASE_CAPACITY,
+// so adding, acknowledging, finding next row to send and flushing acknowledged rows doesn't
+// depend on how many rows there are. Each slot takes 4 bytes of RAM (a pointer to the row).
+#define CTRL_DATABASE_CAPACITY		64
+
+// Rows (header and data together) are carved out of this many bytes of statically allocated arena.
+// Rows are added and removed in TXbase order, so the arena is used as a FIFO and never fragments.
+// When a row doesn't fit into the arena it is allocated from heap with a single os_malloc().
+// The arena takes this many bytes of RAM for good, heap takes the rest of a burst only while it lasts.
+#define CTRL_DATABASE_ARENA_SIZE	2048
+
+// Rows are admitted against a byte budget (header and data), not just against the number of rows.
+// Once a row would take the database over CTRL_DATABASE_BYTE_BUDGET, new rows are refused until
+// the database drains down to CTRL_DATABASE_LOW_WATERMARK bytes, so the application isn't
+// admitted and refused on every other row while the queue is full.
+#define CTRL_DATABASE_BYTE_BUDGET		6144
+#define CTRL_DATABASE_LOW_WATERMARK		4096
+
+// Rows that don't fit into the arena are only allocated from heap if at least this many bytes
+// of heap stay free afterwards (for espconn and the SDK).
+#define CTRL_DATABASE_HEAP_HEADROOM		8192
+
+// ctrl_database_add_row() results, anything but CTRL_DATABASE_ADD_OK means the row was refused.
+// Value 1 is left out so callers can keep using it for their own generic errors.
+typedef enum {
+	CTRL_DATABASE_ADD_OK = 0,
+	CTRL_DATABASE_ADD_ERR_ROWS = 2, // all slots are taken
+	CTRL_DATABASE_ADD_ERR_BUDGET, // over byte budget, or still draining down to the low watermark
+	CTRL_DATABASE_ADD_ERR_HEAP // arena is full and there isn't enough free heap
+} tDatabaseAddResult;
 
-// one database entry (row)
+typedef struct {
+	unsigned long bytes; // bytes taken by rows (header and data) in database
+	unsigned short rows; // rows in database
+	unsigned long rejections; // rows refused by ctrl_database_add_row()
+} tDatabaseStats;
+
+// one database entry (row), its data follows the header in the same allocation
 typedef struct {
 	//unsigned char notification;
 	unsigned long TXbase;
-	char *data;
+	unsigned long sentTime; // system_get_time() when the row was last sent
 	unsigned short len;
 
 	unsigned char sent;
 	unsigned char acked; // all acknowledged messages that have zero unacknowledged messages older than it self, should be removed from the database to free the memory. TXbase should be preserved in local variable of ctrl_database library because of that.
-} tDatabaseRow;
+	unsigned char inArena; // 1 = row is carved out of database arena, 0 = row is allocated from heap
+	unsigned char retries; // how many times the row was re-transmitted because its ACK didn't arrive in time
+	unsigned char sendCount; // how many times the row was sent in total (saturates at 255)
 
-// linked list item
-typedef struct tnode {
-	tDatabaseRow *row;
-	struct tnode *next;
-} tNode;
+	char data[]; // "len" bytes of data
+} tDatabaseRow;
 
 // private
-static unsigned char ctrl_database_count(void);
-static tNode * ctrl_database_delete_by_TXbase(unsigned long TXbase);
-static unsigned char ctrl_database_add_node(tDatabaseRow *);
-static tNode * ctrl_database_find_last();
+static unsigned short ctrl_database_count(void);
+static tDatabaseRow * ctrl_database_find(unsigned long);
+static unsigned short ctrl_database_row_size(unsigned short);
+static tDatabaseRow * ctrl_database_alloc_row(unsigned short);
+static void ctrl_database_free_row(tDatabaseRow *);
 
 // public
 void ctrl_database_flush_acked(void);
-void ctrl_database_ack_row(unsigned long);
+unsigned char ctrl_database_ack_row(unsigned long, unsigned long *);
 void ctrl_database_unsend_all(void);
+void ctrl_database_unsend_row(unsigned long);
+void ctrl_database_unsend_from(unsigned long);
+unsigned long ctrl_database_first_unacked(void);
+unsigned long ctrl_database_last_sent(void);
 void ctrl_database_delete_all(void);
 unsigned char ctrl_database_add_row(char *, unsigned short);
 tDatabaseRow * ctrl_database_get_next_txbase2server(void);
-unsigned char ctrl_database_count_unacked_items(void);
+tDatabaseRow * ctrl_database_get_oldest_in_flight(void);
+unsigned short ctrl_database_count_unacked_items(void);
+unsigned short ctrl_database_count_in_flight(void);
+void ctrl_database_get_stats(tDatabaseStats *);
 void ctrl_database_init();
 
 #endif
@@ -21,11 +21,62 @@
 // transmission and re-transmitting it if something happens.
 #define USE_DATABASE_APPROACH
 #ifdef USE_DATABASE_APPROACH
-	#define TMR_ITEMS_SENDER_MS			150		// sending of all outgoing items when using the database approach
+	#define TMR_ITEMS_SENDER_MS			150		// retry of sending outgoing items when socket refused to take the last one
+	#define CTRL_SEND_WINDOW			8		// how many outgoing items can be sent and waiting for ACK at the same time
+	#define CTRL_RTO_INITIAL_MS			1000	// re-transmission timeout until the first round trip time is measured
+	#define CTRL_RTO_MIN_MS				200		// re-transmission timeout limits, it is doubled on every re-transmission up to the max
+	#define CTRL_RTO_MAX_MS				10000
+	#define CTRL_RETRANSMIT_MAX			5		// when oldest outgoing item is re-transmitted this many times without ACK, connection is re-established
 #endif
 
-// How many unprocessed CTRL messages can we hold until we tell Server to backoff?
-#define TASK_QUEUE_LEN		5
+// Frames are written to socket one at a time, the rest wait in transmit queue until the
+// previous write completes. Last CTRL_TXQUEUE_RESERVED slots are kept for ACKs and other
+// frames CTRL stack sends on its own, application data never takes them. When even those
+// are taken, frames of CTRL stack wait in a list on heap, they must never be dropped.
+// A write the socket didn't take is tried again after CTRL_TX_RETRY_MS.
+#define CTRL_TXQUEUE_LEN			16
+#define CTRL_TXQUEUE_RESERVED		2
+#define CTRL_TX_RETRY_MS			50
+
+// Frames queued during the same event loop turn (or within CTRL_TX_COALESCE_MS) are copied
+// one after another into a single buffer of up to CTRL_TX_COALESCE_SIZE bytes (at most one TCP
+// segment) and written to socket with a single espconn_sent(). 0 ms means "on the next event loop
+// turn". Mostly ACKs and short messages get glued together, longer frames are written on their own,
+// so the buffer (static RAM) doesn't need to be as large as a whole segment.
+#define CTRL_TX_COALESCE_MS			0
+#define CTRL_TX_COALESCE_SIZE		512
+
+// When defined, Nagle's algorithm is turned off on CTRL connection. We coalesce frames ourselves
+// so Nagle would only delay ACKs and keep-alives.
+#define CTRL_TCP_NODELAY
+
+// Received messages wait for user app in our own queue, one posted task drains up to CTRL_APP_QUEUE_BATCH
+// of them at a time, so SDK task queue never holds more than one event. When posting fails anyway, it is
+// tried again every TMR_APP_TASK_RETRY_MS.
+#define TASK_QUEUE_LEN				1
+#define CTRL_APP_QUEUE_LEN			12
+#define CTRL_APP_QUEUE_BATCH		4
+#define TMR_APP_TASK_RETRY_MS		10
+
+// Server is told to backoff before we run out of room for its messages, when any of these reaches its high
+// watermark: messages waiting in app queue, free heap, or time user app needs to process the waiting messages.
+// Rest of the app queue takes messages that are already on the wire, if it fills up anyway the message is not
+// acknowledged as processed and Server sends it again after it backs off. Backoff is released when all of them are
+// back at their low watermarks and Server confirmed our backoff. While backed off, this is re-checked every
+// TMR_BACKOFF_CHECK_MS in case nothing else happens.
+#define CTRL_APP_QUEUE_BACKOFF		8
+#define CTRL_APP_QUEUE_RESUME		2
+#define CTRL_BACKOFF_HEAP_LOW		6144
+#define CTRL_BACKOFF_HEAP_RESUME	10240
+#define CTRL_BACKOFF_DRAIN_MS		500
+#define CTRL_BACKOFF_DRAIN_RESUME_MS	100
+#define TMR_BACKOFF_CHECK_MS		100
+
+// When defined, backoff controller doesn't backoff Server with CTRL protocol but stops reading from the socket
+// with espconn_recv_hold(), so TCP receive window throttles Server and nothing needs to be re-sent. Protocol
+// backoff is then used only for messages app queue can't take, from a segment that arrived before the hold.
+// Releasing lets go of the socket first, Server's confirmation of such protocol backoff can't arrive otherwise.
+//#define CTRL_FLOW_CONTROL_TCP
 
 #define SETUP_OK_KEY					0xAA4529BA	// MAGIC VALUE. When settings exist in flash this is the valid-flag.
 
@@ -68,26 +119,71 @@ typedef struct {
 	void(*message_received)(tCtrlMessage *);
 } tCtrlAppCallbacks;
 
+// how often the backoff controller did what
+typedef struct {
+	unsigned long byQueue; // backed off because app queue reached its high watermark
+	unsigned long byHeap; // backed off because free heap dropped to its low watermark
+	unsigned long byTime; // backed off because user app would need too long to process waiting messages
+	unsigned long released; // backoff released
+	unsigned long deferred; // backoff could be released but Server didn't confirm it yet
+	unsigned long refused; // messages Server has to send again because app queue was full or out of memory
+	unsigned long dropped; // notifications ignored because app queue was full or out of memory
+} tBackoffStats;
+
+// frame waiting in transmit queue
+typedef struct {
+	char *data;
+	unsigned short len;
+} tTxQueueItem;
+
+// frame of CTRL stack waiting for a free transmit queue slot
+typedef struct tTxOverflowItem {
+	char *data;
+	unsigned short len;
+	struct tTxOverflowItem *next;
+} tTxOverflowItem;
+
 // private
 static void ctrl_platform_reconnect(struct espconn *);
 static void ctrl_platform_discon(struct espconn *);
-static void ctrl_platform_check_ip(void *);
+static void ctrl_platform_tcp_connect(void);
+static void ctrl_platform_wifi_event_cb(System_Event_t *);
 static void ctrl_platform_recon_cb(void *, sint8);
 static void ctrl_platform_sent_cb(void *);
+static void ctrl_platform_tx_release(void);
+static void ctrl_platform_tx_drain(void);
+static void ctrl_platform_tx_coalesce_timer(void *);
+static void ctrl_platform_tx_flush(void);
+static unsigned char ctrl_platform_tx_room(unsigned char);
+static void ctrl_platform_tx_refill(void);
 static void ctrl_platform_recv_cb(void *, char *, unsigned short);
 static void ctrl_platform_connect_cb(void *);
 static void ctrl_platform_discon_cb(void *);
 static void ctrl_status_led_blinker(void *);
 static void ctrl_platform_task_processor(os_event_t *);
+static void ctrl_platform_task_post(void *);
+static void ctrl_platform_backoff_control(void);
+static void ctrl_platform_backoff_raise(void);
+static void ctrl_platform_backoff_refuse(void);
+static unsigned char ctrl_platform_backoff_release(void);
+static void ctrl_platform_backoff_reset(void);
+static void ctrl_platform_backoff_check(void *);
 static void ctrl_platform_enter_configuration_mode(void);
+#ifdef USE_DATABASE_APPROACH
+	static void ctrl_database_item_sender(void *);
+	static void ctrl_platform_rtt_sample(unsigned long);
+	static void ctrl_platform_retransmit_restart(void);
+	static void ctrl_platform_retransmit_timeout(void *);
+#endif
 // CTRL stack callbacks
-static void ctrl_message_recv_cb(tCtrlMessage *);
+static unsigned char ctrl_message_recv_cb(tCtrlMessage *);
 static void ctrl_message_ack_cb(tCtrlMessage *);
 static void ctrl_auth_response_cb(void);
 static char ctrl_send_data_cb(char *, unsigned short);
 
 // public
 unsigned char ctrl_platform_send(char *, unsigned short, unsigned char);
+void ctrl_platform_get_backoff_stats(tBackoffStats *);
 void ctrl_platform_init(void);
 
 #endif
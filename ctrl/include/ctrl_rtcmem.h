@@ -0,0 +1,19 @@
+#ifndef __CTRL_RTCMEM_H
+#define __CTRL_RTCMEM_H
+
+// Map of the user part of RTC memory. RTC memory survives reset and deep sleep, it is addressed in blocks
+// of 4 bytes and the user part of it is blocks 64 to 191 (512 bytes). Everything that keeps data there
+// takes its range from here, so nobody writes over anybody else:
+//
+//	blocks  64 ..  69	CTRL session ticket (tCtrlSessionTicket in ctrl_stack.h, 24 bytes)
+//	blocks  70 .. 191	free, user app takes them from RTCMEM_APP_START on
+//
+#define RTCMEM_USER_START				64
+#define RTCMEM_USER_END					192 // first block after the user part
+
+#define RTCMEM_CTRL_SESSION_TICKET		64
+#define RTCMEM_CTRL_SESSION_TICKET_LEN	6 // in blocks
+
+#define RTCMEM_APP_START				(RTCMEM_CTRL_SESSION_TICKET + RTCMEM_CTRL_SESSION_TICKET_LEN)
+
+#endif
@@ -0,0 +1,33 @@
+#ifndef __CTRL_RXPOOL_H
+#define __CTRL_RXPOOL_H
+
+#include "c_types.h"
+
+// Preallocated receive buffers. Received frame that carries data is decrypted into one of these and the
+// message is handed to the user app right there, without copying. Size must be a multiple of 16, it holds
+// everything after the IV block, so it fits messages with up to 121 bytes of data (or a container of them).
+// Every message that is waiting in the app queue or in reorder buffer keeps its buffer taken, so there
+// should be at least CTRL_APP_QUEUE_BACKOFF+CTRL_REORDER_SLOTS+1 of them. Longer messages (or when pool is
+// exhausted) are decrypted in place and copied to heap by whoever needs to keep them. Pool takes
+// SIZE*COUNT bytes (1664 by default) of RAM for good.
+#define CTRL_RXPOOL_SIZE		128
+#define CTRL_RXPOOL_COUNT		13
+
+typedef struct {
+	unsigned long hits; // frames decrypted into the pool
+	unsigned long exhausted; // frames that didn't get a buffer because all were taken
+	unsigned long tooLong; // frames that didn't get a buffer because they are longer than CTRL_RXPOOL_SIZE
+	unsigned char inUse; // pool buffers currently taken
+	unsigned char highWater; // most pool buffers ever taken at the same time
+} tRxPoolStats;
+
+// private
+static unsigned char ctrl_rxpool_index(char *);
+
+// public
+char * ctrl_rxpool_alloc(unsigned short);
+unsigned char ctrl_rxpool_ref(char *);
+unsigned char ctrl_rxpool_unref(char *);
+void ctrl_rxpool_get_stats(tRxPoolStats *);
+
+#endif
@@ -2,20 +2,62 @@
 #define __CTRL_STACK_H
 
 #include "c_types.h"
+#include "ctrl_rtcmem.h"
 
 #define TMR_DATA_EXPECTER_MS	10000 // for how long should we expect data from socket in case it didn't fully arrive
+#define TMR_ACK_DELAY_MS		50 // for how long can cumulative ACK wait for more messages to cover
+#define CTRL_CUMULATIVE_ACK_MAX	8 // cumulative ACK goes out after covering this many messages at the latest
+#define TMR_REORDER_MS			500 // for how long can messages that arrived early wait for the ones before them
+#define CTRL_REORDER_SLOTS		4 // how many messages that arrived early we can hold, they must be at most this far ahead of the next expected one
+
+// Longest frame (including its ALL_LENGTH field) that is collected in a static buffer when it arrives
+// split over multiple TCP segments. Longer ones are collected on heap. Frames which arrive whole in one
+// segment are processed in place. It takes this many bytes of RAM for good, so keep it small.
+#define CTRL_RX_BUFF_SIZE		512
+#define CTRL_FRAME_MAX_LENGTH	0xFFF0 // longest ALL_LENGTH of a valid frame, whole blocks and the entire frame fits into 0xFFFF bytes
+
+// Container frames (when Server supports them) carry multiple messages under one IV and CMAC.
+// CTRL_CONTAINER_DATA_SIZE is the most bytes of records one container carries, chosen so that
+// the frame fits the largest transmit pool buffer. Each record is [LENGTH 2][HEADER 1][TXsender 4][DATA n].
+#define CTRL_CONTAINER_DATA_SIZE	448
+#define CTRL_CONTAINER_MAX_RECORDS	16 // most messages sent in one container, also most ACKs collected while processing received data
+
+// Session ticket Server issued after the last authorization is kept in RTC memory (it survives reset and deep
+// sleep). Next authorization presents it instead of baseid alone and, if Server accepts it, skips the challenge.
+// Data of such authorization frame is [BASEID 16][TICKET 16][COUNTER 4][PROOF 16], PROOF is CMAC over everything
+// before it padded with zeros to 48 bytes. COUNTER grows with every presentation of the same ticket and is saved before the frame goes out.
+// Server keeps the last ticket it issued to each Base together with the highest COUNTER it accepted with it (0 when
+// issued), and accepts only that ticket with a valid PROOF and a higher COUNTER, so a recorded frame can't be
+// replayed. It replies with SYSTEM_MESSAGE_SESSION_RESUMED then, encrypted with the key like the reply to a
+// challenge response. Otherwise it sends the usual challenge, Base drops the ticket then and waits for a new one.
+#define CTRL_SESSION_TICKET_RTC_ADDR	RTCMEM_CTRL_SESSION_TICKET // in 4 byte blocks, see ctrl_rtcmem.h
+#define CTRL_SESSION_TICKET_MAGIC		0x7C5E7A1D // ticket in RTC memory is valid when it starts with this
 
 typedef struct {
 	unsigned short length;
 	char header;
 	unsigned long TXsender;
-	char *data;
+	char *data; // NULL for received frames whose data wasn't decrypted because it isn't used (ACKs, re-transmissions...)
 } tCtrlMessage;
 
+// session ticket as it is kept in RTC memory
+typedef struct {
+	unsigned long magic;
+	unsigned long counter; // how many times ticket was presented
+	char ticket[16];
+} tCtrlSessionTicket;
+
+// ACK waiting to be sent together with other ACKs in a container
 typedef struct {
-	void(*message_received)(tCtrlMessage *);
+	char header;
+	unsigned long TXsender;
+	unsigned long TXserver; // sent as data when header has CH_SAVE_TXSERVER
+} tCtrlPendingAck;
+
+typedef struct {
+	unsigned char(*message_received)(tCtrlMessage *); // returns 0 when message was taken, 1 when it can't be taken now (Server sends it again after it backs off)
 	void(*message_acked)(tCtrlMessage *);
-	char(*send_data)(char *, unsigned short);
+	char(*send_data)(char *, unsigned short); // when it returns ESPCONN_OK it takes over the buffer and must ctrl_txpool_free() it after it is sent
 	void(*auth_response)(void);
 } tCtrlCallbacks;
 
@@ -36,18 +78,47 @@ typedef struct {
 #define	SYSTEM_MESSAGE_SAVE_VAR			0x04
 #define	SYSTEM_MESSAGE_GET_VAR			0x05
 #define	SYSTEM_MESSAGE_GET_RTC			0x06
+#define	SYSTEM_MESSAGE_CAPABILITIES		0x07 // [0x07][capability bits], Base tells what it supports, Server replies with what it will use
+#define	SYSTEM_MESSAGE_CONTAINER		0x08 // [0x08][record][record]..., sent as notification, records are processed as if they arrived on their own
+#define	SYSTEM_MESSAGE_SESSION_TICKET	0x09 // [0x09][TICKET 16], sent by Server after authorization, presented on the next one to resume the session
+#define	SYSTEM_MESSAGE_SESSION_RESUMED	0x0A // [0x0A][TXserver 4], Server's reply to authorization with a session ticket it accepted (SYNC in header like the usual reply)
+
+// Capability bits, negotiated with SYSTEM_MESSAGE_CAPABILITIES after authorization
+#define CTRL_CAP_CONTAINER		0x01
+#define CTRL_CAP_CUMULATIVE_ACK	0x02 // PROCESSED ACK on TXsender acknowledges all messages up to and including TXsender
+#define CTRL_CAP_SESSION_TICKET	0x04 // Server issues session tickets
+#define CTRL_CAPABILITIES		(CTRL_CAP_CONTAINER | CTRL_CAP_CUMULATIVE_ACK | CTRL_CAP_SESSION_TICKET) // what this Base supports
 
 // private
 static unsigned short ctrl_find_message(char *, unsigned short);
 static void ctrl_stack_process_message(tCtrlMessage *);
+static void ctrl_stack_process_frame(char *, unsigned short);
+static unsigned char ctrl_stack_deliver(tCtrlMessage *);
+static void ctrl_stack_rx_reset(void);
+static unsigned char ctrl_stack_wants_data(tCtrlMessage *);
 static unsigned char ctrl_stack_send_msg(tCtrlMessage *);
+static void ctrl_stack_process_container(tCtrlMessage *);
+static unsigned char ctrl_stack_send_ack(tCtrlMessage *);
+static void ctrl_stack_flush_acks(void);
+static void ctrl_stack_delay_ack(void);
+static void ctrl_stack_flush_cumulative_ack(void);
+static void ctrl_stack_send_capabilities(void);
+static unsigned char ctrl_stack_take_ticket(char *);
+static void ctrl_stack_save_ticket(char *);
+static void ctrl_stack_drop_ticket(void);
+static unsigned char ctrl_stack_reorder_hold(tCtrlMessage *);
+static void ctrl_stack_reorder_release(void);
+static void ctrl_stack_reorder_clear(void);
+static void ctrl_stack_reorder_reject(char);
 
 // public
 void reverse_buffer(char *, unsigned short);
-void ctrl_stack_backoff(unsigned char);
+unsigned char ctrl_stack_backoff(unsigned char);
 void ctrl_stack_keepalive(unsigned char);
 void ctrl_stack_get_rtc(void);
 unsigned char ctrl_stack_send(char *, unsigned short, unsigned long, unsigned char);
+unsigned char ctrl_stack_send_container(tCtrlMessage *, unsigned char);
+unsigned char ctrl_stack_capabilities(void);
 void ctrl_stack_recv(char *, unsigned short);
 void ctrl_stack_authorize(char *, char *, unsigned char);
 void ctrl_stack_init(tCtrlCallbacks *);
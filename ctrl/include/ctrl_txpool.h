@@ -0,0 +1,34 @@
+#ifndef __CTRL_TXPOOL_H
+#define __CTRL_TXPOOL_H
+
+#include "c_types.h"
+
+// Preallocated transmit frame buffers, in three size classes. Sizes must be multiples of 16.
+// A frame carrying N bytes of data takes 2+(16*((23+N)/16)+16)+16 bytes, so:
+// small fits ACKs, keep-alives, system messages and data up to 8 bytes,
+// medium fits data up to 72 bytes and large fits data up to 456 bytes.
+// Anything longer (or when a class is exhausted) is allocated from heap. Pool takes
+// SIZE*COUNT of every class (1280 bytes by default) of RAM for good.
+#define CTRL_TXPOOL_SMALL_SIZE		64
+#define CTRL_TXPOOL_SMALL_COUNT		8
+#define CTRL_TXPOOL_MEDIUM_SIZE		128
+#define CTRL_TXPOOL_MEDIUM_COUNT	2
+#define CTRL_TXPOOL_LARGE_SIZE		512
+#define CTRL_TXPOOL_LARGE_COUNT		1
+
+typedef struct {
+	unsigned long hits; // allocations served from the pool
+	unsigned long misses; // allocations that had to fall back to heap
+	unsigned char inUse; // pool buffers currently taken
+	unsigned char highWater; // most pool buffers ever taken at the same time
+} tTxPoolStats;
+
+// private
+static char * ctrl_txpool_take(char *, unsigned short, unsigned char, unsigned long *);
+
+// public
+char * ctrl_txpool_alloc(unsigned short);
+void ctrl_txpool_free(char *);
+void ctrl_txpool_get_stats(tTxPoolStats *);
+
+#endif
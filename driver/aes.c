@@ -51,6 +51,9 @@
 */
 #include "include/aes.h"
 
+// 32-bit T-table implementation is found in aes_ttable.c
+#if !AES_TTABLES
+
 //! Lower 8 bits of AES polynomial (x^8+x^4+x^3+x+1), ie. (x^4+x^3+x+1).
 #define BPOLY 0x1b
 
@@ -626,3 +629,49 @@ void ICACHE_FLASH_ATTR invCipher( byte * block, const byte * key )
 	invShiftRows( block );
 	invSubstituteAndAddConstant( block, scheduleBuffer, 16 );
 }
+
+void ICACHE_FLASH_ATTR expandKey( tAesKeySchedule * schedule, const byte * key )
+{
+	byte roundConstant[4] = { 0x01, 0x00, 0x00, 0x00 };
+
+	copyBytes( schedule->roundKey[0], key, 16 );
+
+	byte round;
+	for( round = 1; round < AES_ROUND_KEYS; ++round ) {
+		// Next round key is calculated in place from a copy of the previous one.
+		copyBytes( schedule->roundKey[round], schedule->roundKey[round-1], 16 );
+		keyExpansion( schedule->roundKey[round], roundConstant );
+	}
+}
+
+void ICACHE_FLASH_ATTR cipherWithSchedule( byte * block, const tAesKeySchedule * schedule )
+{
+	byte round;
+	for( round = 0; round < 9; ++round ) {
+		addConstantAndSubstitute( block, schedule->roundKey[round], 16 );
+		shiftRows( block );
+		mixColumns( block );
+	}
+
+	addConstantAndSubstitute( block, schedule->roundKey[9], 16 );
+	shiftRows( block );
+
+	addConstant( block, schedule->roundKey[10], 16 );
+}
+
+void ICACHE_FLASH_ATTR invCipherWithSchedule( byte * block, const tAesKeySchedule * schedule )
+{
+	addConstant( block, schedule->roundKey[10], 16 );
+
+	byte round;
+	for( round = 9; round > 0; --round ) {
+		invShiftRows( block );
+		invSubstituteAndAddConstant( block, schedule->roundKey[round], 16 );
+		invMixColumns( block );
+	}
+
+	invShiftRows( block );
+	invSubstituteAndAddConstant( block, schedule->roundKey[0], 16 );
+}
+
+#endif // !AES_TTABLES
@@ -8,7 +8,28 @@
 
 // AES 128 in CBC-mode (as seen here: https://polarssl.org/aes-source-code)
 // "data" must be prepared in 16 byte blocks (16, 32, 48, ...)!
+// Key is expanded once for the whole buffer. When encrypting many buffers with the
+// same key, expand it once with expandKey() and use aes128_cbc_encrypt_schedule().
 void ICACHE_FLASH_ATTR aes128_cbc_encrypt(unsigned char *data, unsigned int length, const char *key)
+{
+	tAesKeySchedule schedule;
+
+	expandKey(&schedule, (const unsigned char *)key);
+	aes128_cbc_encrypt_schedule(data, length, &schedule);
+}
+
+// AES 128 in CBC-mode (as seen here: https://polarssl.org/aes-source-code)
+// "data" must be prepared in 16 byte blocks (16, 32, 48, ...)!
+void ICACHE_FLASH_ATTR aes128_cbc_decrypt(unsigned char *data, unsigned int length, const char *key)
+{
+	tAesKeySchedule schedule;
+
+	expandKey(&schedule, (const unsigned char *)key);
+	aes128_cbc_decrypt_schedule(data, length, &schedule);
+}
+
+// Same as aes128_cbc_encrypt() but with already expanded key
+void ICACHE_FLASH_ATTR aes128_cbc_encrypt_schedule(unsigned char *data, unsigned int length, const tAesKeySchedule *schedule)
 {
 	unsigned char iv[16];
 	unsigned int i;
@@ -22,7 +43,7 @@ void ICACHE_FLASH_ATTR aes128_cbc_encrypt(unsigned char *data, unsigned int leng
 			data[i] = (unsigned char)( data[i] ^ iv[i] );
 		}
 
-		cipher(data, key);
+		cipherWithSchedule(data, schedule);
 		os_memcpy(iv, data, 16);
 
 		data += 16;
@@ -30,9 +51,8 @@ void ICACHE_FLASH_ATTR aes128_cbc_encrypt(unsigned char *data, unsigned int leng
 	}
 }
 
-// AES 128 in CBC-mode (as seen here: https://polarssl.org/aes-source-code)
-// "data" must be prepared in 16 byte blocks (16, 32, 48, ...)!
-void ICACHE_FLASH_ATTR aes128_cbc_decrypt(unsigned char *data, unsigned int length, const char *key)
+// Same as aes128_cbc_decrypt() but with already expanded key
+void ICACHE_FLASH_ATTR aes128_cbc_decrypt_schedule(unsigned char *data, unsigned int length, const tAesKeySchedule *schedule)
 {
 	unsigned char iv[16];
 	unsigned char temp[16];
@@ -44,7 +64,7 @@ void ICACHE_FLASH_ATTR aes128_cbc_decrypt(unsigned char *data, unsigned int leng
 	{
 		os_memcpy(temp, data, 16);
 
-		invCipher(data, key);
+		invCipherWithSchedule(data, schedule);
 
 		for( i = 0; i < 16; i++ )
 		{
@@ -57,3 +77,58 @@ void ICACHE_FLASH_ATTR aes128_cbc_decrypt(unsigned char *data, unsigned int leng
 		length -= 16;
 	}
 }
+
+// Decrypts only block number "block" (counting from 0) of CBC-mode ciphertext "data" into "out" (16 bytes),
+// "data" is left untouched. CBC allows that because each block only needs the ciphertext of the block before it.
+void ICACHE_FLASH_ATTR aes128_cbc_decrypt_block_schedule(const unsigned char *data, unsigned int block, const tAesKeySchedule *schedule, unsigned char *out)
+{
+	unsigned int i;
+
+	os_memcpy(out, data + 16*block, 16);
+	invCipherWithSchedule(out, schedule);
+
+	if(block > 0)
+	{
+		for( i = 0; i < 16; i++ )
+		{
+			out[i] = (unsigned char)( out[i] ^ data[16*(block-1) + i] );
+		}
+	}
+}
+
+// Decrypts blocks from "firstBlock" (counting from 0) to the end of "data" in place, leaving blocks before it
+// encrypted. It goes from the last block backwards so ciphertext of the previous block is still there when needed.
+void ICACHE_FLASH_ATTR aes128_cbc_decrypt_from_schedule(unsigned char *data, unsigned int length, unsigned int firstBlock, const tAesKeySchedule *schedule)
+{
+	unsigned int block = length / 16;
+	unsigned int i;
+
+	while (block > firstBlock)
+	{
+		block--;
+
+		unsigned char *p = data + 16*block;
+		invCipherWithSchedule(p, schedule);
+
+		if(block > 0)
+		{
+			for( i = 0; i < 16; i++ )
+			{
+				p[i] = (unsigned char)( p[i] ^ data[16*(block-1) + i] );
+			}
+		}
+	}
+}
+
+// Like aes128_cbc_decrypt_from_schedule() but leaves "data" untouched and writes the plaintext of blocks from
+// "firstBlock" on into "out", so it can be decrypted straight out of a buffer that isn't ours to keep.
+void ICACHE_FLASH_ATTR aes128_cbc_decrypt_to_schedule(const unsigned char *data, unsigned int length, unsigned int firstBlock, const tAesKeySchedule *schedule, unsigned char *out)
+{
+	unsigned int block;
+
+	for(block = firstBlock; block < length / 16; block++)
+	{
+		aes128_cbc_decrypt_block_schedule(data, block, schedule, out);
+		out += 16;
+	}
+}
@@ -0,0 +1,136 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "mem.h"
+
+#include "include/aes.h"
+#include "include/cmac.h"
+#include "include/aes_cbc_cmac.h"
+
+/*
+	Fused AES-128 CBC + CMAC kernels for encrypt-then-MAC and verify-then-decrypt
+	of whole CTRL frames. The result is exactly the same as calling
+	aes128_cbc_encrypt_schedule() and then cmac_generate_ctx() over the ciphertext
+	(or cmac_generate_ctx() and then aes128_cbc_decrypt_schedule()), but every
+	16 byte block is walked only once and both chains are advanced while the block
+	is still at hand.
+
+	"data" must be prepared in 16 byte blocks (16, 32, 48, ...)! Both CBC and CMAC
+	use the key from the CMAC context.
+*/
+
+/*
+	XOR 16 bytes of "in" into "out".
+*/
+static void ICACHE_FLASH_ATTR aes128_xor_block(unsigned char *out, const unsigned char *in) {
+	unsigned char i;
+	for (i=0; i<16; i++) {
+		out[i] ^= in[i];
+	}
+}
+
+/*
+	Encrypt "data" in place in CBC-mode with zero IV and place CMAC of the
+	resulting ciphertext into "mac" (16 bytes).
+*/
+void ICACHE_FLASH_ATTR aes128_cbc_encrypt_cmac(unsigned char *data, unsigned int length, tCmacContext *ctx, unsigned char *mac) {
+	// CMAC over complete blocks takes its last block from this position, wrapped at 256 bytes (see cmac_generate_ctx())
+	unsigned short n = length / 16;
+	unsigned int index = (unsigned char)(16 * (n-1));
+	unsigned char *M_last = NULL;
+
+	unsigned char *iv = NULL; // previous ciphertext block, NULL means zero IV
+	unsigned int offset;
+
+	os_memset(mac, 0, 16);
+
+	for (offset=0; offset<length; offset+=16) {
+		// CBC: C(i) := AES-128(KEY, P(i) (+) C(i-1))
+		if (iv != NULL) {
+			aes128_xor_block(data, iv);
+		}
+		cipherWithSchedule(data, ctx->schedule);
+
+		// CMAC: X := AES-128(KEY, X (+) C(i))
+		aes128_xor_block(mac, data);
+		cipherWithSchedule(mac, ctx->schedule);
+
+		if (offset == index) {
+			M_last = data;
+		}
+
+		iv = data;
+		data += 16;
+	}
+
+	// CMAC: T := AES-128(KEY, X (+) M_last (+) K1)
+	aes128_xor_block(mac, M_last);
+	aes128_xor_block(mac, ctx->K1);
+	cipherWithSchedule(mac, ctx->schedule);
+}
+
+/*
+	Calculate CMAC of ciphertext "data" and decrypt it in place in CBC-mode with
+	zero IV. Returns 1 if calculated CMAC matches "mac" (16 bytes), 0 otherwise.
+	If CMAC doesn't match the content of "data" must be thrown away.
+*/
+unsigned char ICACHE_FLASH_ATTR aes128_cmac_verify_cbc_decrypt(unsigned char *data, unsigned int length, tCmacContext *ctx, const unsigned char *mac) {
+	if (length == 0) {
+		return 0; // nothing to authenticate, can't be a valid frame
+	}
+
+	// CMAC over complete blocks takes its last block from this position, wrapped at 256 bytes (see cmac_generate_ctx())
+	unsigned short n = length / 16;
+	unsigned int index = (unsigned char)(16 * (n-1));
+	unsigned char M_last[16]; // ciphertext gets overwritten in place, so keep a copy of this one
+
+	unsigned char X[16];
+	unsigned char iv[16];
+	unsigned char temp[16];
+	unsigned int offset;
+
+	os_memset(X, 0, 16);
+	os_memset(iv, 0, 16);
+
+	for (offset=0; offset<length; offset+=16) {
+		// CMAC: X := AES-128(KEY, X (+) C(i))
+		aes128_xor_block(X, data);
+		cipherWithSchedule(X, ctx->schedule);
+
+		if (offset == index) {
+			os_memcpy(M_last, data, 16);
+		}
+
+		// CBC: P(i) := AES-128-INV(KEY, C(i)) (+) C(i-1)
+		os_memcpy(temp, data, 16);
+		invCipherWithSchedule(data, ctx->schedule);
+		aes128_xor_block(data, iv);
+		os_memcpy(iv, temp, 16);
+
+		data += 16;
+	}
+
+	// CMAC: T := AES-128(KEY, X (+) M_last (+) K1)
+	aes128_xor_block(X, M_last);
+	aes128_xor_block(X, ctx->K1);
+	cipherWithSchedule(X, ctx->schedule);
+
+	return os_memcmp(X, mac, 16) == 0;
+}
+
+/*
+	Calculate CMAC of ciphertext "data" without decrypting it. Returns 1 if
+	calculated CMAC matches "mac" (16 bytes), 0 otherwise. Use it when only
+	some of the blocks need to be decrypted afterwards.
+*/
+unsigned char ICACHE_FLASH_ATTR aes128_cmac_verify(unsigned char *data, unsigned int length, tCmacContext *ctx, const unsigned char *mac) {
+	unsigned char X[16];
+
+	if (length == 0) {
+		return 0;
+	}
+
+	cmac_generate_ctx(ctx, data, length, X);
+
+	return os_memcmp(X, mac, 16) == 0;
+}
@@ -59,15 +59,15 @@ static void ICACHE_FLASH_ATTR cmac_xor_buffers(unsigned char *in_buff1, unsigned
    The outputs of the subkey generation algorithm are two subkeys, K1
    and K2.  We write (K1,K2) := Generate_Subkey(K).
 
-   KEY, out_K1, out_K2 must be 16 bytes long arrays.
+   out_K1, out_K2 must be 16 bytes long arrays.
 */
-static void ICACHE_FLASH_ATTR cmac_generate_sub_keys(unsigned char *KEY, unsigned char *out_K1, unsigned char *out_K2) {
+static void ICACHE_FLASH_ATTR cmac_generate_sub_keys(const tAesKeySchedule *schedule, unsigned char *out_K1, unsigned char *out_K2) {
 	// Step 1. (using out_K2 as L buffer for generating K1)
 	unsigned char i;
 	for(i=0; i<16; i++) {
 		out_K2[i] = 0;
 	}
-	aes128_cbc_encrypt(out_K2, 16, KEY);
+	cipherWithSchedule(out_K2, schedule);
 
 	// Step 2.
 	cmac_left_shift_buffer(out_K2, out_K1, 16);
@@ -85,9 +85,37 @@ static void ICACHE_FLASH_ATTR cmac_generate_sub_keys(unsigned char *KEY, unsigne
 }
 
 void ICACHE_FLASH_ATTR cmac_generate(unsigned char *KEY, unsigned char *input, unsigned short length, unsigned char *result) {
-	unsigned char K1[16], K2[16];
-	cmac_generate_sub_keys(KEY, K1, K2);
+	tAesKeySchedule schedule;
 
+	expandKey(&schedule, KEY);
+	cmac_generate_schedule(&schedule, input, length, result);
+}
+
+/*
+	Same as cmac_generate() but with already expanded key, so that the
+	key doesn't get expanded again for every block of the input.
+*/
+void ICACHE_FLASH_ATTR cmac_generate_schedule(const tAesKeySchedule *schedule, unsigned char *input, unsigned short length, unsigned char *result) {
+	tCmacContext ctx;
+
+	cmac_prepare(&ctx, schedule);
+	cmac_generate_ctx(&ctx, input, length, result);
+}
+
+/*
+	Derive K1 and K2 for the given key schedule and cache them in "ctx".
+	Must be called again whenever the key behind "schedule" changes.
+*/
+void ICACHE_FLASH_ATTR cmac_prepare(tCmacContext *ctx, const tAesKeySchedule *schedule) {
+	ctx->schedule = schedule;
+	cmac_generate_sub_keys(schedule, ctx->K1, ctx->K2);
+}
+
+/*
+	Same as cmac_generate() but with prepared context, so that neither the key
+	gets expanded nor the subkeys K1 and K2 get derived again for every input.
+*/
+void ICACHE_FLASH_ATTR cmac_generate_ctx(tCmacContext *ctx, unsigned char *input, unsigned short length, unsigned char *result) {
 	unsigned short n = (length + 15) / 16; // n is number of rounds
 	unsigned char lenMod16 = length % 16; // will need later (optimization for speed)
 
@@ -105,17 +133,18 @@ void ICACHE_FLASH_ATTR cmac_generate(unsigned char *KEY, unsigned char *input, u
 		}
 	}
 
-	unsigned char *M_last;
-	unsigned char index = 16 * (n-1);
+	unsigned char M_last[16]; // can't reuse K1/K2 space for it any more, they are cached in ctx
+
+	// Offset of the last block wraps at 256 bytes, like it always did. Inputs of 17 blocks or
+	// more therefore take M_last from an earlier block. This is part of the wire format, the
+	// Server calculates it the same way, so don't "fix" it here alone!
+	unsigned int index = (unsigned char)(16 * (n-1));
 
 	// last block is complete block
 	if (flag) {
-		M_last = &K2[0]; // using the same RAM space for M_last as that of K2 - size optimization
-		cmac_xor_buffers(&input[index], K1, M_last, 16);
+		cmac_xor_buffers(&input[index], ctx->K1, M_last, 16);
 	}
 	else {
-		M_last = &K1[0]; // using the same RAM space for M_last as that of K1 - size optimization
-
 		// padding input and xoring with K2 at the same time
 		unsigned char j;
 		for (j=0; j<16; j++ ) {
@@ -130,22 +159,22 @@ void ICACHE_FLASH_ATTR cmac_generate(unsigned char *KEY, unsigned char *input, u
 				temp = 0x00; // the rest is padded with 0x00
 			}
 
-			M_last[j] = temp ^ K2[j];
+			M_last[j] = temp ^ ctx->K2[j];
 		}
 	}
 
-	unsigned char i;
+	unsigned short i;
 	for (i=0; i<16; i++) {
 		result[i] = 0;
 	}
 
 	for (i=0; i<n; i++) {
 		cmac_xor_buffers(result, &input[16*i], result, 16); // Y := Mi (+) X
-		aes128_cbc_encrypt(result, 16, KEY); // X := AES-128(KEY, Y);
+		cipherWithSchedule(result, ctx->schedule); // X := AES-128(KEY, Y);
 	}
 
 	cmac_xor_buffers(result, M_last, result, 16);
-	aes128_cbc_encrypt(result, 16, KEY);
+	cipherWithSchedule(result, ctx->schedule);
 
 	// Step 7. return T (already done)
 }
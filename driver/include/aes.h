@@ -65,9 +65,40 @@
 
 typedef uint8_t byte; //!< Handy typedef. Very readable.
 
+//! AES backend selection:
+//! 0 = original byte-oriented AVR411 code (aes.c),
+//! 1 = 32-bit T-table code with one 1KB table per direction, rotated on the fly (aes_ttable.c),
+//! 4 = 32-bit T-table code with four 1KB tables per direction (aes_ttable.c).
+//! T-tables are kept in flash (ICACHE_RODATA_ATTR) so they don't take any DRAM.
+//! All three pass the same known-answer tests in test/test_aes.c, "make -C test bench" compares their speed on host.
+#ifndef AES_TTABLES
+#define AES_TTABLES 0
+#endif
+
+//! Number of round keys in AES-128 key schedule (initial key + 10 rounds).
+#define AES_ROUND_KEYS 11
+
+//! Fully expanded AES-128 key schedule. Prepare it once with expandKey() and reuse it for every block encrypted or decrypted with the same key.
+#if AES_TTABLES
+typedef struct {
+	uint32_t encKey[ AES_ROUND_KEYS*4 ]; //!< Round keys as big-endian words, in encryption order.
+	uint32_t decKey[ AES_ROUND_KEYS*4 ]; //!< Round keys for the equivalent inverse cipher, in decryption order.
+} tAesKeySchedule;
+#else
+typedef struct {
+	byte roundKey[ AES_ROUND_KEYS ][ 16 ];
+} tAesKeySchedule;
+#endif
+
 //! Encrypt data block with on-the-fly calculation of key schedule in internal temp buffer
 void cipher( byte *, const byte *);
 //! Decrypt data block by also preparing the key schedule state in internal temp buffer
 void invCipher( byte *, const byte *);
+//! Expand key into all round keys of the key schedule
+void expandKey( tAesKeySchedule *, const byte * );
+//! Encrypt data block using previously expanded key schedule
+void cipherWithSchedule( byte *, const tAesKeySchedule * );
+//! Decrypt data block using previously expanded key schedule
+void invCipherWithSchedule( byte *, const tAesKeySchedule * );
 
 #endif
@@ -2,8 +2,14 @@
 #define __AES_CBC_H
 
 #include "c_types.h"
+#include "aes.h"
 
 void aes128_cbc_encrypt(unsigned char *, unsigned int, const char *);
 void aes128_cbc_decrypt(unsigned char *, unsigned int, const char *);
+void aes128_cbc_encrypt_schedule(unsigned char *, unsigned int, const tAesKeySchedule *);
+void aes128_cbc_decrypt_schedule(unsigned char *, unsigned int, const tAesKeySchedule *);
+void aes128_cbc_decrypt_block_schedule(const unsigned char *, unsigned int, const tAesKeySchedule *, unsigned char *);
+void aes128_cbc_decrypt_from_schedule(unsigned char *, unsigned int, unsigned int, const tAesKeySchedule *);
+void aes128_cbc_decrypt_to_schedule(const unsigned char *, unsigned int, unsigned int, const tAesKeySchedule *, unsigned char *);
 
 #endif
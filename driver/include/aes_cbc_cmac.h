@@ -0,0 +1,12 @@
+#ifndef __AES_CBC_CMAC_H
+#define __AES_CBC_CMAC_H
+
+#include "c_types.h"
+#include "aes.h"
+#include "cmac.h"
+
+void aes128_cbc_encrypt_cmac(unsigned char *, unsigned int, tCmacContext *, unsigned char *);
+unsigned char aes128_cmac_verify_cbc_decrypt(unsigned char *, unsigned int, tCmacContext *, const unsigned char *);
+unsigned char aes128_cmac_verify(unsigned char *, unsigned int, tCmacContext *, const unsigned char *);
+
+#endif
@@ -2,13 +2,24 @@
 #define __CMAC_H
 
 #include "c_types.h"
+#include "aes.h"
+
+// Prepared CMAC context: expanded key and subkeys K1, K2 derived from it
+typedef struct {
+	const tAesKeySchedule *schedule;
+	unsigned char K1[16];
+	unsigned char K2[16];
+} tCmacContext;
 
 // private
 static void cmac_left_shift_buffer(unsigned char *, unsigned char *, unsigned short);
 static void cmac_xor_buffers(unsigned char *, unsigned char *, unsigned char *, unsigned short);
-static void cmac_generate_sub_keys(unsigned char *, unsigned char *, unsigned char *);
+static void cmac_generate_sub_keys(const tAesKeySchedule *, unsigned char *, unsigned char *);
 
 // public
 void cmac_generate(unsigned char *, unsigned char *, unsigned short, unsigned char *);
+void cmac_generate_schedule(const tAesKeySchedule *, unsigned char *, unsigned short, unsigned char *);
+void cmac_prepare(tCmacContext *, const tAesKeySchedule *);
+void cmac_generate_ctx(tCmacContext *, unsigned char *, unsigned short, unsigned char *);
 
 #endif
@@ -0,0 +1,97 @@
+#include "ets_sys.h"
+#include "osapi.h"
+
+#include "../driver/include/aes.h"
+#include "../driver/include/aes_cbc.h"
+
+#include "test.h"
+
+/*
+	Throughput of the AES backend it is built with (AES_TTABLES), per 16 byte block.
+	Host numbers only tell how backends compare to each other, not how fast they are
+	on the target. Cycles are counted with the time stamp counter on x86, elsewhere
+	only nanoseconds are reported.
+*/
+
+#define BENCH_BLOCKS	20000
+#define BENCH_FRAME		128 // typical CTRL frame, without ALL_LENGTH and CMAC
+
+static uint64_t bench_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static uint64_t bench_cycles(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#else
+	return 0;
+#endif
+}
+
+static void bench_report(const char *what, uint64_t ns, uint64_t cycles, unsigned blocks)
+{
+	printf("  %-28s %8.1f ns/block", what, (double)ns / blocks);
+	if(cycles)
+	{
+		printf(" %8.1f cycles/block", (double)cycles / blocks);
+	}
+	printf(" %8.1f MB/s\n", blocks * 16.0 * 1000.0 / ns);
+}
+
+int main(void)
+{
+	static const unsigned char key[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+	unsigned char block[16];
+	unsigned char frame[BENCH_FRAME];
+	tAesKeySchedule schedule;
+	uint64_t ns, cycles;
+	unsigned i;
+
+	os_memset(block, 0x5a, 16);
+	os_memset(frame, 0xa5, sizeof(frame));
+	expandKey(&schedule, key);
+
+	printf("AES_TTABLES=%d\n", AES_TTABLES);
+
+	ns = bench_ns(); cycles = bench_cycles();
+	for(i=0; i<BENCH_BLOCKS; i++)
+	{
+		cipherWithSchedule(block, &schedule);
+	}
+	bench_report("cipherWithSchedule()", bench_ns() - ns, bench_cycles() - cycles, BENCH_BLOCKS);
+
+	ns = bench_ns(); cycles = bench_cycles();
+	for(i=0; i<BENCH_BLOCKS; i++)
+	{
+		invCipherWithSchedule(block, &schedule);
+	}
+	bench_report("invCipherWithSchedule()", bench_ns() - ns, bench_cycles() - cycles, BENCH_BLOCKS);
+
+	ns = bench_ns(); cycles = bench_cycles();
+	for(i=0; i<BENCH_BLOCKS; i++)
+	{
+		cipher(block, key);
+	}
+	bench_report("cipher(), key on the fly", bench_ns() - ns, bench_cycles() - cycles, BENCH_BLOCKS);
+
+	ns = bench_ns(); cycles = bench_cycles();
+	for(i=0; i<BENCH_BLOCKS / (BENCH_FRAME/16); i++)
+	{
+		aes128_cbc_encrypt_schedule(frame, sizeof(frame), &schedule);
+	}
+	bench_report("CBC encrypt, 128 byte frame", bench_ns() - ns, bench_cycles() - cycles, BENCH_BLOCKS);
+
+	ns = bench_ns(); cycles = bench_cycles();
+	for(i=0; i<BENCH_BLOCKS / (BENCH_FRAME/16); i++)
+	{
+		aes128_cbc_decrypt_schedule(frame, sizeof(frame), &schedule);
+	}
+	bench_report("CBC decrypt, 128 byte frame", bench_ns() - ns, bench_cycles() - cycles, BENCH_BLOCKS);
+
+	// keep the results alive
+	return (block[0] ^ frame[0]) == 0x100;
+}
@@ -0,0 +1,82 @@
+#ifndef __ESPCONN_H__
+#define __ESPCONN_H__
+
+#include "c_types.h"
+
+#define ESPCONN_OK			0
+#define ESPCONN_MEM			-1
+#define ESPCONN_TIMEOUT		-3
+#define ESPCONN_RTE			-4
+#define ESPCONN_INPROGRESS	-5
+#define ESPCONN_MAXNUM		-7
+#define ESPCONN_ABRT		-8
+#define ESPCONN_RST			-9
+#define ESPCONN_CLSD		-10
+#define ESPCONN_CONN		-11
+#define ESPCONN_ARG			-12
+#define ESPCONN_ISCONN		-15
+
+typedef void (*espconn_connect_callback)(void *);
+typedef void (*espconn_reconnect_callback)(void *, sint8);
+typedef void (*espconn_recv_callback)(void *, char *, unsigned short);
+typedef void (*espconn_sent_callback)(void *);
+
+enum espconn_type {
+	ESPCONN_INVALID = 0,
+	ESPCONN_TCP = 0x10,
+	ESPCONN_UDP = 0x20
+};
+
+enum espconn_state {
+	ESPCONN_NONE,
+	ESPCONN_WAIT,
+	ESPCONN_LISTEN,
+	ESPCONN_CONNECT,
+	ESPCONN_WRITE,
+	ESPCONN_READ,
+	ESPCONN_CLOSE
+};
+
+enum espconn_option {
+	ESPCONN_START = 0x00,
+	ESPCONN_REUSEADDR = 0x01,
+	ESPCONN_NODELAY = 0x02,
+	ESPCONN_COPY = 0x04,
+	ESPCONN_KEEPALIVE = 0x08,
+	ESPCONN_END
+};
+
+typedef struct _esp_tcp {
+	int remote_port;
+	int local_port;
+	uint8 local_ip[4];
+	uint8 remote_ip[4];
+} esp_tcp;
+
+struct espconn {
+	enum espconn_type type;
+	enum espconn_state state;
+	union {
+		esp_tcp *tcp;
+	} proto;
+	espconn_recv_callback recv_callback;
+	espconn_sent_callback sent_callback;
+	void *reverse;
+};
+
+sint8 espconn_connect(struct espconn *);
+sint8 espconn_disconnect(struct espconn *);
+sint8 espconn_sent(struct espconn *, uint8 *, uint16);
+sint8 espconn_accept(struct espconn *);
+sint8 espconn_regist_connectcb(struct espconn *, espconn_connect_callback);
+sint8 espconn_regist_reconcb(struct espconn *, espconn_reconnect_callback);
+sint8 espconn_regist_disconcb(struct espconn *, espconn_connect_callback);
+sint8 espconn_regist_recvcb(struct espconn *, espconn_recv_callback);
+sint8 espconn_regist_sentcb(struct espconn *, espconn_sent_callback);
+sint8 espconn_regist_time(struct espconn *, uint32, uint8);
+sint8 espconn_set_opt(struct espconn *, uint8);
+sint8 espconn_recv_hold(struct espconn *);
+sint8 espconn_recv_unhold(struct espconn *);
+uint32 espconn_port(void);
+
+#endif
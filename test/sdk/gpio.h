@@ -0,0 +1,17 @@
+#ifndef _GPIO_H_
+#define _GPIO_H_
+
+#include "c_types.h"
+
+#define GPIO_OUTPUT_SET(gpio_no, bit_value)	((void)(gpio_no), (void)(bit_value))
+#define GPIO_INPUT_GET(gpio_no)				((void)(gpio_no), 1)
+#define PIN_FUNC_SELECT(PIN_NAME, FUNC)		((void)(PIN_NAME), (void)(FUNC))
+
+#define PERIPHS_IO_MUX_MTDI_U	0
+#define PERIPHS_IO_MUX_GPIO0_U	0
+#define FUNC_GPIO0				0
+#define FUNC_GPIO12				3
+
+void gpio_init(void);
+
+#endif
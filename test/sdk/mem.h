@@ -0,0 +1,14 @@
+#ifndef __MEM_H__
+#define __MEM_H__
+
+#include "c_types.h"
+
+// heap goes through ../test.c, so tests can make allocations fail
+#define os_malloc(s)	test_malloc(s)
+#define os_zalloc(s)	test_zalloc(s)
+#define os_free(p)		test_free(p)
+void *test_malloc(size_t);
+void *test_zalloc(size_t);
+void test_free(void *);
+
+#endif
@@ -0,0 +1,28 @@
+#ifndef _OS_TYPES_H_
+#define _OS_TYPES_H_
+
+#include "c_types.h"
+
+typedef void os_timer_func_t(void *);
+
+// software timer, ../test.c fires it when test time passes its expiry
+typedef struct _os_timer_t {
+	os_timer_func_t *timer_func;
+	void *timer_arg;
+	uint32 timer_expire; // in ms of test time
+	uint32 timer_period; // 0 = one shot
+	uint8 timer_armed;
+} os_timer_t;
+typedef os_timer_t ETSTimer;
+
+typedef uint32 os_signal_t;
+typedef uint32 os_param_t;
+
+typedef struct {
+	os_signal_t sig;
+	os_param_t par;
+} os_event_t;
+
+typedef void (*os_task_t)(os_event_t *);
+
+#endif
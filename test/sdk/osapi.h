@@ -0,0 +1,29 @@
+#ifndef _OSAPI_H_
+#define _OSAPI_H_
+
+#include "os_type.h"
+
+#define os_memcmp	memcmp
+#define os_memcpy	memcpy
+#define os_memmove	memmove
+#define os_memset	memset
+#define os_strcat	strcat
+#define os_strchr	strchr
+#define os_strcmp	strcmp
+#define os_strcpy	strcpy
+#define os_strlen	strlen
+#define os_strncmp	strncmp
+#define os_strncpy	strncpy
+#define os_strstr	strstr
+#define os_sprintf	sprintf
+
+// logging goes to stdout only when TEST_VERBOSE is set
+#define os_printf		test_printf
+#define os_printf_plus	test_printf
+int test_printf(const char *, ...);
+
+void os_timer_disarm(os_timer_t *);
+void os_timer_setfn(os_timer_t *, os_timer_func_t *, void *);
+void os_timer_arm(os_timer_t *, uint32, bool);
+
+#endif
@@ -0,0 +1,106 @@
+#ifndef __USER_INTERFACE_H__
+#define __USER_INTERFACE_H__
+
+#include "os_type.h"
+
+#define USER_TASK_PRIO_0	0
+#define USER_TASK_PRIO_1	1
+#define USER_TASK_PRIO_2	2
+
+uint32 system_get_time(void);
+uint32 system_get_free_heap_size(void);
+bool system_os_task(os_task_t, uint8, os_event_t *, uint8);
+bool system_os_post(uint8, os_signal_t, os_param_t);
+bool system_rtc_mem_read(uint8, void *, uint16);
+bool system_rtc_mem_write(uint8, const void *, uint16);
+void system_restart(void);
+
+struct ip_addr {
+	uint32 addr;
+};
+
+struct ip_info {
+	struct ip_addr ip;
+	struct ip_addr netmask;
+	struct ip_addr gw;
+};
+
+#define STATION_IF		0x00
+#define SOFTAP_IF		0x01
+
+#define NULL_MODE		0x00
+#define STATION_MODE	0x01
+#define SOFTAP_MODE		0x02
+#define STATIONAP_MODE	0x03
+
+enum {
+	STATION_IDLE = 0,
+	STATION_CONNECTING,
+	STATION_WRONG_PASSWORD,
+	STATION_NO_AP_FOUND,
+	STATION_CONNECT_FAIL,
+	STATION_GOT_IP
+};
+
+struct station_config {
+	uint8 ssid[32];
+	uint8 password[64];
+	uint8 bssid_set;
+	uint8 bssid[6];
+};
+
+struct softap_config {
+	uint8 ssid[32];
+	uint8 password[64];
+	uint8 ssid_len;
+	uint8 channel;
+	uint8 authmode;
+	uint8 ssid_hidden;
+	uint8 max_connection;
+	uint16 beacon_interval;
+};
+
+uint8 wifi_get_opmode(void);
+bool wifi_set_opmode(uint8);
+bool wifi_get_ip_info(uint8, struct ip_info *);
+uint8 wifi_station_get_connect_status(void);
+bool wifi_station_get_config(struct station_config *);
+
+enum {
+	EVENT_STAMODE_CONNECTED = 0,
+	EVENT_STAMODE_DISCONNECTED,
+	EVENT_STAMODE_AUTHMODE_CHANGE,
+	EVENT_STAMODE_GOT_IP,
+	EVENT_STAMODE_DHCP_TIMEOUT,
+	EVENT_SOFTAPMODE_STACONNECTED,
+	EVENT_SOFTAPMODE_STADISCONNECTED,
+	EVENT_MAX
+};
+
+typedef struct {
+	uint8 ssid[32];
+	uint8 ssid_len;
+	uint8 bssid[6];
+	uint8 reason;
+} Event_StaMode_Disconnected_t;
+
+typedef struct {
+	struct ip_addr ip;
+	struct ip_addr mask;
+	struct ip_addr gw;
+} Event_StaMode_Got_IP_t;
+
+typedef union {
+	Event_StaMode_Disconnected_t disconnected;
+	Event_StaMode_Got_IP_t got_ip;
+} Event_Info_u;
+
+typedef struct _esp_event {
+	uint32 event;
+	Event_Info_u event_info;
+} System_Event_t;
+
+typedef void (*wifi_event_handler_cb_t)(System_Event_t *);
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t);
+
+#endif
@@ -0,0 +1,356 @@
+#include "ets_sys.h"
+#include "osapi.h"
+
+#include "../driver/include/aes.h"
+#include "../driver/include/aes_cbc.h"
+#include "../driver/include/cmac.h"
+#include "../ctrl/include/ctrl_stack.h"
+#include "../ctrl/include/ctrl_txpool.h"
+
+#include "test.h"
+#include "server.h"
+
+char serverBaseid[16] = "BASE-ID-0123456";
+char serverKey[16] = { 0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c };
+unsigned serverFrames;
+unsigned serverContainers;
+char serverTicket[16];
+unsigned long serverTicketCounter;
+unsigned char serverTicketValid;
+unsigned serverResumes;
+
+static tAesKeySchedule keySchedule;
+static tCmacContext keyCmac;
+static tAesKeySchedule zeroSchedule;
+static tCmacContext zeroCmac;
+static unsigned wireRead; // how much of testWire is read already
+void (*serverPump)(void); // when set, called before testWire is read so Base can write out what it queued
+
+void server_init(void)
+{
+	char zero[16];
+	os_memset(zero, 0, 16);
+
+	expandKey(&keySchedule, (unsigned char *)serverKey);
+	cmac_prepare(&keyCmac, &keySchedule);
+	expandKey(&zeroSchedule, (unsigned char *)zero);
+	cmac_prepare(&zeroCmac, &zeroSchedule);
+
+	wireRead = 0;
+	serverFrames = 0;
+	serverContainers = 0;
+	test_wire_clear();
+	wireRead = 0;
+}
+
+// send_data callback of Base, what it sends goes to testWire just like espconn_sent() puts it there
+char server_sink(char *data, unsigned short len)
+{
+	if(testSentResult != ESPCONN_OK)
+	{
+		return testSentResult;
+	}
+
+	if(testWireLen + len > sizeof(testWire))
+	{
+		printf("server_sink: testWire is full\n");
+		exit(2);
+	}
+
+	os_memcpy(testWire+testWireLen, data, len);
+	testWireLen += len;
+	testWrites++;
+	ctrl_txpool_free(data);
+
+	return ESPCONN_OK;
+}
+
+// builds a frame Base can read into "out", returns its length (with ALL_LENGTH field)
+unsigned short server_frame(char *out, char header, unsigned long TXsender, const char *data, unsigned short dataLen)
+{
+	unsigned short length = 1+4+dataLen;
+	unsigned char pad = 16 - ((16+2+length) % 16); // same as Base pads
+	unsigned short cipherLength = 16+2+length+pad;
+	unsigned short allLength = cipherLength+16;
+	unsigned short i;
+
+	os_memcpy(out, &allLength, 2);
+	for(i=0; i<16; i++)
+	{
+		out[2+i] = rand();
+	}
+	os_memcpy(out+18, &length, 2);
+	out[20] = header;
+	os_memcpy(out+21, &TXsender, 4);
+	if(dataLen > 0)
+	{
+		os_memcpy(out+25, data, dataLen);
+	}
+	os_memset(out+25+dataLen, 0xEE, pad);
+
+	aes128_cbc_encrypt_schedule((unsigned char *)out+2, cipherLength, &keySchedule);
+	cmac_generate_ctx(&keyCmac, (unsigned char *)out+2, cipherLength, (unsigned char *)out+2+cipherLength);
+
+	return 2+allLength;
+}
+
+// builds a container frame of "count" records into "out", returns its length
+unsigned short server_container(char *out, const tCtrlMessage *records, unsigned char count)
+{
+	char data[1+2048];
+	unsigned short len = 1;
+	unsigned char i;
+
+	data[0] = SYSTEM_MESSAGE_CONTAINER;
+	for(i=0; i<count; i++)
+	{
+		os_memcpy(data+len, &records[i].length, 2);
+		data[len+2] = records[i].header;
+		os_memcpy(data+len+3, &records[i].TXsender, 4);
+		os_memcpy(data+len+7, records[i].data, records[i].length-1-4);
+		len += 2+records[i].length;
+	}
+
+	return server_frame(out, CH_SYSTEM_MESSAGE | CH_NOTIFICATION, 0, data, len);
+}
+
+// builds a frame and hands it to Base as one TCP segment
+void server_send(char header, unsigned long TXsender, const char *data, unsigned short dataLen)
+{
+	char frame[2+16+2+1+4+SERVER_DATA_MAX+16+16];
+	unsigned short len = server_frame(frame, header, TXsender, data, dataLen);
+	ctrl_stack_recv(frame, len);
+}
+
+static void server_add(tServerMsg *msgs, unsigned *count, unsigned max, unsigned short length, char header, unsigned long TXsender, const char *data, unsigned char zeroKey, unsigned char inContainer)
+{
+	if(*count >= max)
+	{
+		printf("server_read: more than %u messages\n", max);
+		exit(2);
+	}
+
+	tServerMsg *m = &msgs[(*count)++];
+	m->length = length;
+	m->header = header;
+	m->TXsender = TXsender;
+	os_memcpy(m->data, data, length-1-4);
+	m->zeroKey = zeroKey;
+	m->inContainer = inContainer;
+}
+
+// reads frames Base wrote since the last call, returns how many messages they carried
+unsigned server_read(tServerMsg *msgs, unsigned max)
+{
+	unsigned count = 0;
+
+	if(serverPump != NULL)
+	{
+		serverPump();
+	}
+
+	// test cleared testWire itself
+	if(wireRead > testWireLen)
+	{
+		wireRead = 0;
+	}
+
+	while(wireRead + 2 <= testWireLen)
+	{
+		unsigned short allLength;
+		os_memcpy(&allLength, testWire+wireRead, 2);
+		CHECK(allLength >= 48 && allLength % 16 == 0 && wireRead+2+allLength <= testWireLen);
+		if(allLength < 48 || allLength % 16 || wireRead+2+allLength > testWireLen)
+		{
+			break;
+		}
+
+		unsigned char frame[2048];
+		unsigned short cipherLength = allLength-16;
+		unsigned char mac[16];
+		unsigned char zeroKey = 0;
+		os_memcpy(frame, testWire+wireRead+2, allLength);
+		wireRead += 2+allLength;
+		serverFrames++;
+
+		// Base uses the all-zero key only for its very first authorization frame
+		cmac_generate_ctx(&keyCmac, frame, cipherLength, mac);
+		if(os_memcmp(mac, frame+cipherLength, 16) == 0)
+		{
+			aes128_cbc_decrypt_schedule(frame, cipherLength, &keySchedule);
+		}
+		else
+		{
+			cmac_generate_ctx(&zeroCmac, frame, cipherLength, mac);
+			CHECK_MEM(mac, frame+cipherLength, 16);
+			aes128_cbc_decrypt_schedule(frame, cipherLength, &zeroSchedule);
+			zeroKey = 1;
+		}
+
+		unsigned short length;
+		unsigned long TXsender;
+		os_memcpy(&length, frame+16, 2);
+		os_memcpy(&TXsender, frame+19, 4);
+		char header = frame[18];
+		char *data = (char *)frame+23;
+		CHECK(length >= 1+4 && 16+2+length <= cipherLength);
+
+		if((header & CH_SYSTEM_MESSAGE) && length > 1+4 && data[0] == SYSTEM_MESSAGE_CONTAINER)
+		{
+			char *p = data+1;
+			char *end = data+length-1-4;
+			serverContainers++;
+			while(p < end)
+			{
+				unsigned short recordLength;
+				unsigned long recordTXsender;
+				os_memcpy(&recordLength, p, 2);
+				os_memcpy(&recordTXsender, p+3, 4);
+				CHECK(recordLength >= 1+4 && p+2+recordLength <= end);
+				if(recordLength < 1+4 || p+2+recordLength > end)
+				{
+					break;
+				}
+				server_add(msgs, &count, max, recordLength, p[2], recordTXsender, p+7, zeroKey, 1);
+				p += 2+recordLength;
+			}
+		}
+		else
+		{
+			server_add(msgs, &count, max, length, header, TXsender, data, zeroKey, 0);
+		}
+	}
+
+	// all of it is read, make room for more
+	if(wireRead == testWireLen)
+	{
+		test_wire_clear();
+		wireRead = 0;
+	}
+
+	return count;
+}
+
+// checks authorization frame that presents a session ticket: [BASEID 16][TICKET 16][COUNTER 4][PROOF 16]
+// returns: 1 when Server accepts it (and remembers its COUNTER), 0 when it is refused
+unsigned char server_resume_ok(const tServerMsg *msg)
+{
+	if(msg->length != 1+4+52 || !msg->zeroKey || !serverTicketValid)
+	{
+		return 0;
+	}
+
+	unsigned long counter = 0; // 4 bytes on the wire
+	os_memcpy(&counter, msg->data+32, 4);
+	if(os_memcmp(msg->data, serverBaseid, 16) != 0 || os_memcmp(msg->data+16, serverTicket, 16) != 0 || counter <= serverTicketCounter)
+	{
+		return 0;
+	}
+
+	// PROOF is CMAC with the secret key over everything before it, padded with zeros to 48 bytes
+	unsigned char proofInput[48];
+	unsigned char proof[16];
+	os_memcpy(proofInput, msg->data, 36);
+	os_memset(proofInput+36, 0, 12);
+	cmac_generate_ctx(&keyCmac, proofInput, 48, proof);
+	if(os_memcmp(proof, msg->data+36, 16) != 0)
+	{
+		return 0;
+	}
+
+	serverTicketCounter = counter;
+	return 1;
+}
+
+// issues a new session ticket to Base, the previous one is no good any more
+void server_issue_ticket(void)
+{
+	char data[1+16];
+	unsigned char i;
+
+	data[0] = SYSTEM_MESSAGE_SESSION_TICKET;
+	for(i=0; i<16; i++)
+	{
+		serverTicket[i] = rand();
+	}
+	os_memcpy(data+1, serverTicket, 16);
+	serverTicketCounter = 0;
+	serverTicketValid = 1;
+
+	server_send(CH_SYSTEM_MESSAGE | CH_NOTIFICATION, 0, data, sizeof(data));
+}
+
+// Base asked for authorization, takes it through the challenge (or resumes the session when Base presented a
+// session ticket Server accepts): TXserver is what Server has saved for it (0 = SYNC), "capabilities" what it
+// agrees to use. Returns how many messages Base sent right after it was authorized, they are in "msgs" (the
+// first one is its capabilities). With CTRL_CAP_SESSION_TICKET Server issues a new ticket then.
+unsigned server_handshake(unsigned long TXserver, unsigned char capabilities, tServerMsg *msgs, unsigned max)
+{
+	unsigned n;
+
+	n = server_read(msgs, max);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].zeroKey, 1);
+	CHECK(msgs[0].length == 1+4+16 || msgs[0].length == 1+4+52);
+	CHECK_MEM(msgs[0].data, serverBaseid, 16);
+
+	if(server_resume_ok(&msgs[0]))
+	{
+		char resumed[1+4];
+		resumed[0] = SYSTEM_MESSAGE_SESSION_RESUMED;
+		os_memcpy(resumed+1, &TXserver, 4);
+		server_send(CH_SYSTEM_MESSAGE | (TXserver == 0 ? CH_SYNC : 0), 0, resumed, sizeof(resumed));
+		serverResumes++;
+	}
+	else
+	{
+		char challenge[16];
+		unsigned char i;
+		for(i=0; i<16; i++)
+		{
+			challenge[i] = rand();
+		}
+		server_send(0, 0, challenge, 16);
+
+		n = server_read(msgs, max);
+		CHECK_EQ(n, 1);
+		CHECK_EQ(msgs[0].zeroKey, 0);
+		CHECK_EQ(msgs[0].length, 1+4+32);
+		CHECK_MEM(msgs[0].data+16, challenge, 16);
+
+		server_send(TXserver == 0 ? CH_SYNC : 0, 0, (char *)&TXserver, 4);
+	}
+
+	// Base tells what it supports right away
+	n = server_read(msgs, max);
+	CHECK(n >= 1);
+	CHECK_EQ(msgs[0].header, CH_SYSTEM_MESSAGE | CH_NOTIFICATION);
+	CHECK_EQ(msgs[0].data[0], SYSTEM_MESSAGE_CAPABILITIES);
+
+	char reply[2] = { SYSTEM_MESSAGE_CAPABILITIES, capabilities };
+	server_send(CH_SYSTEM_MESSAGE | CH_NOTIFICATION, 0, reply, 2);
+	CHECK_EQ(ctrl_stack_capabilities(), capabilities);
+
+	if(capabilities & CTRL_CAP_SESSION_TICKET)
+	{
+		server_issue_ticket();
+	}
+
+	return n;
+}
+
+// initializes CTRL stack on its own and authorizes it
+void server_connect(tCtrlCallbacks *callbacks, unsigned long TXserver, unsigned char capabilities)
+{
+	static tServerMsg msgs[SERVER_MSGS_MAX];
+
+	server_init();
+	ctrl_stack_init(callbacks);
+	ctrl_stack_authorize(serverBaseid, serverKey, TXserver == 0);
+	server_handshake(TXserver, capabilities, msgs, SERVER_MSGS_MAX);
+
+	test_wire_clear();
+	wireRead = 0;
+	serverFrames = 0;
+	serverContainers = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef __SERVER_H
+#define __SERVER_H
+
+#include "c_types.h"
+#include "../ctrl/include/ctrl_stack.h"
+
+/*
+	Stand-in CTRL Server for host tests. It builds frames for ctrl_stack_recv() and reads
+	back the frames Base wrote with espconn_sent() (through the test's send_data callback
+	into testWire). Records of containers are read as if they arrived on their own.
+*/
+
+#define SERVER_MSGS_MAX		256
+#define SERVER_DATA_MAX		1024
+
+typedef struct {
+	unsigned short length;
+	unsigned char header;
+	unsigned long TXsender;
+	char data[SERVER_DATA_MAX];
+	unsigned char zeroKey; // 1 = frame was authenticated with the all-zero key
+	unsigned char inContainer; // 1 = record of a container frame
+} tServerMsg;
+
+extern char serverBaseid[16];
+extern char serverKey[16];
+extern unsigned serverFrames; // frames read from testWire so far
+extern unsigned serverContainers; // of them containers
+extern char serverTicket[16]; // session ticket Server issued last
+extern unsigned long serverTicketCounter; // highest COUNTER Server accepted with it
+extern unsigned char serverTicketValid; // 0 = Server has no ticket for Base (never issued or forgotten)
+extern unsigned serverResumes; // authorizations that resumed the session with a ticket
+extern void (*serverPump)(void);
+
+void server_init(void);
+char server_sink(char *, unsigned short);
+unsigned short server_frame(char *, char, unsigned long, const char *, unsigned short);
+unsigned short server_container(char *, const tCtrlMessage *, unsigned char);
+unsigned server_read(tServerMsg *, unsigned);
+void server_send(char, unsigned long, const char *, unsigned short);
+unsigned char server_resume_ok(const tServerMsg *);
+void server_issue_ticket(void);
+unsigned server_handshake(unsigned long, unsigned char, tServerMsg *, unsigned);
+void server_connect(tCtrlCallbacks *, unsigned long, unsigned char);
+
+#endif
@@ -0,0 +1,484 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "user_interface.h"
+#include "mem.h"
+#include "espconn.h"
+
+#include "test.h"
+
+/*
+	Stand-in for the parts of the SDK that firmware under test calls, plus a few
+	helpers for checking results. Timers and tasks only run when a test lets them
+	(test_time_advance(), test_tasks_run()), everything is single threaded just
+	like on the target.
+*/
+
+static unsigned testChecks;
+static unsigned testFailures;
+
+uint32 testHeapFree = 40000;
+unsigned testMallocFail;
+unsigned testHeapBlocks;
+unsigned testPostFail;
+unsigned char testRtcMem[768];
+sint8 testSentResult = ESPCONN_OK;
+char testWire[16384];
+unsigned testWireLen;
+unsigned testWrites;
+unsigned char testRecvHeld;
+unsigned testDisconnects;
+espconn_connect_callback testConnectCb;
+espconn_reconnect_callback testReconCb;
+espconn_connect_callback testDisconCb;
+espconn_recv_callback testRecvCb;
+espconn_sent_callback testSentCb;
+uint8 testStationStatus = STATION_GOT_IP;
+wifi_event_handler_cb_t testWifiEventCb;
+unsigned testConnects;
+uint32 testConnectAt;
+
+#define TEST_TIMERS_MAX	32
+static os_timer_t *timers[TEST_TIMERS_MAX]; // every timer that was ever armed
+static unsigned char timersCount;
+static uint64_t nowUs;
+
+#define TEST_TASK_PRIOS	3
+static os_task_t tasks[TEST_TASK_PRIOS];
+static unsigned char tasksQueueLen[TEST_TASK_PRIOS];
+static unsigned char tasksPending[TEST_TASK_PRIOS];
+
+void test_check(int ok, const char *file, int line, const char *what)
+{
+	testChecks++;
+	if(!ok)
+	{
+		testFailures++;
+		printf("%s:%d: CHECK(%s) failed\n", file, line, what);
+	}
+}
+
+void test_check_eq(intmax_t actual, intmax_t expected, const char *file, int line, const char *what)
+{
+	testChecks++;
+	if(actual != expected)
+	{
+		testFailures++;
+		printf("%s:%d: %s is %jd, expected %jd\n", file, line, what, actual, expected);
+	}
+}
+
+int test_done(const char *name)
+{
+	printf("%s: %u checks, %u failed\n", name, testChecks, testFailures);
+	return testFailures ? 1 : 0;
+}
+
+void test_hex(const char *label, const void *data, unsigned len)
+{
+	const unsigned char *p = data;
+	unsigned i;
+
+	printf("%s:", label);
+	for(i=0; i<len; i++)
+	{
+		printf(" %02x", p[i]);
+	}
+	printf("\n");
+}
+
+int test_printf(const char *fmt, ...)
+{
+	static int verbose = -1;
+	if(verbose < 0)
+	{
+		verbose = getenv("TEST_VERBOSE") != NULL;
+	}
+	if(!verbose)
+	{
+		return 0;
+	}
+
+	va_list args;
+	va_start(args, fmt);
+	int ret = vprintf(fmt, args);
+	va_end(args);
+	return ret;
+}
+
+void *test_malloc(size_t size)
+{
+	if(testMallocFail > 0)
+	{
+		testMallocFail--;
+		return NULL;
+	}
+
+	void *p = malloc(size);
+	if(p != NULL)
+	{
+		testHeapBlocks++;
+	}
+	return p;
+}
+
+void *test_zalloc(size_t size)
+{
+	void *p = test_malloc(size);
+	if(p != NULL)
+	{
+		memset(p, 0, size);
+	}
+	return p;
+}
+
+void test_free(void *p)
+{
+	if(p != NULL)
+	{
+		testHeapBlocks--;
+		free(p);
+	}
+}
+
+void os_timer_setfn(os_timer_t *t, os_timer_func_t *fn, void *arg)
+{
+	t->timer_func = fn;
+	t->timer_arg = arg;
+}
+
+void os_timer_disarm(os_timer_t *t)
+{
+	t->timer_armed = 0;
+}
+
+void os_timer_arm(os_timer_t *t, uint32 ms, bool repeat)
+{
+	unsigned char i;
+	for(i=0; i<timersCount && timers[i] != t; i++);
+	if(i == timersCount)
+	{
+		if(timersCount == TEST_TIMERS_MAX)
+		{
+			printf("os_timer_arm: too many timers\n");
+			exit(2);
+		}
+		timers[timersCount++] = t;
+	}
+
+	t->timer_expire = (uint32)(nowUs / 1000) + ms;
+	t->timer_period = repeat ? ms : 0;
+	t->timer_armed = 1;
+}
+
+unsigned char test_timer_armed(const os_timer_t *t)
+{
+	return t->timer_armed;
+}
+
+uint32 test_timer_left(const os_timer_t *t)
+{
+	uint32 now = (uint32)(nowUs / 1000);
+	return (t->timer_armed && t->timer_expire > now) ? t->timer_expire - now : 0;
+}
+
+void test_time_add_us(uint32 us)
+{
+	nowUs += us;
+}
+
+void test_time_advance(uint32 ms)
+{
+	uint32 until = (uint32)(nowUs / 1000) + ms;
+
+	for(;;)
+	{
+		// earliest timer that expires until then, timers fire in order of expiry
+		os_timer_t *next = NULL;
+		unsigned char i;
+		for(i=0; i<timersCount; i++)
+		{
+			if(timers[i]->timer_armed && timers[i]->timer_expire <= until && (next == NULL || timers[i]->timer_expire < next->timer_expire))
+			{
+				next = timers[i];
+			}
+		}
+
+		if(next == NULL)
+		{
+			break;
+		}
+
+		if((uint64_t)next->timer_expire * 1000 > nowUs)
+		{
+			nowUs = (uint64_t)next->timer_expire * 1000;
+		}
+
+		if(next->timer_period)
+		{
+			next->timer_expire += next->timer_period;
+		}
+		else
+		{
+			next->timer_armed = 0;
+		}
+
+		if(next->timer_func != NULL)
+		{
+			next->timer_func(next->timer_arg);
+		}
+	}
+
+	if((uint64_t)until * 1000 > nowUs)
+	{
+		nowUs = (uint64_t)until * 1000;
+	}
+}
+
+uint32 system_get_time(void)
+{
+	return (uint32)nowUs;
+}
+
+uint32 system_get_free_heap_size(void)
+{
+	return testHeapFree;
+}
+
+bool system_os_task(os_task_t task, uint8 prio, os_event_t *queue, uint8 qlen)
+{
+	if(prio >= TEST_TASK_PRIOS)
+	{
+		return false;
+	}
+
+	tasks[prio] = task;
+	tasksQueueLen[prio] = qlen;
+	tasksPending[prio] = 0;
+	return true;
+}
+
+bool system_os_post(uint8 prio, os_signal_t sig, os_param_t par)
+{
+	if(testPostFail > 0)
+	{
+		testPostFail--;
+		return false;
+	}
+
+	if(prio >= TEST_TASK_PRIOS || tasks[prio] == NULL || tasksPending[prio] >= tasksQueueLen[prio])
+	{
+		return false;
+	}
+
+	tasksPending[prio]++;
+	return true;
+}
+
+unsigned test_tasks_pending(void)
+{
+	return tasksPending[0] + tasksPending[1] + tasksPending[2];
+}
+
+unsigned test_tasks_run_once(void)
+{
+	unsigned ran = 0;
+	unsigned char pending[TEST_TASK_PRIOS];
+	signed char prio;
+
+	// only events posted before, those the tasks post meanwhile wait for the next call
+	memcpy(pending, tasksPending, sizeof(pending));
+	for(prio=TEST_TASK_PRIOS-1; prio>=0; prio--)
+	{
+		while(pending[prio] > 0)
+		{
+			os_event_t e = { 0, 0 };
+			pending[prio]--;
+			tasksPending[prio]--;
+			tasks[prio](&e);
+			ran++;
+		}
+	}
+
+	return ran;
+}
+
+unsigned test_tasks_run(void)
+{
+	unsigned ran = 0;
+
+	while(test_tasks_pending() > 0)
+	{
+		// highest priority first
+		signed char prio;
+		for(prio=TEST_TASK_PRIOS-1; prio>=0; prio--)
+		{
+			if(tasksPending[prio] > 0)
+			{
+				os_event_t e = { 0, 0 };
+				tasksPending[prio]--;
+				tasks[prio](&e);
+				ran++;
+				break;
+			}
+		}
+	}
+
+	return ran;
+}
+
+// addresses are in 4 byte blocks, user data may only go from block 64 on
+bool system_rtc_mem_read(uint8 addr, void *dst, uint16 len)
+{
+	if(addr < 64 || addr*4 + len > sizeof(testRtcMem))
+	{
+		return false;
+	}
+
+	memcpy(dst, testRtcMem + addr*4, len);
+	return true;
+}
+
+bool system_rtc_mem_write(uint8 addr, const void *src, uint16 len)
+{
+	if(addr < 64 || addr*4 + len > sizeof(testRtcMem))
+	{
+		return false;
+	}
+
+	memcpy(testRtcMem + addr*4, src, len);
+	return true;
+}
+
+void system_restart(void)
+{
+}
+
+uint8 wifi_get_opmode(void)
+{
+	return STATION_MODE;
+}
+
+bool wifi_set_opmode(uint8 mode)
+{
+	return true;
+}
+
+bool wifi_get_ip_info(uint8 ifIndex, struct ip_info *info)
+{
+	memset(info, 0, sizeof(struct ip_info));
+	if(testStationStatus == STATION_GOT_IP)
+	{
+		info->ip.addr = 0x0100A8C0; // 192.168.0.1
+	}
+	return true;
+}
+
+uint8 wifi_station_get_connect_status(void)
+{
+	return testStationStatus;
+}
+
+bool wifi_station_get_config(struct station_config *config)
+{
+	memset(config, 0, sizeof(struct station_config));
+	return true;
+}
+
+void wifi_set_event_handler_cb(wifi_event_handler_cb_t cb)
+{
+	testWifiEventCb = cb;
+}
+
+void test_wire_clear(void)
+{
+	testWireLen = 0;
+	testWrites = 0;
+}
+
+sint8 espconn_sent(struct espconn *conn, uint8 *data, uint16 len)
+{
+	if(testSentResult != ESPCONN_OK)
+	{
+		return testSentResult;
+	}
+
+	if(testWireLen + len > sizeof(testWire))
+	{
+		printf("espconn_sent: test wire overflow\n");
+		exit(2);
+	}
+
+	memcpy(testWire + testWireLen, data, len);
+	testWireLen += len;
+	testWrites++;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_connect(struct espconn *conn)
+{
+	testConnects++;
+	testConnectAt = system_get_time();
+	return ESPCONN_OK;
+}
+
+sint8 espconn_disconnect(struct espconn *conn)
+{
+	testDisconnects++;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_connectcb(struct espconn *conn, espconn_connect_callback cb)
+{
+	testConnectCb = cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_reconcb(struct espconn *conn, espconn_reconnect_callback cb)
+{
+	testReconCb = cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_disconcb(struct espconn *conn, espconn_connect_callback cb)
+{
+	testDisconCb = cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_recvcb(struct espconn *conn, espconn_recv_callback cb)
+{
+	testRecvCb = cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_regist_sentcb(struct espconn *conn, espconn_sent_callback cb)
+{
+	testSentCb = cb;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_set_opt(struct espconn *conn, uint8 opt)
+{
+	return ESPCONN_OK;
+}
+
+sint8 espconn_recv_hold(struct espconn *conn)
+{
+	testRecvHeld = 1;
+	return ESPCONN_OK;
+}
+
+sint8 espconn_recv_unhold(struct espconn *conn)
+{
+	testRecvHeld = 0;
+	return ESPCONN_OK;
+}
+
+uint32 espconn_port(void)
+{
+	return 50000;
+}
+
+void gpio_init(void)
+{
+}
@@ -0,0 +1,59 @@
+#ifndef __TEST_H
+#define __TEST_H
+
+#include "c_types.h"
+#include "os_type.h"
+#include "espconn.h"
+#include "user_interface.h"
+
+/*
+	Host tests run firmware sources against the stand-in SDK in sdk/ and test.c.
+	Every test program does its CHECK()s and returns test_done() from main().
+*/
+
+#define CHECK(cond) \
+	test_check((cond) ? 1 : 0, __FILE__, __LINE__, #cond)
+
+#define CHECK_EQ(actual, expected) \
+	test_check_eq((intmax_t)(actual), (intmax_t)(expected), __FILE__, __LINE__, #actual)
+
+#define CHECK_MEM(actual, expected, len) \
+	test_check(memcmp((actual), (expected), (len)) == 0, __FILE__, __LINE__, #actual " == " #expected)
+
+// stand-in SDK controls
+extern uint32 testHeapFree; // returned by system_get_free_heap_size()
+extern unsigned testMallocFail; // that many os_malloc() calls from now on return NULL
+extern unsigned testHeapBlocks; // os_malloc() blocks not freed yet
+extern unsigned testPostFail; // that many system_os_post() calls from now on fail
+extern unsigned char testRtcMem[768]; // whole RTC memory, system_rtc_mem_*() address it in 4 byte blocks
+extern sint8 testSentResult; // returned by espconn_sent()
+extern char testWire[16384]; // everything espconn_sent() took since test_wire_clear()
+extern unsigned testWireLen;
+extern unsigned testWrites; // how many espconn_sent() calls took data
+extern unsigned char testRecvHeld; // 1 = espconn_recv_hold() is in effect
+extern unsigned testDisconnects;
+extern espconn_connect_callback testConnectCb;
+extern espconn_reconnect_callback testReconCb;
+extern espconn_connect_callback testDisconCb;
+extern espconn_recv_callback testRecvCb;
+extern espconn_sent_callback testSentCb;
+extern uint8 testStationStatus; // returned by wifi_station_get_connect_status(), there is an IP only with STATION_GOT_IP
+extern wifi_event_handler_cb_t testWifiEventCb; // registered with wifi_set_event_handler_cb()
+extern unsigned testConnects; // espconn_connect() calls
+extern uint32 testConnectAt; // system_get_time() of the last one
+
+void test_check(int, const char *, int, const char *);
+void test_check_eq(intmax_t, intmax_t, const char *, int, const char *);
+int test_done(const char *);
+void test_hex(const char *, const void *, unsigned);
+
+void test_time_advance(uint32); // moves test time on by that many ms and fires timers that expire meanwhile
+void test_time_add_us(uint32); // moves test time on without firing timers
+unsigned char test_timer_armed(const os_timer_t *);
+uint32 test_timer_left(const os_timer_t *); // ms until it fires
+unsigned test_tasks_pending(void);
+unsigned test_tasks_run(void); // runs posted tasks until none is left, returns how many ran
+unsigned test_tasks_run_once(void); // runs tasks posted so far, not the ones they post meanwhile
+void test_wire_clear(void);
+
+#endif
@@ -0,0 +1,210 @@
+#include "ets_sys.h"
+#include "osapi.h"
+
+#include "../driver/include/aes.h"
+#include "../driver/include/aes_cbc.h"
+
+#include "test.h"
+
+/*
+	AES-128 block cipher and CBC mode. Every block encrypted with an expanded key
+	schedule must match the block encrypted with on-the-fly key expansion, and both
+	must match the published known answers. Built once for every AES_TTABLES backend.
+*/
+
+// FIPS-197 Appendix C.1
+static const unsigned char fipsKey[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+static const unsigned char fipsPlain[16] = {
+	0x00, 0x11, 0x22, 0x33, 0x44, 0x55, 0x66, 0x77, 0x88, 0x99, 0xaa, 0xbb, 0xcc, 0xdd, 0xee, 0xff
+};
+static const unsigned char fipsCipher[16] = {
+	0x69, 0xc4, 0xe0, 0xd8, 0x6a, 0x7b, 0x04, 0x30, 0xd8, 0xcd, 0xb7, 0x80, 0x70, 0xb4, 0xc5, 0x5a
+};
+
+// NIST SP 800-38A F.1.1 (ECB-AES128) and F.2.1 (CBC-AES128)
+static const unsigned char spKey[16] = {
+	0x2b, 0x7e, 0x15, 0x16, 0x28, 0xae, 0xd2, 0xa6, 0xab, 0xf7, 0x15, 0x88, 0x09, 0xcf, 0x4f, 0x3c
+};
+static const unsigned char spIv[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+static const unsigned char spPlain[64] = {
+	0x6b, 0xc1, 0xbe, 0xe2, 0x2e, 0x40, 0x9f, 0x96, 0xe9, 0x3d, 0x7e, 0x11, 0x73, 0x93, 0x17, 0x2a,
+	0xae, 0x2d, 0x8a, 0x57, 0x1e, 0x03, 0xac, 0x9c, 0x9e, 0xb7, 0x6f, 0xac, 0x45, 0xaf, 0x8e, 0x51,
+	0x30, 0xc8, 0x1c, 0x46, 0xa3, 0x5c, 0xe4, 0x11, 0xe5, 0xfb, 0xc1, 0x19, 0x1a, 0x0a, 0x52, 0xef,
+	0xf6, 0x9f, 0x24, 0x45, 0xdf, 0x4f, 0x9b, 0x17, 0xad, 0x2b, 0x41, 0x7b, 0xe6, 0x6c, 0x37, 0x10
+};
+static const unsigned char spEcb[64] = {
+	0x3a, 0xd7, 0x7b, 0xb4, 0x0d, 0x7a, 0x36, 0x60, 0xa8, 0x9e, 0xca, 0xf3, 0x24, 0x66, 0xef, 0x97,
+	0xf5, 0xd3, 0xd5, 0x85, 0x03, 0xb9, 0x69, 0x9d, 0xe7, 0x85, 0x89, 0x5a, 0x96, 0xfd, 0xba, 0xaf,
+	0x43, 0xb1, 0xcd, 0x7f, 0x59, 0x8e, 0xce, 0x23, 0x88, 0x1b, 0x00, 0xe3, 0xed, 0x03, 0x06, 0x88,
+	0x7b, 0x0c, 0x78, 0x5e, 0x27, 0xe8, 0xad, 0x3f, 0x82, 0x23, 0x20, 0x71, 0x04, 0x72, 0x5d, 0xd4
+};
+static const unsigned char spCbc[64] = {
+	0x76, 0x49, 0xab, 0xac, 0x81, 0x19, 0xb2, 0x46, 0xce, 0xe9, 0x8e, 0x9b, 0x12, 0xe9, 0x19, 0x7d,
+	0x50, 0x86, 0xcb, 0x9b, 0x50, 0x72, 0x19, 0xee, 0x95, 0xdb, 0x11, 0x3a, 0x91, 0x76, 0x78, 0xb2,
+	0x73, 0xbe, 0xd6, 0xb8, 0xe3, 0xc1, 0x74, 0x3b, 0x71, 0x16, 0xe6, 0x9e, 0x22, 0x22, 0x95, 0x16,
+	0x3f, 0xf1, 0xca, 0xa1, 0x68, 0x1f, 0xac, 0x09, 0x12, 0x0e, 0xca, 0x30, 0x75, 0x86, 0xe1, 0xa7
+};
+
+static void test_fips197(void)
+{
+	unsigned char block[16];
+	tAesKeySchedule schedule;
+
+	os_memcpy(block, fipsPlain, 16);
+	cipher(block, fipsKey);
+	CHECK_MEM(block, fipsCipher, 16);
+
+	invCipher(block, fipsKey);
+	CHECK_MEM(block, fipsPlain, 16);
+
+	expandKey(&schedule, fipsKey);
+
+	os_memcpy(block, fipsPlain, 16);
+	cipherWithSchedule(block, &schedule);
+	CHECK_MEM(block, fipsCipher, 16);
+
+	invCipherWithSchedule(block, &schedule);
+	CHECK_MEM(block, fipsPlain, 16);
+}
+
+static void test_sp800_38a_ecb(void)
+{
+	unsigned char block[16];
+	tAesKeySchedule schedule;
+	unsigned i;
+
+	expandKey(&schedule, spKey);
+
+	for(i=0; i<64; i+=16)
+	{
+		os_memcpy(block, spPlain+i, 16);
+		cipherWithSchedule(block, &schedule);
+		CHECK_MEM(block, spEcb+i, 16);
+
+		invCipherWithSchedule(block, &schedule);
+		CHECK_MEM(block, spPlain+i, 16);
+
+		os_memcpy(block, spPlain+i, 16);
+		cipher(block, spKey);
+		CHECK_MEM(block, spEcb+i, 16);
+
+		invCipher(block, spKey);
+		CHECK_MEM(block, spPlain+i, 16);
+	}
+}
+
+// CBC here always starts from zero IV, a frame carries its IV as the first block instead. So the
+// vector's IV goes in front as the block that encrypts into it, and comes out of decryption in front.
+static void test_sp800_38a_cbc(void)
+{
+	unsigned char data[16+64];
+	tAesKeySchedule schedule;
+
+	expandKey(&schedule, spKey);
+
+	os_memcpy(data, spIv, 16);
+	invCipherWithSchedule(data, &schedule);
+	os_memcpy(data+16, spPlain, 64);
+	aes128_cbc_encrypt_schedule(data, sizeof(data), &schedule);
+	CHECK_MEM(data, spIv, 16);
+	CHECK_MEM(data+16, spCbc, 64);
+
+	os_memcpy(data, spIv, 16);
+	os_memcpy(data+16, spCbc, 64);
+	aes128_cbc_decrypt_schedule(data, sizeof(data), &schedule);
+	CHECK_MEM(data+16, spPlain, 64);
+
+	os_memcpy(data, spIv, 16);
+	os_memcpy(data+16, spCbc, 64);
+	aes128_cbc_decrypt(data, sizeof(data), (const char *)spKey);
+	CHECK_MEM(data+16, spPlain, 64);
+}
+
+// one expanded schedule serves any number of blocks, and expanding another key into it replaces the old one
+static void test_schedule_reuse(void)
+{
+	unsigned char key[16];
+	unsigned char block[16];
+	unsigned char expected[16];
+	tAesKeySchedule schedule;
+	unsigned k, n, i;
+
+	srand(1);
+	for(k=0; k<8; k++)
+	{
+		for(i=0; i<16; i++)
+		{
+			key[i] = rand();
+		}
+		expandKey(&schedule, key);
+
+		for(n=0; n<64; n++)
+		{
+			for(i=0; i<16; i++)
+			{
+				block[i] = rand();
+			}
+
+			os_memcpy(expected, block, 16);
+			cipher(expected, key);
+			cipherWithSchedule(block, &schedule);
+			CHECK_MEM(block, expected, 16);
+
+			invCipher(expected, key);
+			invCipherWithSchedule(block, &schedule);
+			CHECK_MEM(block, expected, 16);
+		}
+	}
+}
+
+// CBC with the key and with its expanded schedule give the same ciphertext and round trip
+static void test_cbc_schedule(void)
+{
+	unsigned char data[160];
+	unsigned char withKey[160];
+	unsigned char withSchedule[160];
+	tAesKeySchedule schedule;
+	unsigned i;
+
+	for(i=0; i<sizeof(data); i++)
+	{
+		data[i] = i * 7;
+	}
+
+	os_memcpy(withKey, data, sizeof(data));
+	aes128_cbc_encrypt(withKey, sizeof(data), (const char *)fipsKey);
+
+	expandKey(&schedule, fipsKey);
+	os_memcpy(withSchedule, data, sizeof(data));
+	aes128_cbc_encrypt_schedule(withSchedule, sizeof(data), &schedule);
+	CHECK_MEM(withSchedule, withKey, sizeof(data));
+
+	// first block has zero IV, so it is a plain block encryption
+	unsigned char block[16];
+	os_memcpy(block, data, 16);
+	cipher(block, fipsKey);
+	CHECK_MEM(withKey, block, 16);
+
+	aes128_cbc_decrypt(withKey, sizeof(data), (const char *)fipsKey);
+	CHECK_MEM(withKey, data, sizeof(data));
+
+	aes128_cbc_decrypt_schedule(withSchedule, sizeof(data), &schedule);
+	CHECK_MEM(withSchedule, data, sizeof(data));
+}
+
+int main(void)
+{
+	test_fips197();
+	test_sp800_38a_ecb();
+	test_sp800_38a_cbc();
+	test_schedule_reuse();
+	test_cbc_schedule();
+
+	char name[32];
+	os_sprintf(name, "test_aes (AES_TTABLES=%d)", AES_TTABLES);
+	return test_done(name);
+}
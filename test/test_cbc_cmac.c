@@ -0,0 +1,124 @@
+#include "ets_sys.h"
+#include "osapi.h"
+
+#include "../driver/include/aes.h"
+#include "../driver/include/aes_cbc.h"
+#include "../driver/include/cmac.h"
+#include "../driver/include/aes_cbc_cmac.h"
+
+#include "test.h"
+
+/*
+	Fused single-pass kernels must give exactly what the two-pass code gives:
+	aes128_cbc_encrypt_schedule() followed by cmac_generate_ctx() over the ciphertext,
+	and cmac_generate_ctx() followed by aes128_cbc_decrypt_schedule(). Frames of 17
+	blocks or more take M_last from the wrapped offset, see test_cmac.c.
+*/
+
+#define MAX_BLOCKS	40
+
+static void test_fused(void)
+{
+	unsigned char k[16];
+	unsigned char plain[MAX_BLOCKS*16];
+	unsigned char twoPass[MAX_BLOCKS*16];
+	unsigned char fused[MAX_BLOCKS*16];
+	unsigned char macTwoPass[16], macFused[16];
+	tAesKeySchedule schedule;
+	tCmacContext ctx;
+	unsigned round, blocks, i;
+
+	srand(4);
+	for(round=0; round<4; round++)
+	{
+		for(i=0; i<16; i++)
+		{
+			k[i] = rand();
+		}
+		expandKey(&schedule, k);
+		cmac_prepare(&ctx, &schedule);
+
+		for(blocks=1; blocks<=MAX_BLOCKS; blocks++)
+		{
+			unsigned length = blocks*16;
+			for(i=0; i<length; i++)
+			{
+				plain[i] = rand();
+			}
+
+			// encrypt-then-MAC
+			os_memcpy(twoPass, plain, length);
+			aes128_cbc_encrypt_schedule(twoPass, length, &schedule);
+			cmac_generate_ctx(&ctx, twoPass, length, macTwoPass);
+
+			os_memcpy(fused, plain, length);
+			aes128_cbc_encrypt_cmac(fused, length, &ctx, macFused);
+			CHECK_MEM(fused, twoPass, length);
+			CHECK_MEM(macFused, macTwoPass, 16);
+
+			// verify without decrypting
+			CHECK_EQ(aes128_cmac_verify(fused, length, &ctx, macTwoPass), 1);
+
+			// verify-then-decrypt
+			CHECK_EQ(aes128_cmac_verify_cbc_decrypt(fused, length, &ctx, macTwoPass), 1);
+			CHECK_MEM(fused, plain, length);
+
+			// one flipped bit anywhere in the ciphertext or in the MAC fails verification
+			os_memcpy(fused, twoPass, length);
+			fused[rand() % length] ^= 1 << (rand() % 8);
+			CHECK_EQ(aes128_cmac_verify(fused, length, &ctx, macTwoPass), 0);
+			CHECK_EQ(aes128_cmac_verify_cbc_decrypt(fused, length, &ctx, macTwoPass), 0);
+
+			os_memcpy(fused, twoPass, length);
+			macFused[rand() % 16] ^= 0x80;
+			CHECK_EQ(aes128_cmac_verify(fused, length, &ctx, macFused), 0);
+			CHECK_EQ(aes128_cmac_verify_cbc_decrypt(fused, length, &ctx, macFused), 0);
+		}
+	}
+
+	// nothing to authenticate
+	CHECK_EQ(aes128_cmac_verify(plain, 0, &ctx, macTwoPass), 0);
+	CHECK_EQ(aes128_cmac_verify_cbc_decrypt(plain, 0, &ctx, macTwoPass), 0);
+}
+
+// MAC with a zero byte in it, os_strncmp() used to stop comparing there
+static void test_mac_with_zero_byte(void)
+{
+	unsigned char k[16];
+	unsigned char data[64];
+	unsigned char mac[16], wrong[16];
+	tAesKeySchedule schedule;
+	tCmacContext ctx;
+	unsigned i, tries;
+
+	os_memset(k, 0x11, 16);
+	expandKey(&schedule, k);
+	cmac_prepare(&ctx, &schedule);
+
+	for(tries=0; tries<10000; tries++)
+	{
+		for(i=0; i<sizeof(data); i++)
+		{
+			data[i] = rand();
+		}
+		cmac_generate_ctx(&ctx, data, sizeof(data), mac);
+		if(mac[0] == 0)
+		{
+			break;
+		}
+	}
+	CHECK_EQ(mac[0], 0);
+
+	os_memcpy(wrong, mac, 16);
+	wrong[15] ^= 1;
+	CHECK_EQ(aes128_cmac_verify(data, sizeof(data), &ctx, wrong), 0);
+	CHECK_EQ(aes128_cmac_verify(data, sizeof(data), &ctx, mac), 1);
+}
+
+int main(void)
+{
+	test_fused();
+	test_mac_with_zero_byte();
+
+	return test_done("test_cbc_cmac");
+}
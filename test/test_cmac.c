@@ -0,0 +1,175 @@
+#include "ets_sys.h"
+#include "osapi.h"
+
+#include "../driver/include/aes.h"
+#include "../driver/include/cmac.h"
+
+#include "test.h"
+
+/*
+	CMAC as it goes on the wire. It isn't RFC 4493 CMAC: all n blocks are chained, then
+	M_last (XORed with K1, or padded and XORed with K2) is chained once more. M_last is
+	taken from offset 16*(n-1) truncated to 8 bits, so inputs of 17 blocks or more take it
+	from an earlier block. Server calculates it the same way, every variant here must agree.
+*/
+
+static const unsigned char key[16] = {
+	0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0a, 0x0b, 0x0c, 0x0d, 0x0e, 0x0f
+};
+
+// MACs of input[i] = i*13+5 under "key", as calculated by the firmware before CMAC subkeys were cached
+static const struct {
+	unsigned short length;
+	unsigned char mac[16];
+} pinned[] = {
+	{ 16,  { 0x15, 0xab, 0x85, 0x90, 0x63, 0x87, 0x75, 0x2a, 0x9c, 0x59, 0x78, 0xc8, 0xd8, 0x26, 0x59, 0x19 } },
+	{ 100, { 0x7c, 0x44, 0xcb, 0x36, 0x6e, 0x95, 0x01, 0xb2, 0x5c, 0x20, 0xc6, 0xcd, 0x4a, 0x70, 0xb8, 0x31 } },
+	{ 256, { 0x79, 0xf3, 0x84, 0x7f, 0x3e, 0xb3, 0x02, 0xd1, 0xa6, 0xb3, 0x4a, 0xa0, 0x19, 0x30, 0x7e, 0xe6 } },
+	{ 257, { 0x6b, 0x5b, 0xd9, 0x3b, 0xd2, 0x4f, 0xc3, 0x06, 0x37, 0x4b, 0x9a, 0x92, 0xdd, 0xb4, 0xe3, 0x22 } },
+	{ 272, { 0xff, 0xdb, 0x35, 0xcc, 0x8e, 0xaf, 0x6e, 0x04, 0x2f, 0x15, 0xad, 0xc4, 0x68, 0xa7, 0xf8, 0x43 } },
+	{ 320, { 0x90, 0xd6, 0x31, 0x0c, 0x0a, 0xf5, 0xda, 0xf8, 0xa2, 0x1c, 0x4c, 0x34, 0x9c, 0x3e, 0x32, 0xde } },
+	{ 321, { 0xbd, 0x6e, 0x99, 0x11, 0xf6, 0x73, 0x60, 0x69, 0x2a, 0x81, 0x6a, 0x6a, 0x10, 0x4f, 0x9e, 0xab } }
+};
+
+// CMAC written straight from the description above, with nothing but cipher()
+static void reference_cmac(const unsigned char *k, const unsigned char *input, unsigned short length, unsigned char *mac)
+{
+	unsigned char L[16], K1[16], K2[16], M_last[16];
+	unsigned short n = (length + 15) / 16;
+	unsigned char lenMod16 = length % 16;
+	unsigned char i, j;
+
+	os_memset(L, 0, 16);
+	cipher(L, k);
+	for(i=0; i<16; i++)
+	{
+		K1[i] = (L[i] << 1) | (i < 15 ? L[i+1] >> 7 : 0);
+	}
+	if(L[0] & 0x80)
+	{
+		K1[15] ^= 0x87;
+	}
+	for(i=0; i<16; i++)
+	{
+		K2[i] = (K1[i] << 1) | (i < 15 ? K1[i+1] >> 7 : 0);
+	}
+	if(K1[0] & 0x80)
+	{
+		K2[15] ^= 0x87;
+	}
+
+	if(n == 0)
+	{
+		n = 1;
+	}
+	unsigned char index = 16 * (n-1); // 8 bits, that is the point
+
+	for(j=0; j<16; j++)
+	{
+		if(length > 0 && lenMod16 == 0)
+		{
+			M_last[j] = input[index + j] ^ K1[j];
+		}
+		else
+		{
+			M_last[j] = (j < lenMod16 ? input[index + j] : (j == lenMod16 ? 0x80 : 0x00)) ^ K2[j];
+		}
+	}
+
+	os_memset(mac, 0, 16);
+	unsigned short b;
+	for(b=0; b<n; b++)
+	{
+		for(j=0; j<16; j++)
+		{
+			mac[j] ^= input[16*b + j];
+		}
+		cipher(mac, k);
+	}
+	for(j=0; j<16; j++)
+	{
+		mac[j] ^= M_last[j];
+	}
+	cipher(mac, k);
+}
+
+static void test_pinned(void)
+{
+	unsigned char input[21*16];
+	unsigned char mac[16];
+	unsigned i;
+
+	for(i=0; i<sizeof(input); i++)
+	{
+		input[i] = i*13 + 5;
+	}
+
+	tAesKeySchedule schedule;
+	tCmacContext ctx;
+	expandKey(&schedule, key);
+	cmac_prepare(&ctx, &schedule);
+
+	for(i=0; i<sizeof(pinned)/sizeof(pinned[0]); i++)
+	{
+		cmac_generate((unsigned char *)key, input, pinned[i].length, mac);
+		CHECK_MEM(mac, pinned[i].mac, 16);
+
+		cmac_generate_ctx(&ctx, input, pinned[i].length, mac);
+		CHECK_MEM(mac, pinned[i].mac, 16);
+
+		reference_cmac(key, input, pinned[i].length, mac);
+		CHECK_MEM(mac, pinned[i].mac, 16);
+	}
+}
+
+// every length up to well past the 8 bit wrap, through every API, with one context reused for many keys
+static void test_all_lengths(void)
+{
+	unsigned char k[16];
+	unsigned char input[48*16];
+	unsigned char expected[16], mac[16];
+	tAesKeySchedule schedule;
+	tCmacContext ctx;
+	unsigned round, length, i;
+
+	srand(3);
+	for(round=0; round<3; round++)
+	{
+		for(i=0; i<16; i++)
+		{
+			k[i] = rand();
+		}
+		for(i=0; i<sizeof(input); i++)
+		{
+			input[i] = rand();
+		}
+
+		expandKey(&schedule, k);
+		cmac_prepare(&ctx, &schedule);
+
+		for(length=0; length<=47*16; length++)
+		{
+			reference_cmac(k, input, length, expected);
+
+			cmac_generate_ctx(&ctx, input, length, mac);
+			CHECK_MEM(mac, expected, 16);
+
+			if(length % 37 == 0)
+			{
+				cmac_generate(k, input, length, mac);
+				CHECK_MEM(mac, expected, 16);
+
+				cmac_generate_schedule(&schedule, input, length, mac);
+				CHECK_MEM(mac, expected, 16);
+			}
+		}
+	}
+}
+
+int main(void)
+{
+	test_pinned();
+	test_all_lengths();
+
+	return test_done("test_cmac");
+}
@@ -0,0 +1,371 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+
+#include "test.h"
+
+// statics of the database are checked too
+#include "../ctrl/ctrl_database.c"
+
+/*
+	Outgoing database: ring of slots indexed by TXbase, rows carved out of the arena in FIFO
+	order (heap when it is full) and admission against the byte budget.
+*/
+
+// fills "data" with bytes that tell which row they belong to
+static void row_data(char *data, unsigned long TXbase, unsigned short len)
+{
+	unsigned short i;
+	for(i=0; i<len; i++)
+	{
+		data[i] = (char)(TXbase*7 + i);
+	}
+}
+
+static unsigned char row_ok(tDatabaseRow *row, unsigned long TXbase, unsigned short len)
+{
+	char data[1024];
+	row_data(data, TXbase, len);
+	return row != NULL && row->TXbase == TXbase && row->len == len && memcmp(row->data, data, len) == 0;
+}
+
+static unsigned short row_len(unsigned long TXbase)
+{
+	return TXbase % 53;
+}
+
+static unsigned long add_row(unsigned short len)
+{
+	char data[1024];
+	unsigned long TXbase = gTXbase;
+	row_data(data, TXbase, len);
+	CHECK_EQ(ctrl_database_add_row(data, len), CTRL_DATABASE_ADD_OK);
+	return TXbase;
+}
+
+// rows go round the ring many times, every one is found in its slot and sent in order
+static void test_ring(void)
+{
+	unsigned long acked = 0; // all up to this one are acked
+	unsigned long TXbase;
+	tDatabaseRow *row;
+	unsigned round;
+
+	ctrl_database_init();
+
+	for(round=0; round<50; round++)
+	{
+		// keep 10 to CAPACITY rows in database
+		unsigned short keep = 10 + round % (CTRL_DATABASE_CAPACITY-10+1);
+		while(gTXbase-1-acked < keep)
+		{
+			add_row(row_len(gTXbase));
+		}
+		CHECK_EQ(ctrl_database_count_unacked_items(), keep);
+		CHECK_EQ(ctrl_database_first_unacked(), acked+1);
+
+		for(TXbase = acked+1; TXbase < gTXbase; TXbase++)
+		{
+			CHECK(row_ok(ctrl_database_find(TXbase), TXbase, row_len(TXbase)));
+		}
+		CHECK(ctrl_database_find(acked) == NULL);
+		CHECK(ctrl_database_find(gTXbase) == NULL);
+
+		// all of them are sent in order
+		for(TXbase = acked+1; TXbase < gTXbase; TXbase++)
+		{
+			row = ctrl_database_get_next_txbase2server();
+			CHECK(row_ok(row, TXbase, row_len(TXbase)));
+		}
+		CHECK(ctrl_database_get_next_txbase2server() == NULL);
+		CHECK_EQ(ctrl_database_count_in_flight(), keep);
+
+		// ACKs out of order, nothing is flushed until the oldest one is acked
+		unsigned long last = acked + keep/2;
+		for(TXbase = last; TXbase > acked+1; TXbase--)
+		{
+			ctrl_database_ack_row(TXbase, &(unsigned long){0});
+		}
+		CHECK_EQ(ctrl_database_first_unacked(), acked+1);
+		CHECK_EQ(ctrl_database_count_unacked_items(), keep-(last-acked-1));
+
+		ctrl_database_ack_row(acked+1, &(unsigned long){0});
+		acked = last;
+		CHECK_EQ(ctrl_database_first_unacked(), acked+1);
+		CHECK_EQ(ctrl_database_count_in_flight(), gTXbase-1-acked);
+
+		// ACK of a flushed row changes nothing
+		CHECK_EQ(ctrl_database_ack_row(acked, &(unsigned long){0}), 0);
+		CHECK_EQ(ctrl_database_count_unacked_items(), gTXbase-1-acked);
+
+		// the rest is sent again from the gap on
+		ctrl_database_unsend_from(acked+3);
+		CHECK_EQ(ctrl_database_count_in_flight(), 2);
+		row = ctrl_database_get_next_txbase2server();
+		CHECK(row_ok(row, acked+3, row_len(acked+3)));
+		CHECK_EQ(row->sendCount, 2);
+		ctrl_database_unsend_all();
+		CHECK_EQ(ctrl_database_count_in_flight(), 0);
+	}
+
+	// full ring refuses rows until the oldest one is acked
+	while(ctrl_database_count() < CTRL_DATABASE_CAPACITY)
+	{
+		add_row(1);
+	}
+	CHECK_EQ(ctrl_database_add_row("x", 1), CTRL_DATABASE_ADD_ERR_ROWS);
+	ctrl_database_ack_row(acked+1, &(unsigned long){0});
+	add_row(1);
+
+	ctrl_database_delete_all();
+	CHECK_EQ(ctrl_database_count(), 0);
+	CHECK_EQ(ctrl_database_count_unacked_items(), 0);
+	CHECK_EQ(testHeapBlocks, 0);
+}
+
+// round trip time is only sampled from rows that were sent once (Karn's rule)
+static void test_rtt_sample(void)
+{
+	unsigned long rtt = 0;
+
+	ctrl_database_init();
+	add_row(4);
+	add_row(4);
+
+	ctrl_database_get_next_txbase2server();
+	ctrl_database_get_next_txbase2server();
+	test_time_add_us(30000);
+	CHECK_EQ(ctrl_database_ack_row(1, &rtt), 1);
+	CHECK_EQ(rtt, 30000);
+
+	CHECK(ctrl_database_get_oldest_in_flight() == ctrl_database_find(2));
+	ctrl_database_unsend_row(2);
+	CHECK(ctrl_database_get_oldest_in_flight() == NULL);
+	ctrl_database_get_next_txbase2server();
+	CHECK_EQ(ctrl_database_ack_row(2, &rtt), 0);
+
+	ctrl_database_delete_all();
+}
+
+// checks that rows in arena don't overlap, their data is intact and arena counters add up
+static void check_rows(void)
+{
+	unsigned long TXbase, other;
+	unsigned long used = 0;
+	unsigned long bytes = 0;
+	unsigned heapRows = 0;
+
+	for(TXbase = firstTXbase; TXbase < gTXbase; TXbase++)
+	{
+		tDatabaseRow *row = ctrl_database_find(TXbase);
+		CHECK(row_ok(row, TXbase, row_len(TXbase)));
+		unsigned short size = ctrl_database_row_size(row->len);
+		bytes += size;
+
+		if(!row->inArena)
+		{
+			heapRows++;
+			continue;
+		}
+		used += size;
+
+		char *start = (char *)row;
+		CHECK(start >= dbArena && start + size <= dbArena + CTRL_DATABASE_ARENA_SIZE);
+		CHECK_EQ((start - dbArena) % 4, 0);
+
+		for(other = TXbase+1; other < gTXbase; other++)
+		{
+			tDatabaseRow *row2 = ctrl_database_find(other);
+			if(row2->inArena)
+			{
+				char *start2 = (char *)row2;
+				CHECK(start2 >= start + size || start2 + ctrl_database_row_size(row2->len) <= start);
+			}
+		}
+	}
+
+	CHECK_EQ(arenaUsed, used);
+	CHECK_EQ(dbBytes, bytes);
+	CHECK_EQ(testHeapBlocks, heapRows);
+}
+
+// rows come and go in FIFO order with all kinds of lengths, arena wraps around many times
+static void test_arena(void)
+{
+	unsigned long TXbase;
+	unsigned round;
+	unsigned wraps = 0;
+	unsigned heapRows = 0;
+
+	ctrl_database_init();
+
+	for(round=0; round<2000; round++)
+	{
+		unsigned short arenaEndBefore = arenaEnd;
+
+		// add a few, each row has its length from its TXbase
+		unsigned n = rand() % 6;
+		while(n-- > 0 && ctrl_database_count() < CTRL_DATABASE_CAPACITY)
+		{
+			unsigned short len = row_len(gTXbase);
+			if(ctrl_database_row_size(len) + dbBytes > CTRL_DATABASE_BYTE_BUDGET)
+			{
+				break;
+			}
+			add_row(len);
+			if(!ctrl_database_find(gTXbase-1)->inArena)
+			{
+				heapRows++;
+			}
+		}
+
+		if(arenaEnd != arenaEndBefore && arenaEnd != CTRL_DATABASE_ARENA_SIZE)
+		{
+			wraps++;
+		}
+
+		// ack a few of the oldest ones
+		n = rand() % 6;
+		while(n-- > 0 && ctrl_database_count() > 0)
+		{
+			TXbase = ctrl_database_first_unacked();
+			ctrl_database_get_next_txbase2server();
+			ctrl_database_ack_row(TXbase, &(unsigned long){0});
+		}
+
+		check_rows();
+	}
+
+	CHECK(wraps > 10);
+	CHECK(heapRows > 0);
+
+	ctrl_database_delete_all();
+	CHECK_EQ(arenaUsed, 0);
+	CHECK_EQ(arenaHead, 0);
+	CHECK_EQ(arenaTail, 0);
+	CHECK_EQ(testHeapBlocks, 0);
+}
+
+// arena is full: row goes to heap only when enough heap stays free after it
+static void test_arena_full(void)
+{
+	ctrl_database_init();
+
+	while(arenaTail + ctrl_database_row_size(row_len(gTXbase)) <= CTRL_DATABASE_ARENA_SIZE)
+	{
+		add_row(row_len(gTXbase));
+	}
+
+	char data[64];
+	unsigned short size = ctrl_database_row_size(row_len(gTXbase));
+	row_data(data, gTXbase, row_len(gTXbase));
+
+	testHeapFree = size + CTRL_DATABASE_HEAP_HEADROOM - 1;
+	CHECK_EQ(ctrl_database_add_row(data, row_len(gTXbase)), CTRL_DATABASE_ADD_ERR_HEAP);
+	testHeapFree = size + CTRL_DATABASE_HEAP_HEADROOM;
+	CHECK_EQ(ctrl_database_add_row(data, row_len(gTXbase)), CTRL_DATABASE_ADD_OK);
+	CHECK_EQ(ctrl_database_find(gTXbase-1)->inArena, 0);
+
+	testMallocFail = 1;
+	row_data(data, gTXbase, row_len(gTXbase));
+	CHECK_EQ(ctrl_database_add_row(data, row_len(gTXbase)), CTRL_DATABASE_ADD_ERR_HEAP);
+	testHeapFree = 40000;
+	check_rows();
+
+	ctrl_database_delete_all();
+}
+
+// init leaves nothing of what was there before, however it was left
+static void test_init(void)
+{
+	arenaHead = 100;
+	arenaTail = 40;
+	arenaEnd = 200;
+	arenaUsed = 140;
+	dbBytes = 5000;
+	dbOverBudget = 1;
+
+	ctrl_database_init();
+
+	CHECK_EQ(arenaHead, 0);
+	CHECK_EQ(arenaTail, 0);
+	CHECK_EQ(arenaEnd, CTRL_DATABASE_ARENA_SIZE);
+	CHECK_EQ(arenaUsed, 0);
+	CHECK_EQ(dbBytes, 0);
+	CHECK_EQ(dbOverBudget, 0);
+	CHECK_EQ(add_row(10), 1);
+	CHECK_EQ((char *)ctrl_database_find(1), dbArena);
+
+	ctrl_database_delete_all();
+}
+
+// over the budget rows are refused until database drains down to the low watermark
+static void test_budget(void)
+{
+	tDatabaseStats stats;
+	char data[512];
+	unsigned long rejections;
+	unsigned short size = ctrl_database_row_size(500);
+
+	ctrl_database_init();
+	os_memset(data, 0x11, sizeof(data));
+
+	// fill up to the budget
+	while(dbBytes + size <= CTRL_DATABASE_BYTE_BUDGET)
+	{
+		CHECK_EQ(ctrl_database_add_row(data, 500), CTRL_DATABASE_ADD_OK);
+	}
+	ctrl_database_get_stats(&stats);
+	rejections = stats.rejections;
+
+	CHECK_EQ(ctrl_database_add_row(data, 500), CTRL_DATABASE_ADD_ERR_BUDGET);
+
+	// once over, even the smallest row is refused
+	CHECK_EQ(ctrl_database_add_row(data, 0), CTRL_DATABASE_ADD_ERR_BUDGET);
+
+	// drain, just above the low watermark still nothing gets in
+	while(dbBytes - size > CTRL_DATABASE_LOW_WATERMARK)
+	{
+		ctrl_database_ack_row(ctrl_database_first_unacked(), &(unsigned long){0});
+		CHECK_EQ(ctrl_database_add_row(data, 0), CTRL_DATABASE_ADD_ERR_BUDGET);
+	}
+	CHECK(dbBytes > CTRL_DATABASE_LOW_WATERMARK);
+
+	ctrl_database_ack_row(ctrl_database_first_unacked(), &(unsigned long){0});
+	CHECK(dbBytes <= CTRL_DATABASE_LOW_WATERMARK);
+	CHECK_EQ(ctrl_database_add_row(data, 500), CTRL_DATABASE_ADD_OK);
+
+	ctrl_database_get_stats(&stats);
+	CHECK(stats.rejections > rejections);
+	CHECK_EQ(stats.bytes, dbBytes);
+	CHECK_EQ(stats.rows, ctrl_database_count());
+
+	// refused row never took anything
+	CHECK_EQ(dbBytes, (unsigned long)stats.rows * size);
+
+	// deleting everything lets rows in again
+	while(dbBytes + size <= CTRL_DATABASE_BYTE_BUDGET)
+	{
+		ctrl_database_add_row(data, 500);
+	}
+	CHECK_EQ(ctrl_database_add_row(data, 500), CTRL_DATABASE_ADD_ERR_BUDGET);
+	ctrl_database_delete_all();
+	CHECK_EQ(ctrl_database_add_row(data, 500), CTRL_DATABASE_ADD_OK);
+
+	ctrl_database_delete_all();
+	CHECK_EQ(testHeapBlocks, 0);
+}
+
+int main(void)
+{
+	srand(8);
+
+	test_ring();
+	test_rtt_sample();
+	test_arena();
+	test_arena_full();
+	test_init();
+	test_budget();
+
+	return test_done("test_database");
+}
@@ -0,0 +1,915 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+
+#include "../ctrl/include/ctrl_platform.h"
+#include "../misc/include/realrtc.h"
+
+void ctrl_app_init(tCtrlAppCallbacks *);
+extern unsigned long gTXbase; // next TXbase of ctrl_database.c
+
+// statics of the platform are checked too
+#include "../ctrl/ctrl_platform.c"
+
+#include "test.h"
+#include "server.h"
+
+/*
+	CTRL platform (with database approach) against the stand-in Server: sending rows within the
+	send window, writing queued frames out together, re-transmissions, re-sync and backoff.
+	Built twice, the second time with CTRL_FLOW_CONTROL_TCP.
+*/
+
+#define GOT_MAX	64
+
+static tServerMsg msgs[SERVER_MSGS_MAX];
+static unsigned char sentHeld; // 1 = sent callback doesn't arrive, writes stay in flight
+static unsigned writes; // socket writes completed by pump()
+static unsigned long serverTX; // TXsender of the last message Server sent to Base
+static unsigned gotCount; // messages user app got
+static unsigned long gotTX[GOT_MAX];
+
+// stand-ins for the rest of the firmware
+void load_flash_param(uint32 sec, uint32 *param, uint32 len)
+{
+	tCtrlSetup setup;
+	os_memset(&setup, 0, sizeof(tCtrlSetup));
+	setup.stationSetupOk = SETUP_OK_KEY;
+	os_memcpy(setup.baseid, serverBaseid, 16);
+	os_memcpy(setup.aes128Key, serverKey, 16);
+	os_memcpy(param, &setup, len);
+}
+
+void realrtc_start(void(*cb)(tRealRTC *))
+{
+}
+
+void realrtc_set(tRealRTC *rtc)
+{
+}
+
+void setup_wifi_ap_mode(void)
+{
+}
+
+void ctrl_config_server_init(void)
+{
+}
+
+static void app_message_received(tCtrlMessage *msg)
+{
+	if(gotCount < GOT_MAX)
+	{
+		gotTX[gotCount] = msg->TXsender;
+	}
+	gotCount++;
+}
+
+void ctrl_app_init(tCtrlAppCallbacks *callbacks)
+{
+	callbacks->message_received = app_message_received;
+}
+
+// lets frames queued in this event loop turn out, and completes the writes unless sentHeld
+static void pump(void)
+{
+	test_time_advance(0);
+	while(txInFlight != NULL && !sentHeld)
+	{
+		writes++;
+		testSentCb(&ctrlConn);
+		test_time_advance(0);
+	}
+}
+
+// TCP connection is up, Base gets authorized. Returns how many messages Base sent right after.
+static unsigned platform_connect(unsigned long TXserver, unsigned char capabilities)
+{
+	server_init();
+	serverTX = TXserver;
+	testConnectCb(&ctrlConn);
+	return server_handshake(TXserver, capabilities, msgs, SERVER_MSGS_MAX);
+}
+
+// connection breaks, platform connects again a second later
+static void platform_reconnect(unsigned long TXserver, unsigned char capabilities)
+{
+	testDisconCb(&ctrlConn);
+	test_time_advance(1000);
+	platform_connect(TXserver, capabilities);
+	server_read(msgs, SERVER_MSGS_MAX);
+}
+
+// reads what Base sent, keeps only rows from database (drops system messages and ACKs)
+static unsigned read_rows(void)
+{
+	unsigned n = server_read(msgs, SERVER_MSGS_MAX);
+	unsigned i, rows = 0;
+
+	for(i=0; i<n; i++)
+	{
+		if(!(msgs[i].header & (CH_SYSTEM_MESSAGE | CH_ACK | CH_NOTIFICATION)))
+		{
+			os_memmove(&msgs[rows++], &msgs[i], sizeof(tServerMsg));
+		}
+	}
+
+	return rows;
+}
+
+// Server acknowledges row TXbase as processed
+static void ack(unsigned long TXbase)
+{
+	server_send(CH_ACK | CH_PROCESSED, TXbase, NULL, 0);
+}
+
+static void add_rows(unsigned count)
+{
+	unsigned i;
+	for(i=0; i<count; i++)
+	{
+		char data[20];
+		os_sprintf(data, "row %u", gTXbase);
+		CHECK_EQ(ctrl_platform_send(data, os_strlen(data), 0), 0);
+	}
+}
+
+static unsigned char row_ok(tServerMsg *msg, unsigned long TXbase)
+{
+	char data[20];
+	os_sprintf(data, "row %u", TXbase);
+	return msg->TXsender == TXbase && msg->length == 1+4+os_strlen(data) && os_memcmp(msg->data, data, os_strlen(data)) == 0;
+}
+
+// no more than CTRL_SEND_WINDOW rows wait for ACK, each ACK lets the next one out
+static void test_window(void)
+{
+	unsigned long TXbase;
+	unsigned n, i;
+
+	add_rows(20);
+	CHECK_EQ(ctrl_database_count_in_flight(), CTRL_SEND_WINDOW);
+
+	n = read_rows();
+	CHECK_EQ(n, CTRL_SEND_WINDOW);
+	for(i=0; i<n; i++)
+	{
+		CHECK(row_ok(&msgs[i], 1+i));
+	}
+
+	// every ACK lets exactly one more out
+	for(TXbase=1; TXbase<=20; TXbase++)
+	{
+		ack(TXbase);
+		n = read_rows();
+		if(TXbase + CTRL_SEND_WINDOW <= 20)
+		{
+			CHECK_EQ(n, 1);
+			CHECK(row_ok(&msgs[0], TXbase + CTRL_SEND_WINDOW));
+		}
+		else
+		{
+			CHECK_EQ(n, 0);
+		}
+		CHECK(ctrl_database_count_in_flight() <= CTRL_SEND_WINDOW);
+	}
+	CHECK_EQ(ctrl_database_count_unacked_items(), 0);
+	CHECK(!test_timer_armed(&tmrRetransmit));
+
+	// ACKs that arrive together let as many out, in one write
+	add_rows(12);
+	n = read_rows();
+	CHECK_EQ(n, CTRL_SEND_WINDOW);
+
+	char segment[4*64];
+	unsigned short len = 0;
+	for(i=0; i<4; i++)
+	{
+		len += server_frame(segment+len, CH_ACK | CH_PROCESSED, 21+i, NULL, 0);
+	}
+	pump();
+	unsigned writesBefore = writes;
+	ctrl_stack_recv(segment, len);
+	n = read_rows();
+	CHECK_EQ(n, 4);
+	CHECK_EQ(writes, writesBefore+1);
+	for(i=0; i<n; i++)
+	{
+		CHECK(row_ok(&msgs[i], 21+CTRL_SEND_WINDOW+i));
+	}
+
+	for(TXbase=21; TXbase<=32; TXbase++)
+	{
+		ack(TXbase);
+	}
+	CHECK_EQ(read_rows(), 0);
+	CHECK_EQ(ctrl_database_count_unacked_items(), 0);
+}
+
+// Server sends a message to Base, the next one in order
+static void send_message(char header, const char *data, unsigned short len)
+{
+	server_send(header, ++serverTX, data, len);
+}
+
+// with containers, rows sent again together go out in one frame
+static void test_window_container(void)
+{
+	unsigned n, i;
+
+	platform_reconnect(0, CTRL_CAP_CONTAINER);
+	unsigned long first = gTXbase;
+	unsigned containers = serverContainers;
+
+	// added one by one, each goes out as soon as it is added
+	add_rows(CTRL_SEND_WINDOW+4);
+	n = read_rows();
+	CHECK_EQ(n, CTRL_SEND_WINDOW);
+	CHECK_EQ(serverContainers, containers);
+
+	char resend = SYSTEM_MESSAGE_RESEND_UNACKED;
+	send_message(CH_SYSTEM_MESSAGE, &resend, 1);
+	n = read_rows();
+	CHECK_EQ(n, CTRL_SEND_WINDOW);
+	CHECK_EQ(serverContainers, containers+1);
+	for(i=0; i<n; i++)
+	{
+		CHECK(row_ok(&msgs[i], first+i));
+		CHECK_EQ(msgs[i].inContainer, 1);
+	}
+
+	for(i=0; i<CTRL_SEND_WINDOW+4; i++)
+	{
+		ack(first+i);
+	}
+	CHECK_EQ(read_rows(), 4);
+	CHECK_EQ(ctrl_database_count_unacked_items(), 0);
+}
+
+// frames queued in one event loop turn go out in as few writes as fit into CTRL_TX_COALESCE_SIZE
+static void test_coalesce(void)
+{
+	char data[200];
+	tTxPoolStats stats;
+	unsigned writesBefore;
+	unsigned n, i;
+
+	os_memset(data, 0x42, sizeof(data));
+	server_read(msgs, SERVER_MSGS_MAX);
+
+	// short frames of one turn, one write
+	writesBefore = writes;
+	ctrl_stack_keepalive(1);
+	ctrl_stack_get_rtc();
+	for(i=0; i<3; i++)
+	{
+		CHECK_EQ(ctrl_platform_send(data, 8, 1), 0);
+	}
+	CHECK_EQ(testWrites, 0);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 5);
+	CHECK_EQ(writes, writesBefore+1);
+	CHECK_EQ(msgs[0].data[0], SYSTEM_MESSAGE_KEEPALIVE_ON);
+	CHECK_EQ(msgs[1].data[0], SYSTEM_MESSAGE_GET_RTC);
+
+	// longer ones, as many as fit together
+	unsigned short frameLen = 2+(16*((23+sizeof(data))/16)+16)+16;
+	unsigned perWrite = CTRL_TX_COALESCE_SIZE / frameLen;
+	writesBefore = writes;
+	for(i=0; i<4; i++)
+	{
+		CHECK_EQ(ctrl_platform_send(data, sizeof(data), 1), 0);
+	}
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 4);
+	CHECK_EQ(writes, writesBefore + (4+perWrite-1)/perWrite);
+	for(i=0; i<n; i++)
+	{
+		CHECK_EQ(msgs[i].length, 1+4+sizeof(data));
+	}
+
+	// while a write is in flight everything queues up behind it, and goes out together once it completes
+	sentHeld = 1;
+	ctrl_stack_keepalive(1);
+	pump();
+	CHECK(txInFlight != NULL);
+	for(i=0; i<6; i++)
+	{
+		CHECK_EQ(ctrl_platform_send(data, 8, 1), 0);
+		test_time_advance(1);
+	}
+	CHECK_EQ(txQueueCount, 6);
+	sentHeld = 0;
+	writesBefore = writes;
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 7);
+	CHECK_EQ(writes, writesBefore+2);
+
+	// socket that doesn't take a write gets it again a bit later, nothing is lost or reordered
+	testSentResult = ESPCONN_MAXNUM;
+	ctrl_stack_keepalive(1);
+	ctrl_stack_get_rtc();
+	pump();
+	CHECK(txHeld != NULL);
+	CHECK_EQ(testWireLen, 0);
+	testSentResult = ESPCONN_OK;
+	test_time_advance(CTRL_TX_RETRY_MS);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK_EQ(msgs[0].data[0], SYSTEM_MESSAGE_KEEPALIVE_ON);
+	CHECK_EQ(msgs[1].data[0], SYSTEM_MESSAGE_GET_RTC);
+
+	// every buffer is back in the pool
+	ctrl_txpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+	CHECK_EQ(txQueueCount, 0);
+}
+
+#define STARTUP_LINK_MS		20 // one way delay between Base and Server
+#define STARTUP_ROWS		3
+
+static uint32 startupAuthAt; // when Base got authorized
+static uint32 startupRowAt; // when its first row went out
+
+// like pump(), but the sent callback only arrives once TCP acknowledged the write after a round trip
+static void link_pump(void)
+{
+	test_time_advance(0);
+	while(1)
+	{
+		if(startupAuthAt == 0 && connState == CTRL_AUTHENTICATED)
+		{
+			startupAuthAt = system_get_time();
+		}
+		if(startupRowAt == 0 && ctrl_database_count_in_flight() > 0)
+		{
+			startupRowAt = system_get_time();
+		}
+		if(txInFlight == NULL)
+		{
+			break;
+		}
+
+		test_time_advance(2*STARTUP_LINK_MS);
+		writes++;
+		testSentCb(&ctrlConn);
+		test_time_advance(0);
+	}
+}
+
+// rows left over from the last connection go out right after authorization, in the same write as
+// capabilities, keep-alive and timestamp request, they don't wait for an earlier write to complete
+static void test_startup(void)
+{
+	unsigned long first = gTXbase;
+	unsigned writesBefore;
+	unsigned n, i;
+
+	testDisconCb(&ctrlConn);
+	add_rows(STARTUP_ROWS);
+	test_time_advance(1000);
+
+	serverPump = link_pump;
+	startupAuthAt = 0;
+	startupRowAt = 0;
+	server_init();
+	serverTX = 0;
+	testConnectCb(&ctrlConn);
+	writesBefore = writes;
+	n = server_handshake(0, 0, msgs, SERVER_MSGS_MAX);
+	serverPump = pump;
+
+	CHECK_EQ(writes, writesBefore+3); // authorization, challenge response, then all of what follows it
+	CHECK_EQ(n, 1+2+STARTUP_ROWS);
+	CHECK_EQ(msgs[1].data[0], SYSTEM_MESSAGE_KEEPALIVE_ON);
+	CHECK_EQ(msgs[2].data[0], SYSTEM_MESSAGE_GET_RTC);
+	for(i=0; i<STARTUP_ROWS; i++)
+	{
+		CHECK(row_ok(&msgs[3+i], first+i));
+	}
+
+	// first row reaches Server and its ACK comes back over the link
+	uint32 latency = (startupRowAt - startupAuthAt) / 1000 + 2*STARTUP_LINK_MS;
+	printf("  first row acknowledged %u ms after authorization (link %u ms each way)\n", latency, STARTUP_LINK_MS);
+	CHECK_EQ(latency, 2*STARTUP_LINK_MS);
+
+	for(i=0; i<STARTUP_ROWS; i++)
+	{
+		ack(first+i);
+	}
+	CHECK_EQ(read_rows(), 0);
+	CHECK_EQ(ctrl_database_count_unacked_items(), 0);
+}
+
+// re-transmission timeout follows measured round trip time, unacknowledged row goes out again on it
+static void test_rto(void)
+{
+	unsigned long TXbase, timeout;
+	unsigned i;
+
+	// Jacobson/Karels estimate, clamped to CTRL_RTO_MIN_MS..CTRL_RTO_MAX_MS
+	rttMeasured = 0;
+	ctrl_platform_rtt_sample(100);
+	CHECK_EQ(srtt, 100);
+	CHECK_EQ(rttvar, 50);
+	CHECK_EQ(rto, 300);
+	ctrl_platform_rtt_sample(100);
+	CHECK_EQ(rttvar, 37);
+	CHECK_EQ(rto, 248);
+	ctrl_platform_rtt_sample(300);
+	CHECK_EQ(srtt, 125);
+	CHECK_EQ(rttvar, 77);
+	CHECK_EQ(rto, 433);
+	rttMeasured = 0;
+	ctrl_platform_rtt_sample(10);
+	CHECK_EQ(rto, CTRL_RTO_MIN_MS);
+	rttMeasured = 0;
+	ctrl_platform_rtt_sample(5000);
+	CHECK_EQ(rto, CTRL_RTO_MAX_MS);
+
+	// sampled from ACK timing
+	rttMeasured = 0;
+	rto = CTRL_RTO_INITIAL_MS;
+	add_rows(1);
+	TXbase = gTXbase-1;
+	CHECK_EQ(read_rows(), 1);
+	CHECK_EQ(test_timer_left(&tmrRetransmit), CTRL_RTO_INITIAL_MS);
+	test_time_advance(150);
+	ack(TXbase);
+	CHECK_EQ(srtt, 150);
+	CHECK_EQ(rto, 450);
+	CHECK(!test_timer_armed(&tmrRetransmit));
+
+	// ACK of a row that was sent again says nothing about round trip time (Karn)
+	add_rows(1);
+	TXbase = gTXbase-1;
+	CHECK_EQ(read_rows(), 1);
+	test_time_advance(rto);
+	CHECK_EQ(read_rows(), 1);
+	CHECK(row_ok(&msgs[0], TXbase));
+	CHECK_EQ(test_timer_left(&tmrRetransmit), 2*450);
+	test_time_advance(100);
+	ack(TXbase);
+	CHECK_EQ(srtt, 150);
+	CHECK_EQ(rto, 450);
+	CHECK_EQ(rtoBackoff, 0);
+
+	// every re-transmission waits twice as long, up to CTRL_RTO_MAX_MS
+	add_rows(1);
+	TXbase = gTXbase-1;
+	CHECK_EQ(read_rows(), 1);
+	timeout = rto;
+	for(i=0; i<CTRL_RETRANSMIT_MAX; i++)
+	{
+		CHECK_EQ(test_timer_left(&tmrRetransmit), timeout);
+		test_time_advance(timeout-1);
+		CHECK_EQ(read_rows(), 0);
+		test_time_advance(1);
+		CHECK_EQ(read_rows(), 1);
+		CHECK(row_ok(&msgs[0], TXbase));
+		timeout = (2*timeout < CTRL_RTO_MAX_MS) ? 2*timeout : CTRL_RTO_MAX_MS;
+	}
+	CHECK_EQ(timeout, CTRL_RTO_MAX_MS);
+
+	// the one after CTRL_RETRANSMIT_MAX re-transmissions re-establishes the connection instead
+	unsigned disconnects = testDisconnects;
+	test_time_advance(timeout);
+	CHECK_EQ(read_rows(), 0);
+	CHECK_EQ(testDisconnects, disconnects+1);
+	CHECK_EQ(connState, CTRL_TCP_DISCONNECTED);
+
+	// row is sent again on the new connection, with fresh re-transmission timeout
+	platform_reconnect(0, 0);
+	CHECK_EQ(connState, CTRL_AUTHENTICATED);
+	CHECK_EQ(ctrl_database_count_in_flight(), 1);
+	ack(TXbase);
+	CHECK_EQ(ctrl_database_count_unacked_items(), 0);
+	CHECK(!test_timer_armed(&tmrRetransmit));
+}
+
+// Server reports rows it can't take as out of sync, Base sends again only from the first one it is missing
+static void test_resync(void)
+{
+	unsigned long first;
+	unsigned n, i;
+
+	platform_reconnect(0, 0);
+	first = gTXbase;
+	add_rows(2);
+	CHECK_EQ(read_rows(), 2);
+
+	// Server didn't get "first", rejects the one after it
+	server_send(CH_ACK | CH_OUT_OF_SYNC, first+1, NULL, 0);
+	CHECK_EQ(outOfSyncCounter, 1);
+	n = read_rows();
+	CHECK_EQ(n, 2);
+	for(i=0; i<n; i++)
+	{
+		CHECK(row_ok(&msgs[i], first+i));
+	}
+
+	// row added while re-sending goes out after them
+	add_rows(1);
+	CHECK_EQ(read_rows(), 1);
+
+	// reports on rows sent before re-sending began are echoes, nothing is sent again
+	server_send(CH_ACK | CH_OUT_OF_SYNC, first+1, NULL, 0);
+	CHECK_EQ(outOfSyncCounter, 1);
+	CHECK_EQ(read_rows(), 0);
+
+	// report on the newer one is a problem of its own, it counts and everything is sent again
+	server_send(CH_ACK | CH_OUT_OF_SYNC, first+2, NULL, 0);
+	CHECK_EQ(outOfSyncCounter, 2);
+	n = read_rows();
+	CHECK_EQ(n, 3);
+	for(i=0; i<n; i++)
+	{
+		CHECK(row_ok(&msgs[i], first+i));
+	}
+	server_send(CH_ACK | CH_OUT_OF_SYNC, first+2, NULL, 0);
+	CHECK_EQ(outOfSyncCounter, 2);
+	CHECK_EQ(read_rows(), 0);
+
+	// Server got them this time
+	for(i=0; i<3; i++)
+	{
+		ack(first+i);
+	}
+	CHECK_EQ(outOfSyncCounter, 0);
+	CHECK_EQ(resyncing, 0);
+	CHECK_EQ(ctrl_database_count_unacked_items(), 0);
+
+	// third report in a row gives up on the queue and the connection
+	add_rows(3);
+	CHECK_EQ(read_rows(), 3);
+	unsigned disconnects = testDisconnects;
+	server_send(CH_ACK | CH_OUT_OF_SYNC, first+4, NULL, 0);
+	CHECK_EQ(read_rows(), 3);
+	add_rows(1);
+	CHECK_EQ(read_rows(), 1);
+	server_send(CH_ACK | CH_OUT_OF_SYNC, first+6, NULL, 0);
+	CHECK_EQ(read_rows(), 4);
+	add_rows(1);
+	CHECK_EQ(read_rows(), 1);
+	server_send(CH_ACK | CH_OUT_OF_SYNC, first+7, NULL, 0);
+	CHECK_EQ(testDisconnects, disconnects+1);
+	CHECK_EQ(ctrl_database_count_unacked_items(), 0);
+
+	platform_reconnect(0, 0);
+	CHECK_EQ(connState, CTRL_AUTHENTICATED);
+}
+
+// queued messages keep their receive pool buffers (longer ones a copy on heap) until app gets them
+static void test_app_queue(void)
+{
+	tRxPoolStats stats;
+	char data[200];
+	unsigned heapBlocks;
+	unsigned n;
+
+	os_memset(data, 0x33, sizeof(data));
+	test_tasks_run();
+	server_read(msgs, SERVER_MSGS_MAX);
+	gotCount = 0;
+	heapBlocks = testHeapBlocks;
+
+	send_message(0, data, 8);
+	send_message(0, data, sizeof(data));
+	server_send(CH_NOTIFICATION, 0, data, 8);
+	CHECK_EQ(gotCount, 0);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 2);
+	CHECK_EQ(testHeapBlocks, heapBlocks+1);
+
+	test_tasks_run();
+	CHECK_EQ(gotCount, 3);
+	CHECK_EQ(gotTX[1], serverTX);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+	CHECK_EQ(testHeapBlocks, heapBlocks);
+
+	// no heap for the copy, message is refused before it gets acknowledged
+	server_read(msgs, SERVER_MSGS_MAX);
+	testMallocFail = 1;
+	send_message(0, data, sizeof(data));
+	testMallocFail = 0;
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].header, CH_ACK | CH_BACKOFF);
+	CHECK_EQ(msgs[0].TXsender, serverTX);
+	CHECK_EQ(gotCount, 3);
+	CHECK_EQ(backedOff, 1);
+
+	// Server confirms backoff, it is released, Server sends the message again
+	server_send(CH_ACK | CH_BACKOFF, 0, NULL, 0);
+	test_time_advance(TMR_BACKOFF_CHECK_MS);
+	CHECK_EQ(backedOff, 0);
+	server_send(0, serverTX, data, sizeof(data));
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].header, CH_ACK | CH_PROCESSED | CH_SAVE_TXSERVER);
+	test_tasks_run();
+	CHECK_EQ(gotCount, 4);
+	CHECK_EQ(testHeapBlocks, heapBlocks);
+}
+
+// when SDK task queue doesn't take the app task, it is posted again a bit later
+static void test_task_post(void)
+{
+	unsigned i;
+
+	test_tasks_run();
+	server_read(msgs, SERVER_MSGS_MAX);
+	gotCount = 0;
+
+	testPostFail = 1;
+	send_message(0, "a", 1);
+	CHECK_EQ(test_tasks_pending(), 0);
+	CHECK_EQ(appQueueCount, 1);
+	test_time_advance(TMR_APP_TASK_RETRY_MS);
+	CHECK_EQ(test_tasks_pending(), 1);
+	test_tasks_run();
+	CHECK_EQ(gotCount, 1);
+
+	// task posting itself for the next batch
+	for(i=0; i<CTRL_APP_QUEUE_BATCH+2; i++)
+	{
+		send_message(0, "b", 1);
+	}
+	testPostFail = 2;
+	test_tasks_run();
+	CHECK_EQ(gotCount, 1+CTRL_APP_QUEUE_BATCH);
+	test_time_advance(TMR_APP_TASK_RETRY_MS);
+	CHECK_EQ(test_tasks_pending(), 0);
+	test_time_advance(TMR_APP_TASK_RETRY_MS);
+	test_tasks_run();
+	CHECK_EQ(gotCount, 1+CTRL_APP_QUEUE_BATCH+2);
+	CHECK_EQ(appQueueCount, 0);
+
+	// backed off Server sends nothing, only the retry drains the queue and releases it
+	testPostFail = CTRL_APP_QUEUE_BACKOFF;
+	for(i=0; i<CTRL_APP_QUEUE_BACKOFF; i++)
+	{
+		send_message(0, "c", 1);
+	}
+	CHECK_EQ(backedOff, 1);
+	test_tasks_run();
+	server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(appQueueCount, CTRL_APP_QUEUE_BACKOFF);
+	#ifndef CTRL_FLOW_CONTROL_TCP
+		server_send(CH_ACK | CH_BACKOFF, 0, NULL, 0);
+	#endif
+	for(i=0; i<10 && backedOff; i++)
+	{
+		test_time_advance(TMR_APP_TASK_RETRY_MS);
+		test_tasks_run();
+	}
+	CHECK_EQ(backedOff, 0);
+	CHECK_EQ(appQueueCount, 0);
+	CHECK_EQ(gotCount, 1+CTRL_APP_QUEUE_BATCH+2+CTRL_APP_QUEUE_BACKOFF);
+	server_read(msgs, SERVER_MSGS_MAX);
+}
+
+#define BURST_TICK_MS		10
+#define BURST_WINDOW		1024 // bytes Server can have on their way to Base, like TCP window
+#define SERVER_BACKOFF_MS	200 // how long Server waits before it sends again after BACKOFF
+
+static char burstPipe[BURST_WINDOW+64];
+static unsigned short burstSegments[BURST_WINDOW/16]; // lengths of segments in burstPipe, one message each
+
+/*
+	Server sends "count" messages as fast as the window lets it, each in its own segment, app takes
+	one batch every tick. Segments wait in the window while Base doesn't read from the socket. On BACKOFF Server confirms
+	it, waits SERVER_BACKOFF_MS and sends again from the first message that wasn't processed.
+	Returns how many messages were sent again.
+*/
+static unsigned burst(unsigned count)
+{
+	unsigned long last = serverTX + count;
+	unsigned long next = serverTX + 1; // next message Server sends
+	unsigned long processed = serverTX;
+	unsigned short pipeLen = 0, segments = 0, seg;
+	unsigned char serverBackedOff = 0;
+	unsigned long now = 0, backoffEnds = 0;
+	unsigned sent = 0, holds = 0;
+	unsigned n, i;
+
+	test_tasks_run();
+	server_read(msgs, SERVER_MSGS_MAX);
+	gotCount = 0;
+
+	while((processed < last || gotCount < count) && now < 60000)
+	{
+		// Server sends while window has room and it isn't backed off
+		while(next <= last && !serverBackedOff && pipeLen + 64 <= BURST_WINDOW)
+		{
+			burstSegments[segments] = server_frame(burstPipe+pipeLen, 0, next++, "burst", 5);
+			pipeLen += burstSegments[segments++];
+			sent++;
+		}
+
+		// TCP delivers them until Base stops reading
+		char *segment = burstPipe;
+		for(seg=0; seg<segments && !testRecvHeld; seg++)
+		{
+			testRecvCb(&ctrlConn, segment, burstSegments[seg]);
+			segment += burstSegments[seg];
+		}
+		if(testRecvHeld)
+		{
+			holds++;
+		}
+		os_memmove(burstPipe, segment, pipeLen - (segment - burstPipe));
+		os_memmove(burstSegments, burstSegments+seg, (segments-seg)*sizeof(burstSegments[0]));
+		pipeLen -= segment - burstPipe;
+		segments -= seg;
+
+		n = server_read(msgs, SERVER_MSGS_MAX);
+		for(i=0; i<n; i++)
+		{
+			if(!(msgs[i].header & CH_ACK))
+			{
+				continue;
+			}
+			if((msgs[i].header & CH_PROCESSED) && msgs[i].TXsender > processed)
+			{
+				processed = msgs[i].TXsender;
+			}
+			if((msgs[i].header & CH_BACKOFF) && !serverBackedOff)
+			{
+				serverBackedOff = 1;
+				backoffEnds = now + SERVER_BACKOFF_MS;
+				burstSegments[segments] = server_frame(burstPipe+pipeLen, CH_ACK | CH_BACKOFF, 0, NULL, 0);
+				pipeLen += burstSegments[segments++];
+			}
+		}
+		if(serverBackedOff && now >= backoffEnds)
+		{
+			serverBackedOff = 0;
+			next = processed + 1;
+		}
+
+		test_tasks_run_once();
+		test_time_advance(BURST_TICK_MS);
+		now += BURST_TICK_MS;
+	}
+	serverTX = last;
+
+	CHECK_EQ(processed, last);
+	CHECK_EQ(gotCount, count);
+	for(i=1; i<count && i<GOT_MAX; i++)
+	{
+		CHECK_EQ(gotTX[i], gotTX[i-1]+1);
+	}
+	CHECK_EQ(backedOff, 0);
+	CHECK_EQ(testRecvHeld, 0);
+
+	printf("  %u messages in %u ms, %u sent again, socket held for %u ms\n", count, now, sent-count, holds*BURST_TICK_MS);
+	return sent - count;
+}
+
+// a burst from Server that app can't keep up with, backoff controller throttles it
+static void test_burst(void)
+{
+	#ifdef CTRL_FLOW_CONTROL_TCP
+		// TCP window throttles Server, nothing is sent again
+		CHECK_EQ(burst(100), 0);
+	#else
+		burst(100);
+	#endif
+}
+
+#ifdef CTRL_FLOW_CONTROL_TCP
+// while Base doesn't read from the socket no ACK can arrive, rows waiting for them are not sent again meanwhile
+static void test_hold_rto(void)
+{
+	unsigned long TXbase;
+	unsigned disconnects = testDisconnects;
+	unsigned i;
+
+	test_tasks_run();
+	server_read(msgs, SERVER_MSGS_MAX);
+	add_rows(1);
+	TXbase = gTXbase-1;
+	CHECK_EQ(read_rows(), 1);
+	CHECK(test_timer_armed(&tmrRetransmit));
+
+	for(i=0; i<CTRL_APP_QUEUE_BACKOFF; i++)
+	{
+		send_message(0, "hold", 4);
+	}
+	CHECK_EQ(testRecvHeld, 1);
+	CHECK(!test_timer_armed(&tmrRetransmit));
+
+	test_time_advance((CTRL_RETRANSMIT_MAX+1)*CTRL_RTO_MAX_MS);
+	CHECK_EQ(read_rows(), 0);
+	CHECK_EQ(testDisconnects, disconnects);
+	CHECK_EQ(connState, CTRL_AUTHENTICATED);
+
+	// app catches up, socket is read again and the row gets a fresh timeout
+	test_tasks_run();
+	CHECK_EQ(testRecvHeld, 0);
+	CHECK(test_timer_armed(&tmrRetransmit));
+	CHECK_EQ(test_timer_left(&tmrRetransmit), rto);
+	server_read(msgs, SERVER_MSGS_MAX);
+	ack(TXbase);
+	CHECK(!test_timer_armed(&tmrRetransmit));
+	CHECK_EQ(ctrl_database_count_unacked_items(), 0);
+}
+#endif
+
+static void wifi_event(uint32 event)
+{
+	System_Event_t evt;
+	os_memset(&evt, 0, sizeof(System_Event_t));
+	evt.event = event;
+	testWifiEventCb(&evt);
+}
+
+// Wi-Fi events drive the connection: nothing polls while there is no IP, TCP connects the moment it is assigned
+static void test_wifi_events(void)
+{
+	unsigned connects = testConnects;
+	unsigned disconnects = testDisconnects;
+
+	CHECK(testWifiEventCb != NULL);
+	test_tasks_run();
+	server_read(msgs, SERVER_MSGS_MAX);
+
+	// IP renewed while connected, nothing to do
+	wifi_event(EVENT_STAMODE_GOT_IP);
+	CHECK_EQ(testConnects, connects);
+	CHECK_EQ(connState, CTRL_AUTHENTICATED);
+
+	// AP is gone, live socket is dropped and reconnect finds no IP, then it waits for the event
+	testStationStatus = STATION_CONNECTING;
+	wifi_event(EVENT_STAMODE_DISCONNECTED);
+	CHECK_EQ(testDisconnects, disconnects+1);
+	CHECK_EQ(connState, CTRL_TCP_DISCONNECTED);
+	testDisconCb(&ctrlConn);
+	test_time_advance(1000);
+	CHECK_EQ(connState, CTRL_WIFI_CONNECTING);
+	CHECK_EQ(testConnects, connects);
+	CHECK(!test_timer_armed(&tmrLinker));
+
+	// failed attempts to join are just recorded
+	testStationStatus = STATION_WRONG_PASSWORD;
+	wifi_event(EVENT_STAMODE_DISCONNECTED);
+	CHECK_EQ(connState, CTRL_WIFI_CONNECTING_ERROR);
+	test_time_advance(5000);
+	CHECK_EQ(testConnects, connects);
+	CHECK(!test_timer_armed(&tmrLinker));
+
+	// IP arrives in the middle of what used to be a 1 s poll
+	test_time_advance(530);
+	testStationStatus = STATION_GOT_IP;
+	uint32 gotIpAt = system_get_time();
+	wifi_event(EVENT_STAMODE_GOT_IP);
+	CHECK_EQ(testConnects, connects+1);
+	CHECK_EQ(connState, CTRL_TCP_CONNECTING);
+	printf("  TCP connect %u ms after GOT_IP\n", (testConnectAt - gotIpAt) / 1000);
+	CHECK_EQ(testConnectAt, gotIpAt);
+
+	// another GOT_IP while connecting doesn't start a second connection
+	wifi_event(EVENT_STAMODE_GOT_IP);
+	CHECK_EQ(testConnects, connects+1);
+
+	server_init();
+	serverTX = 0;
+	testConnectCb(&ctrlConn);
+	server_handshake(0, 0, msgs, SERVER_MSGS_MAX);
+	server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(connState, CTRL_AUTHENTICATED);
+}
+
+int main(void)
+{
+	srand(10);
+	serverPump = pump;
+
+	ctrl_platform_init();
+	CHECK(testConnectCb != NULL);
+	platform_connect(0, 0);
+	server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(connState, CTRL_AUTHENTICATED);
+
+	test_window();
+	test_window_container();
+	test_coalesce();
+	test_startup();
+	test_rto();
+	test_resync();
+	test_app_queue();
+	test_task_post();
+	test_burst();
+	#ifdef CTRL_FLOW_CONTROL_TCP
+		test_hold_rto();
+	#endif
+	test_wifi_events();
+
+	#ifdef CTRL_FLOW_CONTROL_TCP
+		return test_done("test_platform (CTRL_FLOW_CONTROL_TCP)");
+	#else
+		return test_done("test_platform");
+	#endif
+}
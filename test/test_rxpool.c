@@ -0,0 +1,121 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+
+#include "../ctrl/include/ctrl_rxpool.h"
+
+#include "test.h"
+
+/*
+	Receive pool: buffers are reference counted through pointers anywhere inside of them, return to
+	the pool with the last reference, and pointers outside of the pool are left to their owners.
+*/
+
+static void test_refs(void)
+{
+	tRxPoolStats stats;
+	char own[16];
+	unsigned i;
+
+	char *buff = ctrl_rxpool_alloc(CTRL_RXPOOL_SIZE);
+	CHECK(buff != NULL);
+	CHECK_EQ((uintptr_t)buff % 16, 0);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.hits, 1);
+	CHECK_EQ(stats.inUse, 1);
+
+	// references through pointers inside of it, the last one returns it
+	CHECK_EQ(ctrl_rxpool_ref(buff+7), 0);
+	CHECK_EQ(ctrl_rxpool_unref(buff), 0);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 1);
+	CHECK_EQ(ctrl_rxpool_unref(buff+CTRL_RXPOOL_SIZE-1), 0);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+
+	// free buffer can't be referenced, releasing it again changes nothing
+	CHECK_EQ(ctrl_rxpool_ref(buff), 1);
+	CHECK_EQ(ctrl_rxpool_unref(buff), 0);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+
+	// not from the pool, caller keeps (and frees) its own copy
+	char *heap = (char *)os_malloc(16);
+	CHECK_EQ(ctrl_rxpool_ref(own), 1);
+	CHECK_EQ(ctrl_rxpool_unref(own), 1);
+	CHECK_EQ(ctrl_rxpool_ref(heap), 1);
+	CHECK_EQ(ctrl_rxpool_unref(heap), 1);
+	os_free(heap);
+
+	// reference count saturates, whoever doesn't get a reference makes a copy
+	buff = ctrl_rxpool_alloc(1);
+	for(i=1; i<0xFF; i++)
+	{
+		CHECK_EQ(ctrl_rxpool_ref(buff), 0);
+	}
+	CHECK_EQ(ctrl_rxpool_ref(buff), 1);
+	for(i=0; i<0xFF; i++)
+	{
+		ctrl_rxpool_get_stats(&stats);
+		CHECK_EQ(stats.inUse, 1);
+		CHECK_EQ(ctrl_rxpool_unref(buff), 0);
+	}
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+}
+
+static void test_exhausted(void)
+{
+	char *buffs[CTRL_RXPOOL_COUNT];
+	tRxPoolStats stats;
+	unsigned i, j;
+
+	for(i=0; i<CTRL_RXPOOL_COUNT; i++)
+	{
+		buffs[i] = ctrl_rxpool_alloc(1+i);
+		CHECK(buffs[i] != NULL);
+		for(j=0; j<i; j++)
+		{
+			CHECK(buffs[i] >= buffs[j] + CTRL_RXPOOL_SIZE || buffs[j] >= buffs[i] + CTRL_RXPOOL_SIZE);
+		}
+		os_memset(buffs[i], i, CTRL_RXPOOL_SIZE);
+	}
+
+	CHECK(ctrl_rxpool_alloc(1) == NULL);
+	CHECK(ctrl_rxpool_alloc(CTRL_RXPOOL_SIZE+1) == NULL);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.exhausted, 1);
+	CHECK_EQ(stats.tooLong, 1);
+	CHECK_EQ(stats.inUse, CTRL_RXPOOL_COUNT);
+	CHECK_EQ(stats.highWater, CTRL_RXPOOL_COUNT);
+
+	// nobody wrote over anybody else
+	for(i=0; i<CTRL_RXPOOL_COUNT; i++)
+	{
+		for(j=0; j<CTRL_RXPOOL_SIZE; j++)
+		{
+			CHECK_EQ(buffs[i][j], (char)i);
+		}
+	}
+
+	// released one is taken again
+	CHECK_EQ(ctrl_rxpool_unref(buffs[CTRL_RXPOOL_COUNT/2]), 0);
+	CHECK(ctrl_rxpool_alloc(CTRL_RXPOOL_SIZE) == buffs[CTRL_RXPOOL_COUNT/2]);
+
+	for(i=0; i<CTRL_RXPOOL_COUNT; i++)
+	{
+		CHECK_EQ(ctrl_rxpool_unref(buffs[i]), 0);
+	}
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+	CHECK_EQ(stats.highWater, CTRL_RXPOOL_COUNT);
+	CHECK_EQ(testHeapBlocks, 0);
+}
+
+int main(void)
+{
+	test_refs();
+	test_exhausted();
+
+	return test_done("test_rxpool");
+}
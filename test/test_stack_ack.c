@@ -0,0 +1,181 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+
+#include "../ctrl/include/ctrl_stack.h"
+
+#include "test.h"
+#include "server.h"
+
+/*
+	ACKs Base sends for messages from Server: cumulative ACKs for messages in order, and
+	everything that must reach Server right away (re-transmissions, backoff).
+*/
+
+static tServerMsg msgs[SERVER_MSGS_MAX];
+static unsigned gotCount;
+static unsigned long backoffAt; // message_received() backs off Server when it gets this TXsender
+static unsigned long refuseAt; // message_received() refuses this TXsender
+
+static unsigned char message_received(tCtrlMessage *msg)
+{
+	gotCount++;
+	if(msg->TXsender == backoffAt)
+	{
+		ctrl_stack_backoff(1);
+	}
+	if(msg->TXsender == refuseAt)
+	{
+		ctrl_stack_backoff(1);
+		return 1;
+	}
+	return 0;
+}
+
+static tCtrlCallbacks callbacks = { message_received, NULL, server_sink, NULL };
+
+static void send_message(unsigned long TXsender)
+{
+	server_send(0, TXsender, "data", 4);
+}
+
+static unsigned long saved_txserver(tServerMsg *msg)
+{
+	unsigned long TXserver;
+	os_memcpy(&TXserver, msg->data, 4);
+	return TXserver;
+}
+
+#define ACK_PROCESSED	(CH_ACK | CH_PROCESSED | CH_SAVE_TXSERVER)
+
+// one ACK covers messages in order, after the delay or CTRL_CUMULATIVE_ACK_MAX of them
+static void test_cumulative(void)
+{
+	unsigned long TX;
+	unsigned n;
+
+	server_connect(&callbacks, 0, CTRL_CAP_CUMULATIVE_ACK);
+
+	for(TX=1; TX<=3; TX++)
+	{
+		send_message(TX);
+	}
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 0);
+	test_time_advance(TMR_ACK_DELAY_MS);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].header, ACK_PROCESSED);
+	CHECK_EQ(msgs[0].TXsender, 3);
+	CHECK_EQ(saved_txserver(&msgs[0]), 3);
+
+	for(; TX<=3+CTRL_CUMULATIVE_ACK_MAX; TX++)
+	{
+		send_message(TX);
+	}
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].TXsender, 3+CTRL_CUMULATIVE_ACK_MAX);
+
+	// re-transmission is acknowledged right away, after the messages processed before it
+	send_message(TX++);
+	send_message(TX-1);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK_EQ(msgs[0].header, ACK_PROCESSED);
+	CHECK_EQ(msgs[0].TXsender, TX-1);
+	CHECK_EQ(msgs[1].header, CH_ACK);
+	CHECK_EQ(msgs[1].TXsender, TX-1);
+
+	// without the capability every message gets its own ACK
+	server_connect(&callbacks, 0, 0);
+	send_message(1);
+	send_message(2);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK_EQ(msgs[0].TXsender, 1);
+	CHECK_EQ(msgs[1].TXsender, 2);
+}
+
+// messages waiting for cumulative ACK are acknowledged the moment we back off, and tell Server about it
+static void test_backoff(void)
+{
+	unsigned n;
+
+	// backoff from outside of message processing
+	server_connect(&callbacks, 0, CTRL_CAP_CUMULATIVE_ACK);
+	send_message(1);
+	send_message(2);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 0);
+	ctrl_stack_backoff(1);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].header, ACK_PROCESSED | CH_BACKOFF);
+	CHECK_EQ(msgs[0].TXsender, 2);
+
+	// while backed off, nothing waits
+	send_message(3);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].header, ACK_PROCESSED | CH_BACKOFF);
+	CHECK_EQ(msgs[0].TXsender, 3);
+
+	// backing off again changes nothing
+	ctrl_stack_backoff(1);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 0);
+
+	// backoff while message is being processed, that one and those before it are acknowledged with BACKOFF
+	server_connect(&callbacks, 0, CTRL_CAP_CUMULATIVE_ACK);
+	ctrl_stack_backoff(0); // new connection, app releases backoff like ctrl_platform does
+	backoffAt = 3;
+	send_message(1);
+	send_message(2);
+	send_message(3);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].header, ACK_PROCESSED | CH_BACKOFF);
+	CHECK_EQ(msgs[0].TXsender, 2);
+	test_time_advance(TMR_ACK_DELAY_MS);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].header, ACK_PROCESSED | CH_BACKOFF);
+	CHECK_EQ(msgs[0].TXsender, 3);
+	backoffAt = 0;
+
+	// refused message: messages before it are acknowledged first, it is not processed
+	server_connect(&callbacks, 0, CTRL_CAP_CUMULATIVE_ACK);
+	ctrl_stack_backoff(0);
+	refuseAt = 3;
+	send_message(1);
+	send_message(2);
+	send_message(3);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK_EQ(msgs[0].header, ACK_PROCESSED | CH_BACKOFF);
+	CHECK_EQ(msgs[0].TXsender, 2);
+	CHECK_EQ(saved_txserver(&msgs[0]), 2);
+	CHECK_EQ(msgs[1].header, CH_ACK | CH_BACKOFF);
+	CHECK_EQ(msgs[1].TXsender, 3);
+	refuseAt = 0;
+
+	// Server confirms backoff, it can be released then and ACKs wait again
+	CHECK_EQ(ctrl_stack_backoff(0), 1);
+	server_send(CH_ACK | CH_BACKOFF, 0, NULL, 0);
+	CHECK_EQ(ctrl_stack_backoff(0), 0);
+	send_message(3);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 0);
+	test_time_advance(TMR_ACK_DELAY_MS);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].header, ACK_PROCESSED);
+	CHECK_EQ(msgs[0].TXsender, 3);
+}
+
+int main(void)
+{
+	srand(14);
+
+	test_cumulative();
+	test_backoff();
+
+	return test_done("test_stack_ack");
+}
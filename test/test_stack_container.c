@@ -0,0 +1,304 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+
+#include "../ctrl/include/ctrl_stack.h"
+
+#include "test.h"
+#include "server.h"
+
+/*
+	Container frames: what ctrl_stack_send_container() packs, ctrl_stack_process_container() unpacks
+	the same way (both sides use the same key, so Base can read its own frames). Malformed records end
+	the container, and ACKs to all messages of one received segment go out in one container.
+*/
+
+#define GOT_MAX	64
+
+static tServerMsg msgs[SERVER_MSGS_MAX];
+static char got[GOT_MAX][SERVER_DATA_MAX];
+static unsigned short gotLen[GOT_MAX];
+static unsigned long gotTX[GOT_MAX];
+static unsigned char gotHeader[GOT_MAX];
+static unsigned gotCount;
+
+static unsigned char message_received(tCtrlMessage *msg)
+{
+	CHECK(gotCount < GOT_MAX);
+	if(gotCount < GOT_MAX)
+	{
+		gotLen[gotCount] = msg->length-1-4;
+		gotTX[gotCount] = msg->TXsender;
+		gotHeader[gotCount] = msg->header;
+		os_memcpy(got[gotCount], msg->data, msg->length-1-4);
+		gotCount++;
+	}
+	return 0;
+}
+
+static tCtrlCallbacks callbacks = { message_received, NULL, server_sink, NULL };
+
+// builds "count" messages with TXsender from "first" on and data lengths "lengths"
+static void make_messages(tCtrlMessage *m, char data[][SERVER_DATA_MAX], unsigned char count, unsigned long first, const unsigned short *lengths)
+{
+	unsigned char i;
+	unsigned short j;
+	for(i=0; i<count; i++)
+	{
+		m[i].header = 0;
+		m[i].TXsender = first+i;
+		m[i].length = 1+4+lengths[i];
+		for(j=0; j<lengths[i]; j++)
+		{
+			data[i][j] = rand();
+		}
+		m[i].data = data[i];
+	}
+}
+
+// Base sends messages in a container, reads them back as if Server sent them
+static void test_round_trip(void)
+{
+	static const unsigned short lengths[] = { 0, 1, 16, 100, 3, 58 };
+	static char data[6][SERVER_DATA_MAX];
+	tCtrlMessage m[6];
+	unsigned n, i;
+
+	server_connect(&callbacks, 0, CTRL_CAP_CONTAINER);
+	make_messages(m, data, 6, 1, lengths);
+
+	CHECK_EQ(ctrl_stack_send_container(m, 6), 0);
+	CHECK_EQ(testWrites, 1);
+
+	// keep the frame, Server reads it first
+	char frame[1024];
+	unsigned short frameLen = testWireLen;
+	os_memcpy(frame, testWire, frameLen);
+
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 6);
+	CHECK_EQ(serverFrames, 1);
+	CHECK_EQ(serverContainers, 1);
+	for(i=0; i<n; i++)
+	{
+		CHECK_EQ(msgs[i].length, m[i].length);
+		CHECK_EQ(msgs[i].TXsender, m[i].TXsender);
+		CHECK_EQ(msgs[i].inContainer, 1);
+		CHECK_MEM(msgs[i].data, m[i].data, m[i].length-1-4);
+	}
+
+	// now Base reads it, every record is a message of its own
+	gotCount = 0;
+	ctrl_stack_recv(frame, frameLen);
+	CHECK_EQ(gotCount, 6);
+	for(i=0; i<gotCount; i++)
+	{
+		CHECK_EQ(gotLen[i], lengths[i]);
+		CHECK_EQ(gotTX[i], i+1);
+		CHECK_MEM(got[i], data[i], lengths[i]);
+	}
+
+	// and acknowledges all of them in one container
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 6);
+	CHECK_EQ(serverFrames, 2);
+	CHECK_EQ(serverContainers, 2);
+	for(i=0; i<n; i++)
+	{
+		CHECK_EQ(msgs[i].header, CH_ACK | CH_PROCESSED | CH_SAVE_TXSERVER);
+		CHECK_EQ(msgs[i].TXsender, i+1);
+		CHECK_EQ(msgs[i].inContainer, 1);
+	}
+}
+
+// records take at most CTRL_CONTAINER_DATA_SIZE bytes, a single message or no support sends them one by one
+static void test_limits(void)
+{
+	static char data[2][SERVER_DATA_MAX];
+	tCtrlMessage m[2];
+	unsigned short lengths[2];
+	unsigned n;
+
+	server_connect(&callbacks, 0, CTRL_CAP_CONTAINER);
+
+	// two records of [LENGTH 2][HEADER 1][TXsender 4][DATA] that take exactly all of it
+	lengths[0] = 100;
+	lengths[1] = CTRL_CONTAINER_DATA_SIZE - 2*(2+1+4) - lengths[0];
+	make_messages(m, data, 2, 1, lengths);
+	CHECK_EQ(ctrl_stack_send_container(m, 2), 0);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK_EQ(serverContainers, 1);
+	CHECK_EQ(msgs[1].length, 1+4+lengths[1]);
+	CHECK_MEM(msgs[1].data, data[1], lengths[1]);
+
+	// one byte more doesn't fit, nothing is sent
+	lengths[1]++;
+	make_messages(m, data, 2, 1, lengths);
+	CHECK_EQ(ctrl_stack_send_container(m, 2), 1);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 0);
+
+	// single message is sent as it is
+	CHECK_EQ(ctrl_stack_send_container(m, 1), 0);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].inContainer, 0);
+
+	// Server without containers gets them one by one
+	server_connect(&callbacks, 0, 0);
+	lengths[1] = 10;
+	make_messages(m, data, 2, 1, lengths);
+	CHECK_EQ(ctrl_stack_send_container(m, 2), 0);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK_EQ(serverContainers, 0);
+	CHECK_EQ(serverFrames, 2);
+}
+
+// appends record to container data being built in "data"
+static unsigned short add_record(char *data, unsigned short len, unsigned short length, char header, unsigned long TXsender, const char *recordData)
+{
+	os_memcpy(data+len, &length, 2);
+	data[len+2] = header;
+	os_memcpy(data+len+3, &TXsender, 4);
+	if(length > 1+4)
+	{
+		os_memcpy(data+len+7, recordData, length-1-4);
+	}
+	return len+7+(length-1-4);
+}
+
+// malformed record ends the container, records before it are processed
+static void test_malformed(void)
+{
+	char data[256];
+	char frame[512];
+	unsigned short len, frameLen;
+
+	server_connect(&callbacks, 0, CTRL_CAP_CONTAINER);
+
+	// last record claims more than there is
+	data[0] = SYSTEM_MESSAGE_CONTAINER;
+	len = add_record(data, 1, 1+4+3, 0, 1, "one");
+	len = add_record(data, len, 1+4+3, 0, 2, "two");
+	unsigned short truncated = 1+4+20;
+	os_memcpy(data+len, &truncated, 2);
+	data[len+2] = 0;
+	os_memcpy(data+len+3, &(unsigned long){3}, 4);
+	os_memcpy(data+len+7, "three", 5);
+	len += 7+5;
+
+	gotCount = 0;
+	frameLen = server_frame(frame, CH_SYSTEM_MESSAGE | CH_NOTIFICATION, 0, data, len);
+	ctrl_stack_recv(frame, frameLen);
+	CHECK_EQ(gotCount, 2);
+	CHECK_MEM(got[0], "one", 3);
+	CHECK_MEM(got[1], "two", 3);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 2);
+
+	// record too short to have a header, and a tail too short to be a record
+	len = add_record(data, 1, 1+4+5, 0, 3, "three");
+	unsigned short tooShort = 4;
+	os_memcpy(data+len, &tooShort, 2);
+	os_memset(data+len+2, 0, 10);
+	len += 12;
+
+	gotCount = 0;
+	frameLen = server_frame(frame, CH_SYSTEM_MESSAGE | CH_NOTIFICATION, 0, data, len);
+	ctrl_stack_recv(frame, frameLen);
+	CHECK_EQ(gotCount, 1);
+	CHECK_MEM(got[0], "three", 5);
+
+	len = add_record(data, 1, 1+4+4, 0, 4, "four");
+	os_memset(data+len, 0xFF, 6);
+	len += 6;
+
+	gotCount = 0;
+	frameLen = server_frame(frame, CH_SYSTEM_MESSAGE | CH_NOTIFICATION, 0, data, len);
+	ctrl_stack_recv(frame, frameLen);
+	CHECK_EQ(gotCount, 1);
+	CHECK_MEM(got[0], "four", 4);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 2);
+
+	// containers don't nest, the one inside is skipped
+	char inner[32];
+	unsigned short innerLen = add_record(inner, 1, 1+4+3, 0, 5, "bad");
+	inner[0] = SYSTEM_MESSAGE_CONTAINER;
+	len = add_record(data, 1, 1+4+(innerLen), CH_SYSTEM_MESSAGE | CH_NOTIFICATION, 0, inner);
+	len = add_record(data, len, 1+4+4, 0, 5, "five");
+
+	gotCount = 0;
+	frameLen = server_frame(frame, CH_SYSTEM_MESSAGE | CH_NOTIFICATION, 0, data, len);
+	ctrl_stack_recv(frame, frameLen);
+	CHECK_EQ(gotCount, 1);
+	CHECK_EQ(gotTX[0], 5);
+	CHECK_MEM(got[0], "five", 4);
+}
+
+// ACKs to all messages of a segment go out together, CTRL_CONTAINER_MAX_RECORDS in a container at most
+static void test_ack_batching(void)
+{
+	static char data[20][SERVER_DATA_MAX];
+	static const unsigned short lengths[20] = { 1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1 };
+	tCtrlMessage m[20];
+	char segment[4096];
+	unsigned short len = 0;
+	unsigned n, i;
+
+	// in a container
+	server_connect(&callbacks, 0, CTRL_CAP_CONTAINER);
+	make_messages(m, data, 20, 1, lengths);
+	len = server_container(segment, m, 20);
+
+	gotCount = 0;
+	ctrl_stack_recv(segment, len);
+	CHECK_EQ(gotCount, 20);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 20);
+	CHECK_EQ(serverFrames, 2);
+	CHECK_EQ(serverContainers, 2);
+	for(i=0; i<n; i++)
+	{
+		CHECK_EQ(msgs[i].TXsender, 1+i);
+		CHECK_EQ(msgs[i].header, CH_ACK | CH_PROCESSED | CH_SAVE_TXSERVER);
+	}
+
+	// in separate frames of one segment
+	len = 0;
+	make_messages(m, data, 5, 21, lengths);
+	for(i=0; i<5; i++)
+	{
+		len += server_frame(segment+len, 0, m[i].TXsender, m[i].data, 1);
+	}
+	gotCount = 0;
+	ctrl_stack_recv(segment, len);
+	CHECK_EQ(gotCount, 5);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 5);
+	CHECK_EQ(serverFrames, 3);
+
+	// without containers every ACK is a frame of its own
+	server_connect(&callbacks, 0, 0);
+	len = 0;
+	for(i=0; i<5; i++)
+	{
+		len += server_frame(segment+len, 0, 1+i, "x", 1);
+	}
+	ctrl_stack_recv(segment, len);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 5);
+	CHECK_EQ(serverFrames, 5);
+	CHECK_EQ(serverContainers, 0);
+}
+
+int main(void)
+{
+	srand(13);
+
+	test_round_trip();
+	test_limits();
+	test_malformed();
+	test_ack_batching();
+
+	return test_done("test_stack_container");
+}
@@ -0,0 +1,287 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+
+#include "../ctrl/include/ctrl_stack.h"
+#include "../ctrl/include/ctrl_rxpool.h"
+
+#include "test.h"
+#include "server.h"
+
+/*
+	Reorder buffer: messages from Server that arrive a bit early are held until the ones before them
+	arrive, and answered OUT_OF_SYNC only when the gap doesn't fill in time or they are too far ahead.
+	Ends with a simulation of a link that reorders and loses messages, it reports how many of them
+	Server had to send again.
+*/
+
+#define GOT_MAX	1024
+
+static tServerMsg msgs[SERVER_MSGS_MAX];
+static unsigned long gotTX[GOT_MAX];
+static unsigned gotCount;
+static unsigned outOfOrder; // messages app got out of order
+
+static unsigned char message_received(tCtrlMessage *msg)
+{
+	char data[20];
+	os_sprintf(data, "msg %u", msg->TXsender);
+	CHECK_EQ(msg->length, 1+4+os_strlen(data));
+	CHECK_MEM(msg->data, data, os_strlen(data));
+
+	if(gotCount > 0 && msg->TXsender != gotTX[(gotCount-1) % GOT_MAX]+1)
+	{
+		outOfOrder++;
+	}
+	gotTX[gotCount % GOT_MAX] = msg->TXsender;
+	gotCount++;
+	return 0;
+}
+
+static tCtrlCallbacks callbacks = { message_received, NULL, server_sink, NULL };
+
+static void send_message(unsigned long TXsender)
+{
+	char data[20];
+	os_sprintf(data, "msg %u", TXsender);
+	server_send(0, TXsender, data, os_strlen(data));
+}
+
+static unsigned char is_ack(tServerMsg *msg, unsigned char header, unsigned long TXsender)
+{
+	return msg->header == header && msg->TXsender == TXsender;
+}
+
+#define ACK_PROCESSED	(CH_ACK | CH_PROCESSED | CH_SAVE_TXSERVER)
+
+static void connect(void)
+{
+	server_connect(&callbacks, 0, 0);
+	gotCount = 0;
+	outOfOrder = 0;
+}
+
+// held messages are processed and acknowledged in order as soon as the gap fills
+static void test_hold(void)
+{
+	tRxPoolStats stats;
+	unsigned n;
+
+	connect();
+	send_message(3);
+	send_message(2);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 0);
+	CHECK_EQ(gotCount, 0);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 2);
+
+	send_message(1);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 3);
+	CHECK(is_ack(&msgs[0], ACK_PROCESSED, 1));
+	CHECK(is_ack(&msgs[1], ACK_PROCESSED, 2));
+	CHECK(is_ack(&msgs[2], ACK_PROCESSED, 3));
+	CHECK_EQ(gotCount, 3);
+	CHECK_EQ(outOfOrder, 0);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+
+	// re-transmission of a held message is held once
+	send_message(5);
+	send_message(5);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 0);
+	send_message(4);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK(is_ack(&msgs[0], ACK_PROCESSED, 4));
+	CHECK(is_ack(&msgs[1], ACK_PROCESSED, 5));
+	CHECK_EQ(gotCount, 5);
+
+	// gap fills only partially, the rest waits
+	send_message(8);
+	send_message(7);
+	send_message(6);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 3);
+	CHECK(is_ack(&msgs[2], ACK_PROCESSED, 8));
+	CHECK_EQ(outOfOrder, 0);
+
+	// held messages are dropped with the connection
+	send_message(10);
+	connect();
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 0);
+}
+
+// gap doesn't fill in time, or messages are too far ahead: OUT_OF_SYNC like without the buffer
+static void test_reject(void)
+{
+	tRxPoolStats stats;
+	unsigned n;
+
+	connect();
+	send_message(1);
+	send_message(3);
+	send_message(4);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	test_time_advance(TMR_REORDER_MS-1);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 0);
+	test_time_advance(1);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK(is_ack(&msgs[0], CH_ACK | CH_OUT_OF_SYNC, 3));
+	CHECK(is_ack(&msgs[1], CH_ACK | CH_OUT_OF_SYNC, 4));
+	CHECK_EQ(gotCount, 1);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+
+	// they are taken when Server sends them again in order
+	send_message(2);
+	send_message(3);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK(is_ack(&msgs[1], ACK_PROCESSED, 3));
+
+	// no more than CTRL_REORDER_SLOTS ahead of the next expected one
+	send_message(3+1+CTRL_REORDER_SLOTS+1);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK(is_ack(&msgs[0], CH_ACK | CH_OUT_OF_SYNC, 3+1+CTRL_REORDER_SLOTS+1));
+	send_message(3+1+CTRL_REORDER_SLOTS);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 0);
+
+	// the gap fills, all of them are taken in order
+	send_message(4);
+	send_message(5);
+	send_message(6);
+	send_message(7);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 5);
+	CHECK(is_ack(&msgs[4], ACK_PROCESSED, 3+1+CTRL_REORDER_SLOTS));
+	CHECK_EQ(gotCount, 3+1+CTRL_REORDER_SLOTS);
+	CHECK_EQ(outOfOrder, 0);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+	CHECK_EQ(testHeapBlocks, 0);
+}
+
+/*
+	Server sends "count" messages, at most "window" of them unacknowledged. The link swaps neighbours
+	with "reorderPct" probability and loses messages with "lossPct" probability. Server sends again
+	everything unprocessed when Base says OUT_OF_SYNC, or when it hears nothing for a while.
+	Returns how many messages were sent again.
+*/
+static unsigned simulate(unsigned long count, unsigned window, unsigned reorderPct, unsigned lossPct)
+{
+	unsigned long processed = 0; // Server's view, everything up to here is processed
+	unsigned long sentMax = 0;
+	unsigned resent = 0;
+	unsigned char goBack = 0;
+	unsigned rounds = 0;
+
+	connect();
+
+	while(processed < count && rounds++ < 100000)
+	{
+		unsigned long batch[16];
+		unsigned n = 0, i;
+
+		if(goBack)
+		{
+			unsigned long TX;
+			for(TX=processed+1; TX<=sentMax; TX++)
+			{
+				batch[n++] = TX;
+			}
+			resent += n;
+			goBack = 0;
+		}
+		while(sentMax < count && sentMax < processed+window)
+		{
+			batch[n++] = ++sentMax;
+		}
+
+		for(i=0; i+1<n; i++)
+		{
+			if((unsigned)(rand() % 100) < reorderPct)
+			{
+				unsigned long tmp = batch[i];
+				batch[i] = batch[i+1];
+				batch[i+1] = tmp;
+				i++;
+			}
+		}
+		for(i=0; i<n; i++)
+		{
+			if((unsigned)(rand() % 100) >= lossPct)
+			{
+				send_message(batch[i]);
+			}
+		}
+
+		unsigned long before = processed;
+		unsigned char pass;
+		for(pass=0; pass<2 && processed == before && !goBack; pass++)
+		{
+			// nothing arrived yet, wait for the reorder timeout
+			if(pass == 1)
+			{
+				test_time_advance(TMR_REORDER_MS);
+			}
+
+			unsigned m = server_read(msgs, SERVER_MSGS_MAX);
+			for(i=0; i<m; i++)
+			{
+				if((msgs[i].header & CH_PROCESSED) && msgs[i].TXsender > processed)
+				{
+					processed = msgs[i].TXsender;
+				}
+				if(msgs[i].header & CH_OUT_OF_SYNC)
+				{
+					goBack = 1;
+				}
+			}
+		}
+
+		// Server's own timeout, everything it sent got lost
+		if(processed == before && !goBack)
+		{
+			goBack = 1;
+		}
+	}
+
+	CHECK_EQ(processed, count);
+	CHECK_EQ(gotCount, count);
+	CHECK_EQ(outOfOrder, 0);
+
+	printf("  %u messages, window %u, %u%% reordered, %u%% lost: %u sent again\n", count, window, reorderPct, lossPct, resent);
+	return resent;
+}
+
+static void test_simulation(void)
+{
+	// reordering within the buffer costs nothing
+	CHECK_EQ(simulate(1000, CTRL_REORDER_SLOTS, 0, 0), 0);
+	CHECK_EQ(simulate(1000, CTRL_REORDER_SLOTS, 10, 0), 0);
+	CHECK_EQ(simulate(1000, CTRL_REORDER_SLOTS, 50, 0), 0);
+
+	// lost ones are sent again together with those held after them
+	CHECK(simulate(1000, CTRL_REORDER_SLOTS, 10, 1) > 0);
+	simulate(1000, CTRL_REORDER_SLOTS, 10, 5);
+
+	// window wider than the buffer, after a loss messages too far ahead are rejected right away
+	simulate(1000, 2*CTRL_REORDER_SLOTS, 10, 1);
+}
+
+int main(void)
+{
+	srand(17);
+
+	test_hold();
+	test_reject();
+	test_simulation();
+
+	return test_done("test_stack_reorder");
+}
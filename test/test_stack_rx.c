@@ -0,0 +1,313 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+
+#include "../ctrl/include/ctrl_stack.h"
+#include "../ctrl/include/ctrl_rxpool.h"
+
+#include "test.h"
+#include "server.h"
+
+/*
+	Receiving side of ctrl_stack.c: frames split over TCP segments in every possible way are
+	reassembled (in rxBuff or on heap), and frames that can't be collected are skipped without
+	losing the ones after them. Data of frames that are only acknowledged is never decrypted.
+*/
+
+#define GOT_MAX	64
+
+static tServerMsg msgs[SERVER_MSGS_MAX];
+static char got[GOT_MAX][SERVER_DATA_MAX];
+static unsigned short gotLen[GOT_MAX];
+static unsigned long gotTX[GOT_MAX];
+static unsigned gotCount;
+
+static unsigned char message_received(tCtrlMessage *msg)
+{
+	CHECK(gotCount < GOT_MAX);
+	if(gotCount < GOT_MAX)
+	{
+		gotLen[gotCount] = msg->length-1-4;
+		gotTX[gotCount] = msg->TXsender;
+		os_memcpy(got[gotCount], msg->data, msg->length-1-4);
+		gotCount++;
+	}
+	return 0;
+}
+
+static unsigned ackedCount;
+static unsigned ackedWithData; // ACKs handed over with data, there should be none
+
+static void message_acked(tCtrlMessage *msg)
+{
+	ackedCount++;
+	if(msg->data != NULL)
+	{
+		ackedWithData++;
+	}
+}
+
+static tCtrlCallbacks callbacks = { message_received, message_acked, server_sink, NULL };
+
+static char stream[32768];
+static unsigned streamLen;
+static char payload[GOT_MAX][SERVER_DATA_MAX];
+static unsigned short payloadLen[GOT_MAX];
+
+// lengths that put frames into rxBuff, exactly fill it, and go over it onto heap
+static const unsigned short lengths[] = { 0, 1, 9, 10, 11, 27, 121, 122, 200, 470, 471, 487, 488, 600, 1000 };
+#define LENGTHS_COUNT	(sizeof(lengths)/sizeof(lengths[0]))
+
+// builds all test frames one after another into stream, "first" is TXsender of the first one
+static void build_stream(unsigned long first, unsigned char notification)
+{
+	unsigned i, j;
+
+	streamLen = 0;
+	for(i=0; i<LENGTHS_COUNT; i++)
+	{
+		payloadLen[i] = lengths[i];
+		for(j=0; j<lengths[i]; j++)
+		{
+			payload[i][j] = rand();
+		}
+		streamLen += server_frame(stream+streamLen, notification ? CH_NOTIFICATION : 0, notification ? 0 : first+i, payload[i], lengths[i]);
+	}
+}
+
+static void check_delivered(unsigned long first, unsigned char notification)
+{
+	unsigned i;
+
+	CHECK_EQ(gotCount, LENGTHS_COUNT);
+	for(i=0; i<gotCount && i<LENGTHS_COUNT; i++)
+	{
+		CHECK_EQ(gotLen[i], payloadLen[i]);
+		CHECK_EQ(gotTX[i], notification ? 0 : first+i);
+		CHECK_MEM(got[i], payload[i], payloadLen[i]);
+	}
+
+	// every frame that isn't a notification is acknowledged as processed, with TXserver to save
+	if(!notification)
+	{
+		unsigned n = server_read(msgs, SERVER_MSGS_MAX);
+		CHECK_EQ(n, LENGTHS_COUNT);
+		for(i=0; i<n && i<LENGTHS_COUNT; i++)
+		{
+			CHECK_EQ(msgs[i].header, CH_ACK | CH_PROCESSED | CH_SAVE_TXSERVER);
+			CHECK_EQ(msgs[i].TXsender, first+i);
+		}
+	}
+}
+
+// feeds stream to Base in segments of "segment" bytes, 0 = random lengths
+static void feed(unsigned segment)
+{
+	unsigned pos = 0;
+	while(pos < streamLen)
+	{
+		unsigned len = segment ? segment : 1 + rand() % 700;
+		if(len > streamLen-pos)
+		{
+			len = streamLen-pos;
+		}
+		ctrl_stack_recv(stream+pos, len);
+		pos += len;
+	}
+}
+
+static void test_segments(void)
+{
+	static const unsigned segments[] = { 16384, 1, 2, 3, 17, 48, 511, 512, 513 };
+	unsigned long TXserver = 0;
+	unsigned i;
+
+	server_connect(&callbacks, 0, 0);
+	unsigned heapBlocks = testHeapBlocks;
+
+	for(i=0; i<sizeof(segments)/sizeof(segments[0]); i++)
+	{
+		build_stream(TXserver+1, 0);
+		gotCount = 0;
+		feed(segments[i]);
+		check_delivered(TXserver+1, 0);
+		TXserver += LENGTHS_COUNT;
+	}
+
+	for(i=0; i<50; i++)
+	{
+		build_stream(TXserver+1, 0);
+		gotCount = 0;
+		feed(0);
+		check_delivered(TXserver+1, 0);
+		TXserver += LENGTHS_COUNT;
+	}
+
+	CHECK_EQ(testHeapBlocks, heapBlocks);
+}
+
+// frame longer than rxBuff that doesn't get heap is skipped, the next one arrives fine
+static void test_out_of_memory(void)
+{
+	char frame[2048];
+	char data[SERVER_DATA_MAX];
+	unsigned short len;
+
+	server_connect(&callbacks, 0, 0);
+	unsigned heapBlocks = testHeapBlocks;
+
+	os_memset(data, 0x5A, sizeof(data));
+	len = server_frame(frame, CH_NOTIFICATION, 0, data, 900);
+	len += server_frame(frame+len, CH_NOTIFICATION, 0, "after", 5);
+
+	gotCount = 0;
+	testMallocFail = 1;
+	ctrl_stack_recv(frame, 100);
+	CHECK_EQ(testMallocFail, 0);
+	ctrl_stack_recv(frame+100, 500);
+	ctrl_stack_recv(frame+600, len-600);
+	CHECK_EQ(gotCount, 1);
+	CHECK_EQ(gotLen[0], 5);
+	CHECK_MEM(got[0], "after", 5);
+	CHECK_EQ(testHeapBlocks, heapBlocks);
+}
+
+// ALL_LENGTH no valid frame has is skipped without collecting it, the next frame arrives fine
+static void test_invalid_length(void)
+{
+	static const unsigned short allLengths[] = { 0xFFFF, 0xFFFE, 0xFFFD, 0xFFF1 };
+	static char garbage[0x10000];
+	char frame[64];
+	unsigned short frameLen;
+	unsigned i;
+	unsigned long pos;
+
+	server_connect(&callbacks, 0, 0);
+	unsigned heapBlocks = testHeapBlocks;
+	frameLen = server_frame(frame, CH_NOTIFICATION, 0, "after", 5);
+
+	for(i=0; i<sizeof(allLengths)/sizeof(allLengths[0]); i++)
+	{
+		os_memset(garbage, 0xA5, sizeof(garbage));
+		os_memcpy(garbage, &allLengths[i], 2);
+
+		gotCount = 0;
+		ctrl_stack_recv(garbage, 1);
+		for(pos=1; pos<2+(unsigned long)allLengths[i]; pos+=1000)
+		{
+			unsigned short len = (2+allLengths[i]-pos < 1000) ? 2+allLengths[i]-pos : 1000;
+			ctrl_stack_recv(garbage+pos, len);
+			CHECK_EQ(testHeapBlocks, heapBlocks);
+		}
+		ctrl_stack_recv(frame, frameLen);
+
+		CHECK_EQ(gotCount, 1);
+		CHECK_MEM(got[0], "after", 5);
+	}
+}
+
+// frame that never arrives entirely is forgotten after a while
+static void test_data_expecter(void)
+{
+	char frame[2048];
+	char data[SERVER_DATA_MAX];
+	unsigned short len;
+
+	server_connect(&callbacks, 0, 0);
+	unsigned heapBlocks = testHeapBlocks;
+
+	os_memset(data, 0x5A, sizeof(data));
+	len = server_frame(frame, CH_NOTIFICATION, 0, data, 900);
+
+	gotCount = 0;
+	ctrl_stack_recv(frame, len-1);
+	CHECK_EQ(testHeapBlocks, heapBlocks+1);
+	test_time_advance(TMR_DATA_EXPECTER_MS);
+	CHECK_EQ(testHeapBlocks, heapBlocks);
+
+	len = server_frame(frame, CH_NOTIFICATION, 0, "after", 5);
+	ctrl_stack_recv(frame, len);
+	CHECK_EQ(gotCount, 1);
+	CHECK_MEM(got[0], "after", 5);
+}
+
+// frames whose data isn't used are not decrypted past their first block, and nobody gets their data
+static void test_undecrypted(void)
+{
+	tRxPoolStats stats;
+	unsigned long hits;
+	char data[40];
+	unsigned n;
+
+	os_memset(data, 0x5A, sizeof(data));
+	server_connect(&callbacks, 0, 0);
+	gotCount = 0;
+	ctrl_rxpool_get_stats(&stats);
+	hits = stats.hits;
+
+	// ACK
+	server_send(CH_ACK | CH_PROCESSED, 1, data, sizeof(data));
+	CHECK_EQ(ackedCount, 1);
+	CHECK_EQ(ackedWithData, 0);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.hits, hits);
+
+	// fresh message is, its re-transmission isn't
+	server_send(0, 1, data, sizeof(data));
+	CHECK_EQ(gotCount, 1);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.hits, hits+1);
+	server_send(0, 1, data, sizeof(data));
+	CHECK_EQ(gotCount, 1);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.hits, hits+1);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK_EQ(msgs[1].header, CH_ACK);
+
+	// too far ahead to be held
+	server_send(0, 2+1+CTRL_REORDER_SLOTS, data, sizeof(data));
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.hits, hits+1);
+
+	// ahead while Server is backed off, it sends it again anyway
+	ctrl_stack_backoff(1);
+	server_send(0, 3, data, sizeof(data));
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.hits, hits+1);
+	n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 2);
+	CHECK_EQ(msgs[1].header, CH_ACK | CH_BACKOFF);
+	CHECK_EQ(msgs[1].TXsender, 3);
+
+	// notifications and the next expected one are still taken while backed off
+	server_send(CH_NOTIFICATION, 0, data, sizeof(data));
+	server_send(0, 2, data, sizeof(data));
+	CHECK_EQ(gotCount, 3);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.hits, hits+3);
+
+	// once Server confirmed backoff and it is released, messages ahead are held (decrypted) again
+	server_send(CH_ACK | CH_BACKOFF, 0, NULL, 0);
+	CHECK_EQ(ctrl_stack_backoff(0), 0);
+	server_send(0, 4, data, sizeof(data));
+	server_send(0, 3, data, sizeof(data));
+	CHECK_EQ(gotCount, 5);
+	ctrl_rxpool_get_stats(&stats);
+	CHECK_EQ(stats.hits, hits+5);
+	CHECK_EQ(ackedWithData, 0);
+	server_read(msgs, SERVER_MSGS_MAX);
+}
+
+int main(void)
+{
+	srand(5);
+
+	test_segments();
+	test_out_of_memory();
+	test_invalid_length();
+	test_data_expecter();
+	test_undecrypted();
+
+	return test_done("test_stack_rx");
+}
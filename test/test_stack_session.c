@@ -0,0 +1,216 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+
+#include "../ctrl/include/ctrl_stack.h"
+
+#include "test.h"
+#include "server.h"
+
+/*
+	Session tickets: Base keeps the one Server issued in RTC memory and presents it on the
+	next authorization instead of going through the challenge. Server accepts it only with
+	a higher COUNTER than before and replies with SYSTEM_MESSAGE_SESSION_RESUMED.
+*/
+
+static tServerMsg msgs[SERVER_MSGS_MAX];
+static unsigned gotCount;
+static unsigned authCount;
+
+static unsigned char message_received(tCtrlMessage *msg)
+{
+	gotCount++;
+	return 0;
+}
+
+static void auth_response(void)
+{
+	authCount++;
+}
+
+static tCtrlCallbacks callbacks = { message_received, NULL, server_sink, auth_response };
+
+static void stored_ticket(tCtrlSessionTicket *stored)
+{
+	os_memcpy(stored, testRtcMem + CTRL_SESSION_TICKET_RTC_ADDR*4, sizeof(tCtrlSessionTicket));
+}
+
+static unsigned long frame_counter(const tServerMsg *msg)
+{
+	unsigned long counter = 0;
+	os_memcpy(&counter, msg->data+32, 4);
+	return counter;
+}
+
+// Base takes the next message from Server in order only when it restored TXserver
+static void check_txserver(unsigned long TXserver)
+{
+	unsigned got = gotCount;
+	server_send(0, TXserver+1, "data", 4);
+	CHECK_EQ(gotCount, got+1);
+	server_read(msgs, SERVER_MSGS_MAX);
+}
+
+// replies with what Server agrees to use, after Base told what it supports
+static void finish_capabilities(unsigned char capabilities)
+{
+	unsigned n = server_read(msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(n, 1);
+	CHECK_EQ(msgs[0].data[0], SYSTEM_MESSAGE_CAPABILITIES);
+
+	char reply[2] = { SYSTEM_MESSAGE_CAPABILITIES, capabilities };
+	server_send(CH_SYSTEM_MESSAGE | CH_NOTIFICATION, 0, reply, 2);
+	if(capabilities & CTRL_CAP_SESSION_TICKET)
+	{
+		server_issue_ticket();
+	}
+}
+
+// Server issues the ticket after authorization, Base keeps it in RTC memory
+static void test_issue(void)
+{
+	tCtrlSessionTicket stored;
+
+	os_memset(testRtcMem, 0, sizeof(testRtcMem));
+	server_connect(&callbacks, 0, CTRL_CAP_SESSION_TICKET);
+	CHECK_EQ(serverResumes, 0);
+	CHECK_EQ(gotCount, 0); // ticket is for the stack only
+
+	stored_ticket(&stored);
+	CHECK_EQ(stored.magic, CTRL_SESSION_TICKET_MAGIC);
+	CHECK_EQ(stored.counter, 0);
+	CHECK_MEM(stored.ticket, serverTicket, 16);
+
+	// first block the app may use is after the ticket
+	CHECK(RTCMEM_CTRL_SESSION_TICKET >= RTCMEM_USER_START);
+	CHECK(RTCMEM_APP_START <= RTCMEM_USER_END);
+}
+
+// next authorization presents the ticket, Server resumes the session without the challenge
+static void test_resume(void)
+{
+	tCtrlSessionTicket stored;
+	tServerMsg presented;
+	unsigned auths = authCount;
+
+	ctrl_stack_authorize(serverBaseid, serverKey, 0);
+
+	// counter is saved before the frame goes out
+	stored_ticket(&stored);
+	CHECK_EQ(stored.counter, 1);
+
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 1);
+	presented = msgs[0];
+	CHECK_EQ(presented.zeroKey, 1);
+	CHECK_EQ(presented.length, 1+4+52);
+	CHECK_MEM(presented.data, serverBaseid, 16);
+	CHECK_MEM(presented.data+16, serverTicket, 16);
+	CHECK_EQ(frame_counter(&presented), 1);
+	CHECK_EQ(server_resume_ok(&presented), 1);
+
+	unsigned long TXserver = 7;
+	char resumed[1+4];
+	resumed[0] = SYSTEM_MESSAGE_SESSION_RESUMED;
+	os_memcpy(resumed+1, &TXserver, 4);
+	server_send(CH_SYSTEM_MESSAGE, 0, resumed, sizeof(resumed));
+	CHECK_EQ(authCount, auths+1);
+
+	// no challenge response, capabilities come right away
+	finish_capabilities(0);
+	check_txserver(7);
+
+	// ticket is still good for the next authorization
+	stored_ticket(&stored);
+	CHECK_EQ(stored.magic, CTRL_SESSION_TICKET_MAGIC);
+
+	// recorded frame can't be replayed, nor can the proof be forged
+	CHECK_EQ(server_resume_ok(&presented), 0);
+	presented.data[32]++;
+	CHECK_EQ(server_resume_ok(&presented), 0);
+}
+
+// every presentation counts, also the ones that got no reply, Server accepts any higher counter
+static void test_counter(void)
+{
+	unsigned long counter;
+	unsigned i;
+
+	for(i=0; i<2; i++)
+	{
+		ctrl_stack_authorize(serverBaseid, serverKey, 0);
+		CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 1);
+		counter = frame_counter(&msgs[0]);
+		CHECK_EQ(counter, 2+i);
+	}
+
+	unsigned resumes = serverResumes;
+	ctrl_stack_authorize(serverBaseid, serverKey, 1);
+	server_handshake(0, 0, msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(serverResumes, resumes+1);
+	CHECK_EQ(serverTicketCounter, 4);
+	check_txserver(0); // SYNC in SESSION_RESUMED
+}
+
+// Server refused the ticket (it forgot it): Base goes through the challenge and drops the ticket
+static void test_refused(void)
+{
+	tCtrlSessionTicket stored;
+	unsigned resumes = serverResumes;
+	unsigned auths = authCount;
+
+	serverTicketValid = 0;
+	ctrl_stack_authorize(serverBaseid, serverKey, 0);
+	server_handshake(5, 0, msgs, SERVER_MSGS_MAX);
+	CHECK_EQ(serverResumes, resumes);
+	CHECK_EQ(authCount, auths+1);
+	check_txserver(5);
+
+	stored_ticket(&stored);
+	CHECK(stored.magic != CTRL_SESSION_TICKET_MAGIC);
+
+	// without a ticket it is the usual authorization
+	ctrl_stack_authorize(serverBaseid, serverKey, 0);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 1);
+	CHECK_EQ(msgs[0].length, 1+4+16);
+}
+
+// only SESSION_RESUMED resumes the session, a short reply of any other kind is not taken as TXserver
+static void test_marker(void)
+{
+	tCtrlSessionTicket stored;
+	unsigned auths;
+
+	server_connect(&callbacks, 0, CTRL_CAP_SESSION_TICKET);
+	auths = authCount;
+
+	ctrl_stack_authorize(serverBaseid, serverKey, 0);
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 1);
+	CHECK_EQ(msgs[0].length, 1+4+52);
+
+	unsigned long TXserver = 9;
+	server_send(0, 0, (char *)&TXserver, 4);
+	CHECK_EQ(authCount, auths);
+
+	// Base took it for a challenge and responded to it
+	CHECK_EQ(server_read(msgs, SERVER_MSGS_MAX), 1);
+	CHECK_EQ(msgs[0].zeroKey, 0);
+	CHECK_EQ(msgs[0].length, 1+4+32);
+	stored_ticket(&stored);
+	CHECK(stored.magic != CTRL_SESSION_TICKET_MAGIC);
+
+	server_send(0, 0, (char *)&TXserver, 4);
+	CHECK_EQ(authCount, auths+1);
+	finish_capabilities(0);
+	check_txserver(9);
+}
+
+int main(void)
+{
+	test_issue();
+	test_resume();
+	test_counter();
+	test_refused();
+	test_marker();
+
+	return test_done("test_stack_session");
+}
@@ -0,0 +1,182 @@
+#include "ets_sys.h"
+#include "osapi.h"
+#include "mem.h"
+
+#include "../ctrl/include/ctrl_stack.h"
+#include "../ctrl/include/ctrl_txpool.h"
+
+#include "test.h"
+#include "server.h"
+
+/*
+	Transmit pool: every size class serves the lengths it is meant for, falls over to the next class
+	when it is exhausted and to heap after the last one. Frames CTRL stack builds land in the class
+	ctrl_txpool.h promises for their data length.
+*/
+
+#define POOL_COUNT	(CTRL_TXPOOL_SMALL_COUNT + CTRL_TXPOOL_MEDIUM_COUNT + CTRL_TXPOOL_LARGE_COUNT)
+
+// returns which class "buff" came from (0 small, 1 medium, 2 large), 3 for heap
+static unsigned char class_of(char *buff, char * const *first)
+{
+	unsigned char i;
+	for(i=0; i<3; i++)
+	{
+		if(first[i] != NULL && buff >= first[i] && buff < first[i] + (i == 0 ? CTRL_TXPOOL_SMALL_SIZE*CTRL_TXPOOL_SMALL_COUNT : i == 1 ? CTRL_TXPOOL_MEDIUM_SIZE*CTRL_TXPOOL_MEDIUM_COUNT : CTRL_TXPOOL_LARGE_SIZE*CTRL_TXPOOL_LARGE_COUNT))
+		{
+			return i;
+		}
+	}
+	return 3;
+}
+
+static char *first[3];
+
+static void test_classes(void)
+{
+	char *buffs[POOL_COUNT+4];
+	tTxPoolStats stats;
+	unsigned i;
+
+	// first buffer of every class tells where the class is
+	first[0] = ctrl_txpool_alloc(1);
+	first[1] = ctrl_txpool_alloc(CTRL_TXPOOL_SMALL_SIZE+1);
+	first[2] = ctrl_txpool_alloc(CTRL_TXPOOL_MEDIUM_SIZE+1);
+	CHECK(first[0] != NULL && first[1] != NULL && first[2] != NULL);
+	CHECK_EQ((uintptr_t)first[0] % 16, 0);
+	CHECK_EQ((uintptr_t)first[1] % 16, 0);
+	CHECK_EQ((uintptr_t)first[2] % 16, 0);
+	ctrl_txpool_free(first[0]);
+	ctrl_txpool_free(first[1]);
+	ctrl_txpool_free(first[2]);
+
+	// smallest class that fits
+	buffs[0] = ctrl_txpool_alloc(CTRL_TXPOOL_SMALL_SIZE);
+	buffs[1] = ctrl_txpool_alloc(CTRL_TXPOOL_MEDIUM_SIZE);
+	buffs[2] = ctrl_txpool_alloc(CTRL_TXPOOL_LARGE_SIZE);
+	buffs[3] = ctrl_txpool_alloc(CTRL_TXPOOL_LARGE_SIZE+1);
+	CHECK_EQ(class_of(buffs[0], first), 0);
+	CHECK_EQ(class_of(buffs[1], first), 1);
+	CHECK_EQ(class_of(buffs[2], first), 2);
+	CHECK_EQ(class_of(buffs[3], first), 3);
+	CHECK_EQ(testHeapBlocks, 1);
+	for(i=0; i<4; i++)
+	{
+		ctrl_txpool_free(buffs[i]);
+	}
+	CHECK_EQ(testHeapBlocks, 0);
+
+	// exhausted small class falls over to medium, then large, then heap
+	for(i=0; i<POOL_COUNT+2; i++)
+	{
+		buffs[i] = ctrl_txpool_alloc(48);
+		CHECK(buffs[i] != NULL);
+		if(i < CTRL_TXPOOL_SMALL_COUNT)
+		{
+			CHECK_EQ(class_of(buffs[i], first), 0);
+		}
+		else if(i < CTRL_TXPOOL_SMALL_COUNT+CTRL_TXPOOL_MEDIUM_COUNT)
+		{
+			CHECK_EQ(class_of(buffs[i], first), 1);
+		}
+		else if(i < POOL_COUNT)
+		{
+			CHECK_EQ(class_of(buffs[i], first), 2);
+		}
+		else
+		{
+			CHECK_EQ(class_of(buffs[i], first), 3);
+		}
+	}
+
+	// no two of them are the same
+	unsigned j;
+	for(i=0; i<POOL_COUNT; i++)
+	{
+		for(j=i+1; j<POOL_COUNT; j++)
+		{
+			CHECK(buffs[i] != buffs[j]);
+		}
+	}
+
+	ctrl_txpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, POOL_COUNT);
+	CHECK_EQ(stats.highWater, POOL_COUNT);
+
+	// freed one is served again
+	ctrl_txpool_free(buffs[3]);
+	char *again = ctrl_txpool_alloc(10);
+	CHECK(again == buffs[3]);
+	buffs[3] = again;
+
+	for(i=0; i<POOL_COUNT+2; i++)
+	{
+		ctrl_txpool_free(buffs[i]);
+	}
+	ctrl_txpool_free(NULL);
+
+	ctrl_txpool_get_stats(&stats);
+	CHECK_EQ(stats.inUse, 0);
+	CHECK_EQ(stats.highWater, POOL_COUNT);
+	CHECK_EQ(stats.hits, 3 + 3 + POOL_COUNT + 1);
+	CHECK_EQ(stats.misses, 1 + 2);
+	CHECK_EQ(testHeapBlocks, 0);
+
+	// out of everything
+	for(i=0; i<POOL_COUNT; i++)
+	{
+		buffs[i] = ctrl_txpool_alloc(1);
+	}
+	testMallocFail = 1;
+	CHECK(ctrl_txpool_alloc(1) == NULL);
+	for(i=0; i<POOL_COUNT; i++)
+	{
+		ctrl_txpool_free(buffs[i]);
+	}
+}
+
+static unsigned short lastLen;
+static unsigned char lastClass;
+
+static char sink(char *data, unsigned short len)
+{
+	lastLen = len;
+	lastClass = class_of(data, first);
+	return server_sink(data, len);
+}
+
+// data lengths at the edges of the classes, as documented in ctrl_txpool.h
+static void test_frame_classes(void)
+{
+	static const struct {
+		unsigned short dataLen;
+		unsigned char class;
+	} edges[] = {
+		{ 0, 0 }, { 8, 0 }, { 9, 1 }, { 72, 1 }, { 73, 2 }, { 456, 2 }, { 457, 3 }
+	};
+	static tCtrlCallbacks callbacks = { NULL, NULL, sink, NULL };
+	char data[1024];
+	unsigned i;
+
+	os_memset(data, 0x33, sizeof(data));
+	server_connect(&callbacks, 0, 0);
+
+	for(i=0; i<sizeof(edges)/sizeof(edges[0]); i++)
+	{
+		CHECK_EQ(ctrl_stack_send(data, edges[i].dataLen, 1+i, 0), 0);
+		CHECK_EQ(lastClass, edges[i].class);
+		CHECK_EQ(lastLen, 2+(16*((23+edges[i].dataLen)/16)+16)+16);
+	}
+
+	// and ACKs take small ones
+	server_send(0, 1, "x", 1);
+	CHECK_EQ(lastClass, 0);
+}
+
+int main(void)
+{
+	test_classes();
+	test_frame_classes();
+
+	return test_done("test_txpool");
+}